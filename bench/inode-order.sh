@@ -0,0 +1,106 @@
+#!/bin/sh
+
+#/ Usage: bench/inode-order.sh [-d <dirs>] [-f <files>] [-n <runs>] [<sandbox-create> <sandbox-destroy>]
+#/ Time sandbox-create with and without -I from a cold cache.
+#/
+#/ A root filesystem holding <dirs> directories of <files> empty files
+#/ each is built on an ext4 image attached with losetup --direct-io=on,
+#/ so the host's page cache never holds it.  Every run mounts the image
+#/ afresh in its own mount namespace, pivots into it, and shallow copies
+#/ it, so nothing is cached but what that run reads.  Must be run as root.
+
+set -e
+
+usage() {
+	grep "^#/" "$0" | cut -c"4-" >&2
+	exit "$1"
+}
+
+DIRS=200 FILES=1000 RUNS=2
+while getopts "d:f:n:h" opt
+do
+	case "$opt" in
+		d) DIRS="$OPTARG";;
+		f) FILES="$OPTARG";;
+		n) RUNS="$OPTARG";;
+		h) usage 0;;
+		*) usage 1;;
+	esac
+done
+shift $(($OPTIND - 1))
+CREATE="${1:-$(which sandbox-create)}"
+DESTROY="${2:-$(which sandbox-destroy)}"
+[ -x "$CREATE" -a -x "$DESTROY" ] || usage 1
+
+TMP="$(mktemp -d)"
+trap "umount -q \"$TMP/root\" || true; losetup -d \"\$LOOP\" 2>/dev/null || true; rm -rf \"$TMP\"" EXIT
+truncate -s 1G "$TMP/img"
+mkfs.ext4 -q -N $(($DIRS * $FILES + 10000)) -F "$TMP/img"
+LOOP="$(losetup --direct-io=on --show -f "$TMP/img")"
+mkdir "$TMP/root"
+
+# Build the root: the host's /usr read-only for libraries, a few of the
+# directories sandbox-create expects, and the files to be walked.
+mount "$LOOP" "$TMP/root"
+(
+	cd "$TMP/root"
+	mkdir -p dev etc home mnt oldroot opt proc root srv tmp usr var
+	ln -s usr/bin bin
+	ln -s usr/lib lib
+	ln -s usr/lib64 lib64
+	ln -s usr/sbin sbin
+	cp "$CREATE" opt/sandbox-create
+	cp "$DESTROY" opt/sandbox-destroy
+	d=0
+	while [ $d -lt $DIRS ]
+	do
+		mkdir srv/$d
+		(cd srv/$d && seq 1 $FILES | xargs touch)
+		d=$(($d + 1))
+	done
+)
+umount "$TMP/root"
+
+cat >"$TMP/run.sh" <<EOF
+set -e
+mount --make-rprivate /
+mount "$LOOP" "$TMP/root"
+cd "$TMP/root"
+mount --bind /usr usr
+mount -o remount,bind,ro usr
+mount --rbind /dev dev
+mount -t proc proc proc
+pivot_root . oldroot
+umount -l /oldroot
+cd /
+START=\$(date +%s%N)
+/opt/sandbox-create -q "\$@" bench
+END=\$(date +%s%N)
+/opt/sandbox-destroy bench >/dev/null 2>&1
+echo \$(((\$END - \$START) / 1000000))
+EOF
+
+# Each run starts from an unmounted filesystem and empty caches.
+run() {
+	sync
+	echo 3 >/proc/sys/vm/drop_caches
+	unshare -m sh "$TMP/run.sh" "$@"
+}
+
+printf "%-8s %-16s %s\n" "jobs" "order" "ms"
+for JOBS in 1 4
+do
+	for ORDER in readdir inode
+	do
+		OPT=""
+		[ "$ORDER" = "inode" ] && OPT="-I"
+		TIMES=""
+		i=0
+		while [ $i -lt $RUNS ]
+		do
+			TIMES="$TIMES $(run -j $JOBS $OPT)"
+			i=$(($i + 1))
+		done
+		printf "%-8s %-16s%s\n" "-j $JOBS" "$ORDER" "$TIMES"
+	done
+done
@@ -0,0 +1,148 @@
+#include "../changes.h"
+#include "../message.h"
+#include "../sandbox.h"
+#include "../sudo.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+void usage(char *argv0) {
+	fprintf(stderr,
+		"Usage: %s [-s <number> | -t] [-q] [<name>]\n",
+		basename(argv0)
+	);
+}
+
+void help() {
+	fprintf(stderr,
+		"  -s <number>, --since=<number> list paths changed since number\n"
+		"  -t, --track              track changes until interrupted\n"
+		"  -q, --quiet              operate quietly\n"
+		"  -h, --help               show this help message\n"
+	);
+}
+
+int print(const char *path, int op, void *ptr) {
+	printf("%c %s\n", op, path);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	sudo(argc, argv);
+	message_init(*argv);
+
+	int track = 0;
+	const char *since = 0;
+	const char *optstring = "s:tqh";
+	static struct option longopts[] = {
+		{"since", 1, 0, 0},
+		{"track", 0, 0, 0},
+		{"quiet", 0, 0, 0},
+		{"help", 0, 0, 0},
+		{0, 0, 0, 0}
+	};
+	int c = -1, longindex = 0;
+	while (-1 != (c = getopt_long(
+		argc, argv, optstring, longopts, &longindex
+	))) {
+		switch (c) {
+		case 0:
+			switch (longindex) {
+			case 0: /* --since */
+				since = optarg;
+				break;
+			case 1: /* --track */
+				track = 1;
+				break;
+			case 2: /* --quiet */
+				message_quiet_default(1);
+				message_quiet(1);
+				break;
+			case 3: /* --help */
+				usage(*argv);
+				help();
+				exit(0);
+			}
+			break;
+		case 's': /* -s */
+			since = optarg;
+			break;
+		case 't': /* -t */
+			track = 1;
+			break;
+		case 'q': /* -q */
+			message_quiet_default(1);
+			message_quiet(1);
+			break;
+		case 'h': /* -h */
+			usage(*argv);
+			help();
+			exit(0);
+			break;
+		case '?':
+			usage(*argv);
+			exit(1);
+			break;
+		}
+	}
+	const char *name;
+	switch (argc - optind) {
+	case 0:
+		name = "/";
+		break;
+	case 1:
+		name = argv[optind];
+		break;
+	default:
+		usage(*argv);
+		exit(1);
+		break;
+	}
+	if (track && since) {
+		usage(*argv);
+		exit(1);
+	}
+	if (!sandbox_valid(name)) {
+		message_loud("invalid sandbox name %s\n", name);
+		exit(1);
+	}
+
+	int result = -1;
+	char pathname[PATH_MAX];
+	if (track) { result = sandbox_track(name); }
+	else if (!sandbox_changes(name, pathname)) {
+
+		/* Without a number, print the latest, to pass back later.
+		 */
+		uint64_t seq;
+		if (since) {
+			char *end;
+			errno = 0;
+			seq = strtoull(since, &end, 10);
+			if (errno || !*since || *end) {
+				message_loud("invalid number %s\n", since);
+				exit(1);
+			}
+			result = changes_since(pathname, seq, print, 0);
+		}
+		else if (!(result = changes_current(pathname, &seq))) {
+			printf("%" PRIu64 "\n", seq);
+		}
+		if (result && ESTALE == errno && since) {
+			message("changes to sandbox %s since %s aren't known\n",
+				name, since);
+		}
+		else if (result && ESTALE == errno) {
+			message("changes to sandbox %s aren't being tracked\n", name);
+		}
+	}
+
+	message_free();
+	return result;
+}
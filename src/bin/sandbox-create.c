@@ -1,3 +1,4 @@
+#include "../dir.h"
 #include "../message.h"
 #include "../sandbox.h"
 #include "../sudo.h"
@@ -10,15 +11,28 @@
 
 void usage(char *argv0) {
 	fprintf(stderr,
-		"Usage: %s [-q] <name>\n",
+		"Usage: %s [-j <jobs>] [-I] [-L] [-B <backend>] [-q]"
+		" <name>...\n",
 		basename(argv0)
 	);
 }
 
 void help() {
 	fprintf(stderr,
-		"  -q, --quiet operate quietly\n"
-		"  -h, --help  show this help message\n"
+		"  -j <jobs>, --jobs=<jobs> walk with this many threads (defaults to\n"
+		"                           the number of processors)\n"
+		"  -I, --inode-order        visit files in inode order (for cold\n"
+		"                           caches)\n"
+		"  -L, --lazy               fill /etc, /root, and /home as they're\n"
+		"                           used rather than up front\n"
+		"  -B <backend>, --backend=<backend>\n"
+		"                           keep the sandbox by hard linking\n"
+		"                           (`hardlink`), sharing extents\n"
+		"                           (`reflink`), served whole by sandboxfs\n"
+		"                           (`sandboxfs`), or with overlayfs\n"
+		"                           (`overlay`)\n"
+		"  -q, --quiet              operate quietly\n"
+		"  -h, --help               show this help message\n"
 	);
 }
 
@@ -26,8 +40,12 @@ int main(int argc, char **argv) {
 	sudo(argc, argv);
 	message_init(*argv);
 
-	const char *optstring = "qh";
+	const char *optstring = "j:ILB:qh";
 	static struct option longopts[] = {
+		{"jobs", 1, 0, 0},
+		{"inode-order", 0, 0, 0},
+		{"lazy", 0, 0, 0},
+		{"backend", 1, 0, 0},
 		{"quiet", 0, 0, 0},
 		{"help", 0, 0, 0},
 		{0, 0, 0, 0}
@@ -39,16 +57,40 @@ int main(int argc, char **argv) {
 		switch (c) {
 		case 0:
 			switch (longindex) {
-			case 0: /* --quiet */
+			case 0: /* --jobs */
+				dir_workers(atoi(optarg));
+				break;
+			case 1: /* --inode-order */
+				dir_inode_order();
+				break;
+			case 2: /* --lazy */
+				sandbox_lazy(1);
+				break;
+			case 3: /* --backend */
+				if (sandbox_backend(optarg)) { exit(1); }
+				break;
+			case 4: /* --quiet */
 				message_quiet_default(1);
 				message_quiet(1);
 				break;
-			case 1: /* --help */
+			case 5: /* --help */
 				usage(*argv);
 				help();
 				exit(0);
 			}
 			break;
+		case 'j': /* -j */
+			dir_workers(atoi(optarg));
+			break;
+		case 'I': /* -I */
+			dir_inode_order();
+			break;
+		case 'L': /* -L */
+			sandbox_lazy(1);
+			break;
+		case 'B': /* -B */
+			if (sandbox_backend(optarg)) { exit(1); }
+			break;
 		case 'q': /* -q */
 			message_quiet_default(1);
 			message_quiet(1);
@@ -64,22 +106,19 @@ int main(int argc, char **argv) {
 			break;
 		}
 	}
-	char *name;
-	switch (argc - optind) {
-	case 1:
-		name = argv[optind];
-		break;
-	default:
+	if (argc == optind) {
 		usage(*argv);
 		exit(1);
-		break;
 	}
-	if (!sandbox_valid(name)) {
-		message_loud("invalid sandbox name %s\n", name);
-		exit(1);
+	int i;
+	for (i = optind; i < argc; ++i) {
+		if (!sandbox_valid(argv[i])) {
+			message_loud("invalid sandbox name %s\n", argv[i]);
+			exit(1);
+		}
 	}
 
-	int result = sandbox_create(name);
+	int result = sandbox_create_many((const char **)&argv[optind]);
 
 	message_free();
 	return result;
@@ -0,0 +1,86 @@
+#include "../dedup.h"
+#include "../message.h"
+#include "../sandbox.h"
+#include "../sudo.h"
+
+#include <getopt.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+void usage(char *argv0) {
+	fprintf(stderr,
+		"Usage: %s [-r <rate>] [-q]\n",
+		basename(argv0)
+	);
+}
+
+void help() {
+	fprintf(stderr,
+		"  -r <rate>, --rate=<rate> read no more than this many megabytes\n"
+		"                           per second (defaults to no limit)\n"
+		"  -q, --quiet              operate quietly\n"
+		"  -h, --help               show this help message\n"
+	);
+}
+
+int main(int argc, char **argv) {
+	sudo(argc, argv);
+	message_init(*argv);
+
+	const char *optstring = "r:qh";
+	static struct option longopts[] = {
+		{"rate", 1, 0, 0},
+		{"quiet", 0, 0, 0},
+		{"help", 0, 0, 0},
+		{0, 0, 0, 0}
+	};
+	int c = -1, longindex = 0;
+	while (-1 != (c = getopt_long(
+		argc, argv, optstring, longopts, &longindex
+	))) {
+		switch (c) {
+		case 0:
+			switch (longindex) {
+			case 0: /* --rate */
+				dedup_rate(strtoul(optarg, 0, 10) << 20);
+				break;
+			case 1: /* --quiet */
+				message_quiet_default(1);
+				message_quiet(1);
+				break;
+			case 2: /* --help */
+				usage(*argv);
+				help();
+				exit(0);
+			}
+			break;
+		case 'r': /* -r */
+			dedup_rate(strtoul(optarg, 0, 10) << 20);
+			break;
+		case 'q': /* -q */
+			message_quiet_default(1);
+			message_quiet(1);
+			break;
+		case 'h': /* -h */
+			usage(*argv);
+			help();
+			exit(0);
+			break;
+		case '?':
+			usage(*argv);
+			exit(1);
+			break;
+		}
+	}
+	if (argc != optind) {
+		usage(*argv);
+		exit(1);
+	}
+
+	int result = sandbox_dedup();
+
+	message_free();
+	return result;
+}
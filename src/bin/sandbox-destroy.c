@@ -1,3 +1,4 @@
+#include "../dir.h"
 #include "../message.h"
 #include "../sandbox.h"
 #include "../sudo.h"
@@ -10,15 +11,17 @@
 
 void usage(char *argv0) {
 	fprintf(stderr,
-		"Usage: %s [-q] <name>\n",
+		"Usage: %s [-j <jobs>] [-q] <name>\n",
 		basename(argv0)
 	);
 }
 
 void help() {
 	fprintf(stderr,
-		"  -q, --quiet operate quietly\n"
-		"  -h, --help  show this help message\n"
+		"  -j <jobs>, --jobs=<jobs> walk with this many threads (defaults to\n"
+		"                           the number of processors)\n"
+		"  -q, --quiet              operate quietly\n"
+		"  -h, --help               show this help message\n"
 	);
 }
 
@@ -26,8 +29,9 @@ int main(int argc, char **argv) {
 	sudo(argc, argv);
 	message_init(*argv);
 
-	const char *optstring = "qh";
+	const char *optstring = "j:qh";
 	static struct option longopts[] = {
+		{"jobs", 1, 0, 0},
 		{"quiet", 0, 0, 0},
 		{"help", 0, 0, 0},
 		{0, 0, 0, 0}
@@ -39,16 +43,22 @@ int main(int argc, char **argv) {
 		switch (c) {
 		case 0:
 			switch (longindex) {
-			case 0: /* --quiet */
+			case 0: /* --jobs */
+				dir_workers(atoi(optarg));
+				break;
+			case 1: /* --quiet */
 				message_quiet_default(1);
 				message_quiet(1);
 				break;
-			case 1: /* --help */
+			case 2: /* --help */
 				usage(*argv);
 				help();
 				exit(0);
 			}
 			break;
+		case 'j': /* -j */
+			dir_workers(atoi(optarg));
+			break;
 		case 'q': /* -q */
 			message_quiet_default(1);
 			message_quiet(1);
@@ -9,11 +9,16 @@
 
 #define FUSE_USE_VERSION 26
 
+#include "../file.h"
+#include "../lazy.h"
+#include "../rules.h"
+
 #include <dirent.h>
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,6 +31,11 @@
 
 static char *_shadow = 0;
 
+/* The shadow directory and the trees its lazy directories are filled
+ * from, or a null pointer if it has none.
+ */
+static struct lazy *_lazy = 0;
+
 /* Deep copy the file at the given pathname.  If fd is not negative and
  * flags are non-zero, fd will be made to refer to the the new deep copy.
  */
@@ -52,14 +62,9 @@ int _deepcopy(const char *pathname, int fd, int flags) {
 	errno = 0;
 	if (0 > (deep_fd = mkstemp(template))) { goto error; }
 
-	/* Buffered file copy. */
+	/* Copy the data, sharing extents if the filesystem can. */
 	if (0 > (shallow_fd = open(pathname, O_RDONLY))) { goto error; }
-	char buf[4096];
-	ssize_t len;
-	while (0 < (len = read(shallow_fd, buf, 4096))) {
-		if (0 > write(deep_fd, buf, len)) { goto error; }
-	}
-	if (0 > len) { goto error; }
+	if (file_copyfd(shallow_fd, deep_fd)) { goto error; }
 
 	/* Move the deep copy into place. */
 	if (rename(template, pathname)) { goto error; }
@@ -85,6 +90,17 @@ error:
 	return -errno;
 }
 
+/* Fill any lazy directories along pathname, and pathname itself if self is
+ * non-zero, as root.  Anything that's looked up, listed, or changed must
+ * be filled first so it looks as though the whole tree had been copied.
+ */
+int _fill(const char *pathname, int self) {
+	if (!_lazy) { return 0; }
+	if (0 > setfsgid(0) || 0 > setfsuid(0)) { return -EINVAL; }
+	if (lazy_fill(_lazy, pathname, self)) { return -EIO; }
+	return 0;
+}
+
 int _unroot() {
 	struct fuse_context *context = fuse_get_context();
 	if (0 > setfsgid(context->gid)) { return -EINVAL; }
@@ -104,6 +120,8 @@ void sandboxfs_destroy(void *ptr) {
 
 int sandboxfs_access(const char *pathname, int mode) {
 	fprintf(stderr, "[sandboxfs] access pathname: %s, mode: %o\n", pathname, mode);
+	int result = _fill(pathname, 0);
+	if (result) { return result; }
 	_unroot();
 	if (access(pathname, mode)) { return -errno; }
 	return 0;
@@ -119,6 +137,8 @@ int sandboxfs_bmap(const char *pathname, size_t size, uint64_t *index) {
 
 int sandboxfs_chmod(const char *pathname, mode_t mode) {
 	fprintf(stderr, "[sandboxfs] chmod pathname: %s, mode: %o\n", pathname, mode);
+	int result = _fill(pathname, 0);
+	if (result) { return result; }
 	_deepcopy(pathname, -1, 0);
 	_unroot();
 	if (chmod(pathname, mode)) { return -errno; }
@@ -127,6 +147,8 @@ int sandboxfs_chmod(const char *pathname, mode_t mode) {
 
 int sandboxfs_chown(const char *pathname, uid_t uid, gid_t gid) {
 	fprintf(stderr, "[sandboxfs] chown pathname: %s, uid: %d, gid: %d\n", pathname, uid, gid);
+	int result = _fill(pathname, 0);
+	if (result) { return result; }
 	_deepcopy(pathname, -1, 0);
 	_unroot();
 	if (lchown(pathname, uid, gid)) { return -errno; }
@@ -137,6 +159,8 @@ int sandboxfs_create(
 	const char *pathname, mode_t mode, struct fuse_file_info *fi
 ) {
 	fprintf(stderr, "[sandboxfs] create pathname: %s, mode: %o, fi: %p\n", pathname, mode, fi);
+	int result = _fill(pathname, 0);
+	if (result) { return result; }
 	_unroot();
 	int fd;
 	if (0 > (fd = creat(pathname, mode))) { return -errno; }
@@ -195,6 +219,8 @@ int sandboxfs_ftruncate(
 
 int sandboxfs_getattr(const char *pathname, struct stat *s) {
 	fprintf(stderr, "[sandboxfs] getattr pathname: %s, s: %p\n", pathname, s);
+	int result = _fill(pathname, 0);
+	if (result) { return result; }
 	_unroot();
 	if (lstat(pathname, s)) { return -errno; }
 	return 0;
@@ -227,6 +253,9 @@ int sandboxfs_ioctl(
 
 int sandboxfs_link(const char *oldpathname, const char *newpathname) {
 	fprintf(stderr, "[sandboxfs] link oldpathname: %s, newpathname: %s\n", oldpathname, newpathname);
+	int result = _fill(oldpathname, 0);
+	if (result) { return result; }
+	if ((result = _fill(newpathname, 0))) { return result; }
 	_unroot();
 	if (link(oldpathname, newpathname)) { return -errno; }
 	return 0;
@@ -254,6 +283,8 @@ int sandboxfs_lock(
 
 int sandboxfs_mkdir(const char *pathname, mode_t mode) {
 	fprintf(stderr, "[sandboxfs] mkdir pathname: %s, mode: %o\n", pathname, mode);
+	int result = _fill(pathname, 0);
+	if (result) { return result; }
 	_unroot();
 	if (mkdir(pathname, mode)) { return -errno; }
 	return 0;
@@ -261,6 +292,8 @@ int sandboxfs_mkdir(const char *pathname, mode_t mode) {
 
 int sandboxfs_mknod(const char *pathname, mode_t mode, dev_t dev) {
 	fprintf(stderr, "[sandboxfs] mknod pathname: %s, mode: %o, dev: %%ld\n", pathname, mode/*, dev*/);
+	int result = _fill(pathname, 0);
+	if (result) { return result; }
 	_unroot();
 	if (mknod(pathname, mode, dev)) { return -errno; }
 	return 0;
@@ -268,6 +301,8 @@ int sandboxfs_mknod(const char *pathname, mode_t mode, dev_t dev) {
 
 int sandboxfs_open(const char *pathname, struct fuse_file_info *fi) {
 	fprintf(stderr, "[sandboxfs] open pathname: %s, fi: %p\n", pathname, fi);
+	int result = _fill(pathname, 0);
+	if (result) { return result; }
 	_unroot();
 	int fd;
 	if (0 > (fd = open(pathname, fi->flags))) { return -errno; }
@@ -319,6 +354,9 @@ int sandboxfs_readdir(
 	struct fuse_file_info *fi
 ) {
 	fprintf(stderr, "[sandboxfs] readdir pathname: %s, ptr: %p, filler: %p, off: %%ld, fi: %p\n", pathname, ptr, filler/*, off*/, fi);
+	int result = _fill(pathname, 1);
+	if (result) { return result; }
+	_unroot();
 	DIR *dir;
 	if (!(dir = opendir(pathname))) { return -errno; }
 	struct dirent *entry;
@@ -331,6 +369,8 @@ int sandboxfs_readdir(
 
 int sandboxfs_readlink(const char *pathname, char *buf, size_t size) {
 	fprintf(stderr, "[sandboxfs] readlink pathname: %s, buf: %p, size: %%ld\n", pathname, buf/*, size*/);
+	int result = _fill(pathname, 0);
+	if (result) { return result; }
 	_unroot();
 	ssize_t len;
 	if (0 > (len = readlink(pathname, buf, size))) { return -errno; }
@@ -362,6 +402,9 @@ int sandboxfs_removexattr(const char *pathname, const char *name) {
 
 int sandboxfs_rename(const char *oldpathname, const char *newpathname) {
 	fprintf(stderr, "[sandboxfs] rename oldpathname: %s, newpathname: %s\n", oldpathname, newpathname);
+	int result = _fill(oldpathname, 1);
+	if (result) { return result; }
+	if ((result = _fill(newpathname, 1))) { return result; }
 	_deepcopy(oldpathname, -1, 0);
 	_unroot();
 	if (rename(oldpathname, newpathname)) { return -errno; }
@@ -370,6 +413,8 @@ int sandboxfs_rename(const char *oldpathname, const char *newpathname) {
 
 int sandboxfs_rmdir(const char *pathname) {
 	fprintf(stderr, "[sandboxfs] rmdir pathname: %s\n", pathname);
+	int result = _fill(pathname, 1);
+	if (result) { return result; }
 	_unroot();
 	if (rmdir(pathname)) { return -errno; }
 	return 0;
@@ -398,6 +443,8 @@ int sandboxfs_statfs(const char *pathname, struct statvfs *s) {
 
 int sandboxfs_symlink(const char *target, const char *pathname) {
 	fprintf(stderr, "[sandboxfs] symlink target: %s, pathname: %s\n", target, pathname);
+	int result = _fill(pathname, 0);
+	if (result) { return result; }
 	_unroot();
 	if (symlink(target, pathname)) { return -errno; }
 	return 0;
@@ -405,6 +452,8 @@ int sandboxfs_symlink(const char *target, const char *pathname) {
 
 int sandboxfs_truncate(const char *pathname, off_t off) {
 	fprintf(stderr, "[sandboxfs] truncate pathname: %s, off: %%ld\n", pathname/*, off*/);
+	int result = _fill(pathname, 0);
+	if (result) { return result; }
 	_deepcopy(pathname, -1, 0);
 	_unroot();
 	if (truncate(pathname, off)) { return -errno; }
@@ -413,6 +462,8 @@ int sandboxfs_truncate(const char *pathname, off_t off) {
 
 int sandboxfs_unlink(const char *pathname) {
 	fprintf(stderr, "[sandboxfs] unlink pathname: %s\n", pathname);
+	int result = _fill(pathname, 0);
+	if (result) { return result; }
 	_unroot();
 	if (unlink(pathname)) { return -errno; }
 	return 0;
@@ -420,6 +471,8 @@ int sandboxfs_unlink(const char *pathname) {
 
 int sandboxfs_utime(const char *pathname, struct utimbuf *times) {
 	fprintf(stderr, "[sandboxfs] utime pathname: %s, times: %p\n", pathname, times);
+	int result = _fill(pathname, 0);
+	if (result) { return result; }
 	_deepcopy(pathname, -1, 0);
 	_unroot();
 	if (utime(pathname, times)) { return -errno; }
@@ -428,6 +481,8 @@ int sandboxfs_utime(const char *pathname, struct utimbuf *times) {
 
 int sandboxfs_utimens(const char *pathname, const struct timespec tv[2]) {
 	fprintf(stderr, "[sandboxfs] utimens pathname: %s, tv: %p\n", pathname, tv);
+	int result = _fill(pathname, 0);
+	if (result) { return result; }
 	_deepcopy(pathname, -1, 0);
 	_unroot();
 	if (utimensat(-1, pathname, tv, 0)) { return -errno; }
@@ -517,10 +572,38 @@ int main(int argc, char **argv) {
 	/* Before we jump into the event loop, figure out the path
 	 * to the shadow directory that contains our shallow copy.
 	 */
-	if (!(_shadow = (char *)malloc(strlen(mountpoint) + 2))) { return -1; }
+	if (!(_shadow = (char *)malloc(
+		strlen(mountpoint) + 2 + strlen(LAZY_ROOTFS)
+	))) { return -1; }
 	strcpy(&_shadow[1], mountpoint);
 	strncpy(_shadow, "/var/sandboxes/.", strlen("/var/sandboxes/."));
 
+	/* A sandbox served whole is mounted at its top and served from the
+	 * lazy tree that takes its place in the shadow directory.
+	 */
+	const char *name = &_shadow[strlen("/var/sandboxes/.")];
+	int whole = !strchr(name, '/');
+	if (whole) { strcat(_shadow, LAZY_ROOTFS); }
+
+	/* Find the trees lazy directories are filled from while they can
+	 * still be reached, and the rules that filter them, which leave /etc
+	 * alone as a copy made up front would.  Only a sandbox served whole
+	 * or one that left a `lazy` file in its shadow directory has lazy
+	 * directories at all; the rest skip filling entirely.
+	 */
+	char pathname[PATH_MAX];
+	snprintf(pathname, PATH_MAX, "/var/sandboxes/.%.*s/lazy",
+		(int)strcspn(name, "/"), name);
+	if (whole || !access(pathname, F_OK)) {
+		struct rules *rules = 0;
+		if (strcmp("/etc", strrchr(_shadow, '/'))) {
+			rules = rules_new("/");
+			if (rules_load(rules, RULES_CONFIG)) { return -1; }
+		}
+		_lazy = lazy_open(_shadow, rules);
+		rules_unref(rules);
+	}
+
 	/* We're going to need pthread_cancel later and won't be able to find
 	 * it post-chroot(2), so load it here.
 	 */
@@ -0,0 +1,714 @@
+#include "changes.h"
+#include "macros.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A change journal records which paths beneath a root were created,
+ * modified, or deleted, numbering each change in the order it was seen, so
+ * anyone holding an earlier number can learn what changed since without
+ * walking the tree.  The file starts with a header line giving the number
+ * changes are known since and the root, followed by a line per change: its
+ * number as CHANGES_SEQLEN hex digits, one of the CHANGES_* letters, and
+ * the path as seen from inside the root, with a trailing / for
+ * directories.  Lines are in order and their numbers all the same width,
+ * so a query finds where to start by bisection.
+ *
+ * Only the latest change to each path matters to any query, so the others
+ * are dropped whenever the file is compacted.  Whenever changes may have
+ * gone unseen, as when the tracker starts or the kernel's queue overflows,
+ * the file starts over from a later number, and earlier numbers get no
+ * answer.  Neither do any numbers at all unless the tracker is running,
+ * which it shows by holding a lock on the file.
+ */
+#define CHANGES_HEADER "changes"
+#define CHANGES_SEQLEN 16
+
+/* Compact the journal when it's grown past this many bytes and to twice
+ * its size after the last compaction.
+ */
+#define CHANGES_COMPACT (4 << 20)
+
+/* Set when the tracker's been asked to stop.
+ */
+static volatile sig_atomic_t _changes_stopped = 0;
+
+/* A change to a path, or a hole where one was before it changed again.
+ */
+struct change {
+	uint64_t seq;
+	int op;
+	char *path;
+};
+
+/* Paths in the order they last changed, each once.
+ */
+struct changes_list {
+	struct change *v;
+	size_t n, cap;
+	GHashTable *index; /* Paths to their index in v plus one. */
+};
+
+/* A journal's file mapped for reading.
+ */
+struct changes_map {
+	char *buf;
+	size_t len;
+	size_t start, end;   /* The first change and just past the last. */
+	uint64_t since, last;
+	const char *root;    /* In buf, ending at start. */
+	size_t rootlen;
+};
+
+struct changes_tracker {
+	const char *pathname, *root;
+	size_t rootlen; /* Without a trailing /. */
+	const char **exclude;
+	int fd, fanfd, mountfd;
+	uint64_t since, seq;
+	off_t compacted;
+	struct changes_list batch;
+	GHashTable *dirs; /* Handles to paths, "" if they're gone. */
+	sigset_t sigmask; /* To restore when the tracker stops. */
+};
+
+static void _changes_list_init(struct changes_list *l) {
+	memset(l, 0, sizeof(struct changes_list));
+	l->index = g_hash_table_new(g_str_hash, g_str_equal);
+	FATAL(!l->index, "g_hash_table_new");
+}
+
+static void _changes_list_free(struct changes_list *l) {
+	size_t i;
+	for (i = 0; i < l->n; ++i) { free(l->v[i].path); }
+	free(l->v);
+	if (l->index) { g_hash_table_destroy(l->index); }
+	memset(l, 0, sizeof(struct changes_list));
+}
+
+/* Return what a path that changed by old and then by op changed by in
+ * all.  Being created or deleted last is what counts; otherwise a path
+ * created and then modified is still new.
+ */
+static int _changes_merge(int old, int op) {
+	if (CHANGES_MODIFIED != op) { return op; }
+	return CHANGES_CREATED == old ? old : op;
+}
+
+/* Add a change to path, moving the path to the end if it changed before.
+ */
+static void _changes_add(
+	struct changes_list *l, const char *path, int op, uint64_t seq
+) {
+	char *key;
+	uintptr_t i = (uintptr_t)g_hash_table_lookup(l->index, path);
+	if (i) {
+		struct change *c = &l->v[i - 1];
+		op = _changes_merge(c->op, op);
+		key = c->path;
+		c->path = 0;
+	}
+	else { FATAL(!(key = strdup(path)), "strdup"); }
+	if (l->n == l->cap) {
+		l->cap = l->cap ? 2 * l->cap : 64;
+		l->v = (struct change *)realloc(l->v, l->cap * sizeof(struct change));
+		FATAL(!l->v, "realloc");
+	}
+	l->v[l->n].seq = seq;
+	l->v[l->n].op = op;
+	l->v[l->n].path = key;
+	g_hash_table_replace(l->index, key, (void *)(uintptr_t)++l->n);
+}
+
+/* Append each change in l to fd in one write(2).  If seq is given, the
+ * changes are numbered as they go, after it.
+ */
+static int _changes_write(int fd, struct changes_list *l, uint64_t *seq) {
+	int result = -1;
+	char *buf = 0;
+	size_t i, len = 0, size = 0;
+	for (i = 0; i < l->n; ++i) {
+		if (l->v[i].path) {
+			size += CHANGES_SEQLEN + 4 + strlen(l->v[i].path);
+		}
+	}
+	if (!size) { return 0; }
+	FATAL(!(buf = (char *)malloc(size + 1)), "malloc");
+	for (i = 0; i < l->n; ++i) {
+		struct change *c = &l->v[i];
+		if (!c->path) { continue; }
+		if (seq) { c->seq = ++*seq; }
+		len += sprintf(&buf[len], "%0*" PRIx64 " %c %s\n",
+			CHANGES_SEQLEN, c->seq, c->op, c->path);
+	}
+	WARN(len != write(fd, buf, len), "write");
+	result = 0;
+error:
+	free(buf);
+	return result;
+}
+
+/* Parse the hex number at p, which must be CHANGES_SEQLEN digits long.
+ */
+static int _changes_hex(const char *p, uint64_t *seq) {
+	int i;
+	*seq = 0;
+	for (i = 0; i < CHANGES_SEQLEN; ++i) {
+		int c = p[i];
+		if ('0' <= c && c <= '9') { c -= '0'; }
+		else if ('a' <= c && c <= 'f') { c -= 'a' - 10; }
+		else { return -1; }
+		*seq = *seq << 4 | c;
+	}
+	return 0;
+}
+
+/* Parse the change on the line from p to its newline at end, pointing
+ * path into the line.  The path isn't terminated.
+ */
+static int _changes_line(
+	const char *p, const char *end,
+	uint64_t *seq, int *op, const char **path
+) {
+	if (end - p < CHANGES_SEQLEN + 4
+		|| _changes_hex(p, seq)
+		|| ' ' != p[CHANGES_SEQLEN]
+		|| ' ' != p[CHANGES_SEQLEN + 2]
+	) { return -1; }
+	*op = p[CHANGES_SEQLEN + 1];
+	*path = &p[CHANGES_SEQLEN + 3];
+	return 0;
+}
+
+static void _changes_unmap(struct changes_map *f) {
+	if (f->buf) { munmap(f->buf, f->len); }
+	f->buf = 0;
+}
+
+/* Map the journal open at fd.  A line torn by a crash or still being
+ * written is left off the end.  Fails with ESTALE if the file isn't a
+ * journal.
+ */
+static int _changes_map(int fd, struct changes_map *f) {
+	memset(f, 0, sizeof(struct changes_map));
+	struct stat s;
+	WARN(fstat(fd, &s), "fstat");
+	size_t headerlen = strlen(CHANGES_HEADER);
+	if ((size_t)s.st_size < headerlen + CHANGES_SEQLEN + 3) {
+		errno = ESTALE;
+		return -1;
+	}
+	f->len = s.st_size;
+	f->buf = (char *)mmap(0, f->len, PROT_READ, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == f->buf) {
+		f->buf = 0;
+		WARN(1, "mmap");
+	}
+
+	char *nl = (char *)memchr(f->buf, '\n', f->len);
+	if (!nl
+		|| memcmp(f->buf, CHANGES_HEADER " ", headerlen + 1)
+		|| _changes_hex(&f->buf[headerlen + 1], &f->since)
+		|| ' ' != f->buf[headerlen + 1 + CHANGES_SEQLEN]
+	) {
+		_changes_unmap(f);
+		errno = ESTALE;
+		return -1;
+	}
+	f->root = &f->buf[headerlen + CHANGES_SEQLEN + 2];
+	f->rootlen = nl - f->root;
+	f->start = nl + 1 - f->buf;
+	f->end = (char *)memrchr(f->buf, '\n', f->len) + 1 - f->buf;
+
+	/* The last change, if there's been one, is the latest.
+	 */
+	f->last = f->since;
+	if (f->start < f->end) {
+		const char *p = (const char *)memrchr(
+			f->buf, '\n', f->end - 1
+		) + 1, *path;
+		int op;
+		if (_changes_line(p, &f->buf[f->end - 1], &f->last, &op, &path)) {
+			_changes_unmap(f);
+			errno = ESTALE;
+			return -1;
+		}
+	}
+
+	return 0;
+error:
+	return -1;
+}
+
+/* Return the offset of the first line in f numbered after seq.
+ */
+static size_t _changes_find(const struct changes_map *f, uint64_t seq) {
+	size_t lo = f->start, hi = f->end;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const char *p = (const char *)memrchr(
+			&f->buf[lo], '\n', mid - lo
+		);
+		size_t line = p ? p + 1 - f->buf : lo;
+		const char *end = (const char *)memchr(
+			&f->buf[line], '\n', hi - line
+		);
+		uint64_t n;
+		if (end - &f->buf[line] < CHANGES_SEQLEN
+			|| _changes_hex(&f->buf[line], &n)
+			|| seq < n
+		) { hi = line; }
+		else { lo = end + 1 - f->buf; }
+	}
+	return lo;
+}
+
+/* Return non-zero if the tracker holds the journal open at fd.
+ * (Positive logic.)
+ */
+static int _changes_live(int fd) {
+	struct flock lock;
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = 0;
+	lock.l_len = 1;
+	if (fcntl(fd, F_GETLK, &lock)) { return 0; }
+	return F_UNLCK != lock.l_type;
+}
+
+static int _changes_lock(int fd) {
+	struct flock lock;
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = 0;
+	lock.l_len = 1;
+	return fcntl(fd, F_SETLK, &lock);
+}
+
+/* Open and map the journal at pathname if it's being kept up to date.
+ * Fails with ESTALE if it isn't.
+ */
+static int _changes_open(const char *pathname, struct changes_map *f) {
+	int fd = open(pathname, O_RDONLY | O_CLOEXEC);
+	if (0 > fd) {
+		if (ENOENT == errno) { errno = ESTALE; }
+		return -1;
+	}
+	int result = _changes_map(fd, f);
+	if (!result && !_changes_live(fd)) {
+		_changes_unmap(f);
+		errno = ESTALE;
+		result = -1;
+	}
+	close(fd);
+	return result;
+}
+
+/* Start the journal over, since changes may have gone unseen, so no number
+ * handed out before now can be used to ask what changed.
+ */
+static int _changes_reset(struct changes_tracker *t) {
+	char buf[PATH_MAX + 64];
+	t->since = ++t->seq;
+	int len = snprintf(buf, sizeof(buf), "%s %0*" PRIx64 " %s\n",
+		CHANGES_HEADER, CHANGES_SEQLEN, t->since, t->root);
+	WARN(sizeof(buf) <= len, "snprintf");
+	WARN(ftruncate(t->fd, 0), "ftruncate");
+	WARN(len != write(t->fd, buf, len), "write");
+	t->compacted = len;
+	return 0;
+error:
+	return -1;
+}
+
+/* Rewrite the journal with only the latest change to each path.  The new
+ * file is locked before it replaces the old so the tracker is never seen
+ * to stop, though a query that opened the old one a moment too soon may
+ * be told nothing is known, which is always safe.
+ */
+static int _changes_compact(struct changes_tracker *t) {
+	int result = -1, fd = -1;
+	struct changes_map f;
+	struct changes_list l;
+	char tmp[PATH_MAX], path[PATH_MAX + 1];
+	_changes_list_init(&l);
+	if (_changes_map(t->fd, &f)) { goto error; }
+	size_t i = f.start;
+	while (i < f.end) {
+		const char *end = (const char *)memchr(
+			&f.buf[i], '\n', f.end - i
+		), *p;
+		uint64_t seq;
+		int op;
+		if (!_changes_line(&f.buf[i], end, &seq, &op, &p)
+			&& end - p <= PATH_MAX
+		) {
+			memcpy(path, p, end - p);
+			path[end - p] = 0;
+			_changes_add(&l, path, op, seq);
+		}
+		i = end + 1 - f.buf;
+	}
+
+	WARN(PATH_MAX <= snprintf(tmp, PATH_MAX, "%s~%d",
+		t->pathname, (int)getpid()
+	), "snprintf");
+	WARN(0 > (fd = open(
+		tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644
+	)), "open");
+	WARN(_changes_lock(fd), "fcntl");
+	WARN((ssize_t)f.start != write(fd, f.buf, f.start), "write");
+	if (_changes_write(fd, &l, 0)) { goto error; }
+	struct stat s;
+	WARN(fstat(fd, &s), "fstat");
+	WARN(rename(tmp, t->pathname), "rename");
+	close(t->fd);
+	t->fd = fd;
+	fd = -1;
+	t->compacted = s.st_size;
+
+	result = 0;
+error:
+	if (0 <= fd) {
+		unlink(tmp);
+		close(fd);
+	}
+	_changes_unmap(&f);
+	_changes_list_free(&l);
+	return result;
+}
+
+/* Return the path of the directory with the given handle, or "" if it's
+ * gone.  Whatever happened beneath a directory that's gone is covered by
+ * its own deletion, which is seen from a parent that isn't.
+ */
+static const char *_changes_dir(
+	struct changes_tracker *t, struct file_handle *fh
+) {
+	char key[2 * MAX_HANDLE_SZ + 16];
+	unsigned int i;
+	int len = sprintf(key, "%x:", fh->handle_type);
+	for (i = 0; i < fh->handle_bytes && i < MAX_HANDLE_SZ; ++i) {
+		len += sprintf(&key[len], "%02x", fh->f_handle[i]);
+	}
+	const char *dirname = (const char *)g_hash_table_lookup(t->dirs, key);
+	if (dirname) { return dirname; }
+
+	char buf[PATH_MAX] = "";
+	int fd = open_by_handle_at(t->mountfd, fh, O_PATH | O_CLOEXEC);
+	if (0 <= fd) {
+		char proc[64];
+		snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+		ssize_t n = readlink(proc, buf, PATH_MAX - 1);
+		const char *deleted = " (deleted)";
+		size_t dellen = strlen(deleted);
+		if (0 > n || '/' != *buf || (
+			(size_t)n >= dellen && !memcmp(&buf[n - dellen], deleted, dellen)
+		)) { n = 0; }
+		buf[n] = 0;
+		close(fd);
+	}
+
+	char *k, *v;
+	FATAL(!(k = strdup(key)), "strdup");
+	FATAL(!(v = strdup(buf)), "strdup");
+	g_hash_table_insert(t->dirs, k, v);
+	return v;
+}
+
+/* Return pathname as seen from inside the tracker's root, or a null
+ * pointer if it's outside or excluded.
+ */
+static const char *_changes_path(
+	const struct changes_tracker *t, const char *pathname
+) {
+	int i;
+	for (i = 0; t->exclude && t->exclude[i]; ++i) {
+		size_t len = strlen(t->exclude[i]);
+		if (!strncmp(t->exclude[i], pathname, len)
+			&& ('/' == pathname[len] || !pathname[len])
+		) { return 0; }
+	}
+	if (strncmp(t->root, pathname, t->rootlen)) { return 0; }
+	pathname += t->rootlen;
+	if (!*pathname) { return "/"; }
+	if ('/' != *pathname) { return 0; }
+	return pathname;
+}
+
+/* Add what an event reports to the batch.  Creations and deletions merged
+ * by the kernel into one event are told apart by looking.
+ */
+static void _changes_event(
+	struct changes_tracker *t, const struct fanotify_event_metadata *m
+) {
+	const char *p = (const char *)m + m->metadata_len;
+	const char *end = (const char *)m + m->event_len;
+	const struct fanotify_event_info_fid *info = 0;
+	while (p + sizeof(struct fanotify_event_info_header) <= end) {
+		const struct fanotify_event_info_header *h =
+			(const struct fanotify_event_info_header *)p;
+		if (!h->len) { break; }
+		if (FAN_EVENT_INFO_TYPE_DFID_NAME == h->info_type
+			|| FAN_EVENT_INFO_TYPE_DFID == h->info_type
+		) {
+			info = (const struct fanotify_event_info_fid *)h;
+			break;
+		}
+		p += h->len;
+	}
+	if (!info) { return; }
+
+	struct file_handle *fh = (struct file_handle *)info->handle;
+	const char *name = ".";
+	if (FAN_EVENT_INFO_TYPE_DFID_NAME == info->hdr.info_type) {
+		name = (const char *)fh->f_handle + fh->handle_bytes;
+	}
+	const char *dirname = _changes_dir(t, fh);
+	if (!*dirname) { return; }
+
+	/* A name that can't be written on a line of its own is recorded as
+	 * a change to its directory.
+	 */
+	int dir = !!(FAN_ONDIR & m->mask), op = CHANGES_MODIFIED;
+	char pathname[PATH_MAX + NAME_MAX + 2];
+	if (!strcmp(".", name) || strchr(name, '\n')) {
+		strcpy(pathname, dirname);
+		dir = 1;
+	}
+	else {
+		snprintf(pathname, sizeof(pathname), "%s/%s",
+			strcmp("/", dirname) ? dirname : "", name);
+		if ((FAN_CREATE | FAN_MOVED_TO | FAN_DELETE | FAN_MOVED_FROM)
+			& m->mask
+		) {
+			struct stat s;
+			op = lstat(pathname, &s) ? CHANGES_DELETED : CHANGES_CREATED;
+		}
+	}
+
+	const char *path = _changes_path(t, pathname);
+	if (!path) { return; }
+	char buf[PATH_MAX + NAME_MAX + 3];
+	if (dir && strcmp("/", path)) {
+		snprintf(buf, sizeof(buf), "%s/", path);
+		path = buf;
+	}
+	if (PATH_MAX < strlen(path)) { return; }
+	_changes_add(&t->batch, path, op, 0);
+}
+
+static void _changes_stop(int signum) {
+	_changes_stopped = 1;
+}
+
+/* Record changes to the filesystem tree rooted at root in the journal at
+ * pathname until interrupted or terminated, leaving out paths beneath any
+ * in exclude.  The journal must be outside root or excluded.  Only root's
+ * own filesystem is watched, as fanotify(7) marks whole filesystems.  Only
+ * one tracker may keep a journal; others fail with EAGAIN or EACCES.
+ */
+int changes_track(
+	const char *pathname, const char *root, const char **exclude
+) {
+	int result = -1, blocked = 0;
+	struct changes_tracker t;
+	struct changes_map f;
+	memset(&t, 0, sizeof(t));
+	t.fd = t.fanfd = t.mountfd = -1;
+	t.pathname = pathname;
+	t.root = root;
+	t.rootlen = strlen(root);
+	while (t.rootlen && '/' == root[t.rootlen - 1]) { --t.rootlen; }
+	t.exclude = exclude;
+	_changes_list_init(&t.batch);
+	t.dirs = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	FATAL(!t.dirs, "g_hash_table_new_full");
+
+	WARN(0 > (t.fd = open(
+		pathname, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644
+	)), "open");
+	if (_changes_lock(t.fd)) { goto error; }
+
+	/* Watch before saying so, so nothing is missed in between.
+	 */
+	WARN(0 > (t.fanfd = fanotify_init(
+		FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK
+			| FAN_REPORT_DFID_NAME, O_RDONLY
+	)), "fanotify_init");
+	WARN(fanotify_mark(t.fanfd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+		FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO
+			| FAN_MODIFY | FAN_ATTRIB | FAN_ONDIR,
+		AT_FDCWD, root
+	), "fanotify_mark");
+	WARN(0 > (t.mountfd = open(
+		root, O_RDONLY | O_DIRECTORY | O_CLOEXEC
+	)), "open");
+
+	/* Carry on numbering from a journal left by an earlier tracker of the
+	 * same root.  Otherwise start from the time, which keeps numbers from
+	 * a journal that was removed from ever being mistaken for new ones.
+	 */
+	if (!_changes_map(t.fd, &f)) {
+		if (f.rootlen == strlen(root) && !memcmp(f.root, root, f.rootlen)) {
+			t.seq = f.last;
+		}
+		_changes_unmap(&f);
+	}
+	if (!t.seq) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		t.seq = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	}
+	if (_changes_reset(&t)) { goto error; }
+
+	/* The signals that stop the tracker are only let in while it waits,
+	 * so none can slip in between checking and waiting.
+	 */
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _changes_stop;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	WARN(sigprocmask(SIG_BLOCK, &mask, &t.sigmask), "sigprocmask");
+	blocked = 1;
+
+	/* Changes read together are written together, so no query sees a
+	 * number between them and each path need only be written once.
+	 */
+	uint64_t buf[8192];
+	while (!_changes_stopped) {
+		struct pollfd pfd;
+		pfd.fd = t.fanfd;
+		pfd.events = POLLIN;
+		if (0 > ppoll(&pfd, 1, 0, &t.sigmask)) {
+			if (EINTR == errno) { continue; }
+			WARN(1, "ppoll");
+		}
+		ssize_t len = read(t.fanfd, buf, sizeof(buf));
+		if (0 > len) {
+			if (EAGAIN == errno || EINTR == errno) { continue; }
+			WARN(1, "read");
+		}
+		int overflow = 0;
+		const struct fanotify_event_metadata *m =
+			(const struct fanotify_event_metadata *)buf;
+		for (; FAN_EVENT_OK(m, len); m = FAN_EVENT_NEXT(m, len)) {
+			if (FANOTIFY_METADATA_VERSION != m->vers) { continue; }
+			if (FAN_Q_OVERFLOW & m->mask) { overflow = 1; }
+			else { _changes_event(&t, m); }
+		}
+		if (overflow) {
+			if (_changes_reset(&t)) { goto error; }
+		}
+		else if (_changes_write(t.fd, &t.batch, &t.seq)) { goto error; }
+		_changes_list_free(&t.batch);
+		_changes_list_init(&t.batch);
+		g_hash_table_destroy(t.dirs);
+		t.dirs = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+		FATAL(!t.dirs, "g_hash_table_new_full");
+
+		struct stat s;
+		WARN(fstat(t.fd, &s), "fstat");
+		if (CHANGES_COMPACT < s.st_size && 2 * t.compacted < s.st_size) {
+			if (_changes_compact(&t)) { goto error; }
+		}
+	}
+
+	result = 0;
+error:
+	if (blocked) { sigprocmask(SIG_SETMASK, &t.sigmask, 0); }
+	if (0 <= t.mountfd) { close(t.mountfd); }
+	if (0 <= t.fanfd) { close(t.fanfd); }
+	if (0 <= t.fd) { close(t.fd); }
+	_changes_list_free(&t.batch);
+	g_hash_table_destroy(t.dirs);
+	return result;
+}
+
+/* Set seq to the number of the latest change in the journal at pathname,
+ * to ask changes_since about later.  Fails with ESTALE if the journal
+ * isn't being kept.
+ */
+int changes_current(const char *pathname, uint64_t *seq) {
+	struct changes_map f;
+	if (_changes_open(pathname, &f)) { return -1; }
+	*seq = f.last;
+	_changes_unmap(&f);
+	return 0;
+}
+
+/* Call cb for each path changed after seq in the journal at pathname, in
+ * the order each last changed, with what happened to it in all.  Paths are
+ * as seen from inside the root, with a trailing / for directories.  Fails
+ * with ESTALE if it can't say, because the journal isn't being kept or was
+ * started over since seq, in which case the caller must look for itself.
+ * Changes are recorded moments after they happen, so the very latest may
+ * not be listed yet.
+ */
+int changes_since(
+	const char *pathname, uint64_t seq,
+	int(*cb)(const char *path, int op, void *ptr),
+	void *ptr
+) {
+	int result = -1;
+	struct changes_map f;
+	struct changes_list l;
+	char path[PATH_MAX + 1];
+	memset(&f, 0, sizeof(f));
+	_changes_list_init(&l);
+	if (_changes_open(pathname, &f)) { goto error; }
+	if (seq < f.since || seq > f.last) {
+		errno = ESTALE;
+		goto error;
+	}
+
+	size_t i = _changes_find(&f, seq);
+	while (i < f.end) {
+		const char *end = (const char *)memchr(
+			&f.buf[i], '\n', f.end - i
+		), *p;
+		uint64_t n;
+		int op;
+		if (!_changes_line(&f.buf[i], end, &n, &op, &p)
+			&& end - p <= PATH_MAX
+		) {
+			memcpy(path, p, end - p);
+			path[end - p] = 0;
+			_changes_add(&l, path, op, n);
+		}
+		i = end + 1 - f.buf;
+	}
+
+	size_t k;
+	for (k = 0; k < l.n; ++k) {
+		if (l.v[k].path && cb(l.v[k].path, l.v[k].op, ptr)) { goto error; }
+	}
+
+	result = 0;
+error:
+	_changes_unmap(&f);
+	_changes_list_free(&l);
+	return result;
+}
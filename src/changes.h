@@ -0,0 +1,24 @@
+#ifndef CHANGES_H
+#define CHANGES_H
+
+#include <stdint.h>
+
+/* What happened to a path, as passed to changes_since callbacks.  A
+ * directory created or deleted stands for everything beneath it.
+ */
+#define CHANGES_CREATED 'C'
+#define CHANGES_MODIFIED 'M'
+#define CHANGES_DELETED 'D'
+
+int changes_track(
+	const char *pathname, const char *root, const char **exclude
+);
+
+int changes_current(const char *pathname, uint64_t *seq);
+int changes_since(
+	const char *pathname, uint64_t seq,
+	int(*cb)(const char *path, int op, void *ptr),
+	void *ptr
+);
+
+#endif
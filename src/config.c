@@ -0,0 +1,75 @@
+#include "config.h"
+#include "macros.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static GHashTable *_config = 0;
+
+/* Return s without leading or trailing whitespace, modifying it in place.
+ */
+static char *_config_strip(char *s) {
+	while (isspace((unsigned char)*s)) { ++s; }
+	size_t len = strlen(s);
+	while (len && isspace((unsigned char)s[len - 1])) { s[--len] = 0; }
+	return s;
+}
+
+/* Read CONFIG the first time it's needed.  A missing file leaves every
+ * setting at its default and blank lines and lines starting with `#` are
+ * ignored.
+ */
+static void _config_load() {
+	if (_config) { return; }
+	_config = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	FATAL(!_config, "g_hash_table_new_full");
+	FILE *f = fopen(CONFIG, "re");
+	if (!f) {
+		if (ENOENT != errno) { perror(CONFIG); }
+		return;
+	}
+	char *line = 0;
+	size_t n = 0;
+	while (0 < getline(&line, &n, f)) {
+		char *key = _config_strip(line);
+		if (!*key || '#' == *key) { continue; }
+		char *value = strchr(key, '=');
+		if (!value) {
+			fprintf(stderr, "%s: ignoring %s\n", CONFIG, key);
+			continue;
+		}
+		*value++ = 0;
+		key = strdup(_config_strip(key));
+		value = strdup(_config_strip(value));
+		FATAL(!key || !value, "strdup");
+		g_hash_table_insert(_config, key, value);
+	}
+	if (ferror(f)) { perror(CONFIG); }
+	free(line);
+	fclose(f);
+}
+
+/* Return the value of a setting or a null pointer if it's not set.
+ */
+const char *config_get(const char *key) {
+	_config_load();
+	return (const char *)g_hash_table_lookup(_config, key);
+}
+
+/* Return the value of a numeric setting or value if it's not set.
+ */
+int config_int(const char *key, int value) {
+	const char *s = config_get(key);
+	if (!s) { return value; }
+	char *end;
+	long l = strtol(s, &end, 10);
+	if (!*s || *end) {
+		fprintf(stderr, "%s: %s isn't a number\n", CONFIG, key);
+		return value;
+	}
+	return (int)l;
+}
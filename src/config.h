@@ -0,0 +1,11 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/* Settings shared by every sandbox program, as `key = value` lines.
+ */
+#define CONFIG "/etc/sandbox.conf"
+
+const char *config_get(const char *key);
+int config_int(const char *key, int value);
+
+#endif
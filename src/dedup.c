@@ -0,0 +1,555 @@
+#include "dedup.h"
+#include "dir.h"
+#include "journal.h"
+#include "macros.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <limits.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Files are read this much at a time, which must be a multiple of the 32
+ * bytes the hash takes in at once.
+ */
+#define DEDUP_BUFSIZE 65536
+
+/* The most FIDEDUPERANGE is asked to share at once.  btrfs quietly
+ * shortens longer requests to this anyway.
+ */
+#define DEDUP_RANGE (16 << 20)
+
+/* XXH64's primes.  Its four lanes are independent of each other until the
+ * end, so the compiler keeps all four in flight at once, and hashing runs
+ * as fast as files can be read.
+ */
+#define DEDUP_P1 11400714785074694791ULL
+#define DEDUP_P2 14029467366897019727ULL
+#define DEDUP_P3 1609587929392839161ULL
+#define DEDUP_P4 9650029242287828579ULL
+#define DEDUP_P5 2870177450012600261ULL
+
+/* Bytes per second a pass may read, or 0 for as fast as it can.
+ */
+static unsigned long _dedup_rate = 0;
+
+/* A file later files with the same contents are shared with.  A file whose
+ * size no other has matched yet is kept by size alone so it's never read
+ * unless one does.
+ */
+struct dedup_file {
+	char *pathname;
+	int linkable;
+};
+
+/* Stands in the sizes table for sizes whose files are kept by hash.
+ */
+static struct dedup_file _dedup_hashed = {0, 0};
+
+struct dedup {
+	struct journal *journal;
+	int reflink;
+	const char *root, *base;
+	const char **share;
+	size_t rootlen;
+	int cow;
+	GHashTable *sizes, *hashes;
+	struct dedup_counts counts;
+	unsigned long long bytes;
+	struct timespec start;
+	unsigned char buf1[DEDUP_BUFSIZE], buf2[DEDUP_BUFSIZE];
+};
+
+/* Read no more than rate bytes per second from now on.
+ */
+void dedup_rate(unsigned long rate) {
+	_dedup_rate = rate;
+}
+
+static void _dedup_file_free(void *ptr) {
+	struct dedup_file *f = (struct dedup_file *)ptr;
+	if (!f || &_dedup_hashed == f) { return; }
+	free(f->pathname);
+	free(f);
+}
+
+static struct dedup_file *_dedup_file_new(const char *pathname, int linkable) {
+	struct dedup_file *f = (struct dedup_file *)malloc(sizeof(*f));
+	FATAL(!f, "malloc");
+	FATAL(!(f->pathname = strdup(pathname)), "strdup");
+	f->linkable = linkable;
+	return f;
+}
+
+/* Start a deduplication pass, which skips directories the journal says an
+ * earlier pass finished and marks those it finishes.  Files are shared by
+ * reflink if reflink is non-zero.
+ */
+struct dedup *dedup_new(struct journal *journal, int reflink) {
+	struct dedup *d = (struct dedup *)calloc(1, sizeof(struct dedup));
+	FATAL(!d, "calloc");
+	d->journal = journal;
+	d->reflink = reflink;
+	d->sizes = g_hash_table_new_full(
+		g_str_hash, g_str_equal, free, _dedup_file_free);
+	FATAL(!d->sizes, "g_hash_table_new_full");
+	d->hashes = g_hash_table_new_full(
+		g_str_hash, g_str_equal, free, _dedup_file_free);
+	FATAL(!d->hashes, "g_hash_table_new_full");
+	clock_gettime(CLOCK_MONOTONIC, &d->start);
+
+	/* Leases taken before a file is replaced are broken with SIGIO when
+	 * someone else opens it, which would otherwise kill the process.
+	 */
+	signal(SIGIO, SIG_IGN);
+
+	return d;
+}
+
+void dedup_counts(const struct dedup *d, struct dedup_counts *c) {
+	*c = d->counts;
+}
+
+void dedup_free(struct dedup *d) {
+	if (!d) { return; }
+	g_hash_table_destroy(d->sizes);
+	g_hash_table_destroy(d->hashes);
+	free(d);
+}
+
+/* Account for n more bytes read and sleep off however far ahead of the
+ * rate that puts the pass.
+ */
+static void _dedup_throttle(struct dedup *d, size_t n) {
+	d->bytes += n;
+	if (!_dedup_rate) { return; }
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double ahead = (double)d->bytes / _dedup_rate
+		- (now.tv_sec - d->start.tv_sec)
+		- (now.tv_nsec - d->start.tv_nsec) / 1e9;
+	if (0 >= ahead) { return; }
+	struct timespec t;
+	t.tv_sec = (time_t)ahead;
+	t.tv_nsec = (long)((ahead - t.tv_sec) * 1e9);
+	nanosleep(&t, 0);
+}
+
+/* Fill buf from fd starting at off, stopping short only at the end of the
+ * file.  Returns the number of bytes read or -1 on failure.
+ */
+static ssize_t _dedup_read(
+	struct dedup *d, int fd, unsigned char *buf, off_t off
+) {
+	size_t len = 0;
+	while (len < DEDUP_BUFSIZE) {
+		ssize_t n = pread(fd, &buf[len], DEDUP_BUFSIZE - len, off + len);
+		if (0 > n) { return -1; }
+		if (!n) { break; }
+		len += n;
+	}
+	_dedup_throttle(d, len);
+	return len;
+}
+
+static uint64_t _dedup_rotl(uint64_t x, int r) {
+	return x << r | x >> (64 - r);
+}
+
+static uint64_t _dedup_round(uint64_t acc, uint64_t input) {
+	acc += input * DEDUP_P2;
+	return _dedup_rotl(acc, 31) * DEDUP_P1;
+}
+
+static uint64_t _dedup_merge(uint64_t h, uint64_t v) {
+	h ^= _dedup_round(0, v);
+	return h * DEDUP_P1 + DEDUP_P4;
+}
+
+/* Words are taken in the host's byte order since hashes never leave the
+ * process.
+ */
+static uint64_t _dedup_read64(const unsigned char *p) {
+	uint64_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+static uint32_t _dedup_read32(const unsigned char *p) {
+	uint32_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+/* Hash the whole file open on fd with XXH64.  Matching hashes only pick
+ * which files to compare, so any collision costs a comparison and nothing
+ * more.
+ */
+static int _dedup_hash(struct dedup *d, int fd, uint64_t *hash) {
+	uint64_t v[4] = {DEDUP_P1 + DEDUP_P2, DEDUP_P2, 0, -DEDUP_P1}, h;
+	const unsigned char *tail;
+	size_t i = 0, len;
+	off_t total = 0;
+	int k;
+	for (;;) {
+		ssize_t n = _dedup_read(d, fd, d->buf1, total);
+		if (0 > n) { return -1; }
+		len = n;
+		for (i = 0; i + 32 <= len; i += 32) {
+			for (k = 0; k < 4; ++k) {
+				v[k] = _dedup_round(v[k], _dedup_read64(&d->buf1[i + 8 * k]));
+			}
+		}
+		total += len;
+		if (DEDUP_BUFSIZE > len) { break; }
+	}
+	tail = &d->buf1[i];
+	len -= i;
+
+	if (32 <= total) {
+		h = _dedup_rotl(v[0], 1) + _dedup_rotl(v[1], 7)
+			+ _dedup_rotl(v[2], 12) + _dedup_rotl(v[3], 18);
+		for (k = 0; k < 4; ++k) { h = _dedup_merge(h, v[k]); }
+	}
+	else { h = DEDUP_P5; }
+	h += total;
+	for (; 8 <= len; tail += 8, len -= 8) {
+		h ^= _dedup_round(0, _dedup_read64(tail));
+		h = _dedup_rotl(h, 27) * DEDUP_P1 + DEDUP_P4;
+	}
+	if (4 <= len) {
+		h ^= _dedup_read32(tail) * DEDUP_P1;
+		h = _dedup_rotl(h, 23) * DEDUP_P2 + DEDUP_P3;
+		tail += 4;
+		len -= 4;
+	}
+	for (; len; ++tail, --len) {
+		h ^= *tail * DEDUP_P5;
+		h = _dedup_rotl(h, 11) * DEDUP_P1;
+	}
+	h ^= h >> 33;
+	h *= DEDUP_P2;
+	h ^= h >> 29;
+	h *= DEDUP_P3;
+	h ^= h >> 32;
+	*hash = h;
+	return 0;
+}
+
+/* Return 1 if the files open on fd1 and fd2 hold the same size bytes, 0 if
+ * they don't, or -1 on failure.
+ */
+static int _dedup_same(struct dedup *d, int fd1, int fd2, off_t size) {
+	off_t off = 0;
+	while (off < size) {
+		ssize_t n1 = _dedup_read(d, fd1, d->buf1, off);
+		ssize_t n2 = _dedup_read(d, fd2, d->buf2, off);
+		if (0 > n1 || 0 > n2) { return -1; }
+		if (n1 != n2 || memcmp(d->buf1, d->buf2, n1)) { return 0; }
+		if (!n1) { break; }
+		off += n1;
+	}
+	return 1;
+}
+
+/* Return non-zero if the file open on fd already shares its first extent
+ * with another, as files reflinked by a backend or an earlier pass do.
+ * (Positive logic.)
+ */
+static int _dedup_shared(int fd) {
+	struct {
+		struct fiemap f;
+		struct fiemap_extent e;
+	} m;
+	memset(&m, 0, sizeof(m));
+	m.f.fm_length = FIEMAP_MAX_OFFSET;
+	m.f.fm_extent_count = 1;
+	return !ioctl(fd, FS_IOC_FIEMAP, &m.f) && m.f.fm_mapped_extents
+		&& m.f.fm_extents[0].fe_flags & FIEMAP_EXTENT_SHARED;
+}
+
+/* Have the filesystem share the extents of the file open on fd1 with the
+ * file open on fd2, which it does only where their bytes match.  Returns
+ * 0 if the whole file is shared, 1 if it isn't, or -1 on failure.
+ */
+static int _dedup_reflink(struct dedup *d, int fd1, int fd2, off_t size) {
+	struct {
+		struct file_dedupe_range r;
+		struct file_dedupe_range_info info;
+	} args;
+	off_t off = 0;
+	while (off < size) {
+		memset(&args, 0, sizeof(args));
+		args.r.src_offset = off;
+		args.r.src_length = DEDUP_RANGE < size - off
+			? DEDUP_RANGE : size - off;
+		args.r.dest_count = 1;
+		args.info.dest_fd = fd2;
+		args.info.dest_offset = off;
+		if (ioctl(fd1, FIDEDUPERANGE, &args.r)) {
+			if (EOPNOTSUPP == errno || EINVAL == errno || EXDEV == errno
+				|| ETXTBSY == errno || EPERM == errno
+			) { return 1; }
+			return -1;
+		}
+		_dedup_throttle(d, 2 * args.info.bytes_deduped);
+		if (FILE_DEDUPE_RANGE_SAME != args.info.status
+			|| !args.info.bytes_deduped
+		) { return 1; }
+		off += args.info.bytes_deduped;
+	}
+	return 0;
+}
+
+/* Replace the file e names, open on fd2 and described by s2, with a hard
+ * link to the file open on fd1 if their bytes and metadata match.  It's
+ * done under a lease so nobody can have the file open, and everything
+ * after sees the link, which sandboxfs copies before changing.  Setuid,
+ * setgid, and sticky files are never linked, since they were copied so
+ * changes to their modes outside sandboxfs, as dpkg(1) makes in the base
+ * sandbox, don't reach them.  Returns 0 if it's replaced, 1 if it isn't,
+ * or -1 on failure.
+ */
+static int _dedup_link(
+	struct dedup *d, int fd1, const struct dir_entry *e, int fd2,
+	const struct stat *s2
+) {
+	int result = -1, leased = 0;
+	char tmp[NAME_MAX + 1];
+	struct stat s1, s3;
+	if (s2->st_mode & (S_ISUID | S_ISGID | S_ISVTX)) { return 1; }
+	WARN(fstat(fd1, &s1), "fstat");
+	if (s1.st_dev != s2->st_dev || s1.st_mode != s2->st_mode
+		|| s1.st_uid != s2->st_uid || s1.st_gid != s2->st_gid
+	) { RETURN(1); }
+	switch (_dedup_same(d, fd1, fd2, s2->st_size)) {
+	case 0:
+		RETURN(1);
+	case 1:
+		break;
+	default:
+		goto error;
+	}
+	if (fcntl(fd2, F_SETLEASE, F_WRLCK)) { RETURN(1); }
+	leased = 1;
+	WARN(fstat(fd2, &s3), "fstat");
+	if (s3.st_mtim.tv_sec != s2->st_mtim.tv_sec
+		|| s3.st_mtim.tv_nsec != s2->st_mtim.tv_nsec
+		|| s3.st_ctim.tv_sec != s2->st_ctim.tv_sec
+		|| s3.st_ctim.tv_nsec != s2->st_ctim.tv_nsec
+		|| sizeof(tmp) <= snprintf(tmp, sizeof(tmp), "%s~%d",
+			e->srcname, (int)getpid())
+	) { RETURN(1); }
+	if (linkat(fd1, "", e->srcfd, tmp, AT_EMPTY_PATH)) {
+		if (EMLINK == errno) { RETURN(1); }
+		WARN(1, "linkat");
+	}
+	if (renameat(e->srcfd, tmp, e->srcfd, e->srcname)) {
+		unlinkat(e->srcfd, tmp, 0);
+		WARN(1, "renameat");
+	}
+	result = 0;
+error:
+	if (leased) { fcntl(fd2, F_SETLEASE, F_UNLCK); }
+	return result;
+}
+
+/* Share the file e names, open on fd2 and described by s2, with the file
+ * open on fd1 if they match: by reflink if the filesystem can and, where
+ * sandboxfs protects both, by hard link if not.  Returns 1 if they're
+ * shared, 0 if not, or -1 on failure.
+ */
+static int _dedup_share(
+	struct dedup *d, int fd1, int linkable,
+	const struct dir_entry *e, int fd2, const struct stat *s2
+) {
+	if (d->reflink) {
+		switch (_dedup_reflink(d, fd1, fd2, s2->st_size)) {
+		case 0:
+			++d->counts.reflinked;
+			d->counts.saved += s2->st_size;
+			return 1;
+		case 1:
+			break;
+		default:
+			perror("ioctl");
+			return -1;
+		}
+	}
+	if (!d->cow || !linkable) { return 0; }
+	switch (_dedup_link(d, fd1, e, fd2, s2)) {
+	case 0:
+		++d->counts.linked;
+		d->counts.saved += s2->st_size;
+		return 1;
+	case 1:
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* Look for a file with the same contents as this one, first where it
+ * would be in the base sandbox, then among those seen so far, and share
+ * them.  Only files no other file links to are looked at since the rest
+ * are shared already.  A file that isn't shared may be shared with those
+ * that follow.
+ */
+static int _dedup_file(const struct dir_entry *e, void *ptr) {
+	struct dedup *d = (struct dedup *)ptr;
+	int result = -1, fd1 = -1, fd2 = -1;
+	if (!S_ISREG(e->type)) { return 0; }
+	const struct stat *s = dir_stat(e, STATX_NLINK | STATX_SIZE);
+	if (!s) { goto error; }
+	if (1 != s->st_nlink || !s->st_size) { RETURN(0); }
+	if (0 > (fd2 = openat(
+		e->srcfd, e->srcname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC
+	))) {
+		WARN(ENOENT != errno && ELOOP != errno, "openat");
+		RETURN(0);
+	}
+	struct stat s2;
+	WARN(fstat(fd2, &s2), "fstat");
+	if (!S_ISREG(s2.st_mode) || 1 != s2.st_nlink || _dedup_shared(fd2)) {
+		RETURN(0);
+	}
+
+	char pathname[PATH_MAX];
+	struct stat s1;
+	if (PATH_MAX <= snprintf(pathname, PATH_MAX, "%s%s/%s",
+		strcmp("/", d->base) ? d->base : "", &e->src[d->rootlen],
+		e->srcname
+	)) { RETURN(0); }
+	if (!lstat(pathname, &s1) && S_ISREG(s1.st_mode)
+		&& s1.st_size == s2.st_size
+		&& (s1.st_dev != s2.st_dev || s1.st_ino != s2.st_ino)
+		&& 0 <= (fd1 = open(pathname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC))
+	) {
+		int shared = _dedup_share(d, fd1, 1, e, fd2, &s2);
+		if (shared) { RETURN(0 > shared ? -1 : 0); }
+		close(fd1);
+		fd1 = -1;
+	}
+
+	/* Hash only files whose sizes match another's, including the first
+	 * file of each size once a second comes along.
+	 */
+	char key[64];
+	struct dedup_file *f;
+	uint64_t hash;
+	snprintf(key, sizeof(key), "%llx", (unsigned long long)s2.st_size);
+	if (PATH_MAX <= snprintf(pathname, PATH_MAX, "%s/%s",
+		e->src, e->srcname
+	)) { RETURN(0); }
+	if (!(f = (struct dedup_file *)g_hash_table_lookup(d->sizes, key))) {
+		g_hash_table_insert(d->sizes, strdup(key),
+			_dedup_file_new(pathname, d->cow));
+		RETURN(0);
+	}
+	if (&_dedup_hashed != f) {
+		f = _dedup_file_new(f->pathname, f->linkable);
+		g_hash_table_replace(d->sizes, strdup(key), &_dedup_hashed);
+		if (0 <= (fd1 = open(f->pathname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC))
+			&& !_dedup_hash(d, fd1, &hash)
+		) {
+			char key2[96];
+			snprintf(key2, sizeof(key2), "%s:%016llx",
+				key, (unsigned long long)hash);
+			g_hash_table_replace(d->hashes, strdup(key2), f);
+		}
+		else { _dedup_file_free(f); }
+		if (0 <= fd1) { close(fd1); }
+		fd1 = -1;
+	}
+	if (_dedup_hash(d, fd2, &hash)) {
+		perror("pread");
+		goto error;
+	}
+	snprintf(&key[strlen(key)], sizeof(key) - strlen(key), ":%016llx",
+		(unsigned long long)hash);
+	f = (struct dedup_file *)g_hash_table_lookup(d->hashes, key);
+	if (!f || 0 > (fd1 = open(
+		f->pathname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC
+	))) {
+		g_hash_table_replace(d->hashes, strdup(key),
+			_dedup_file_new(pathname, d->cow));
+		RETURN(0);
+	}
+	if (0 > _dedup_share(d, fd1, f->linkable, e, fd2, &s2)) { goto error; }
+
+	result = 0;
+error:
+	if (0 <= fd1) { close(fd1); }
+	if (0 <= fd2) { close(fd2); }
+	return result;
+}
+
+/* Stay on one device and skip the subtrees bind mounted read-only from
+ * elsewhere, which are on it too, and directories an earlier pass
+ * finished.
+ */
+static int _dedup_dev(const struct dir_entry *e, dev_t dev, void *ptr) {
+	struct dedup *d = (struct dedup *)ptr;
+	int i;
+	if (dev != e->st->s.st_dev) { return 1; } /* Don't descend. */
+	for (i = 0; d->share && d->share[i]; ++i) {
+		if (!strcmp(d->share[i], &e->src[d->rootlen])) { return 1; }
+	}
+	if (d->journal && journal_done(d->journal, e->src)) { return 1; }
+	return 0; /* Keep going. */
+}
+
+static int _dedup_after(const struct dir_entry *e, void *ptr) {
+	struct dedup *d = (struct dedup *)ptr;
+	if (d->journal && journal_mark(d->journal, e->src)) {
+		perror("journal_mark");
+		return -1;
+	}
+	return 0;
+}
+
+/* Share the files in dirname, on dev, that match files where they'd be in
+ * the tree at base or files the pass has already seen.  If cow is non-zero
+ * sandboxfs copies each file in dirname before changing it, so they may be
+ * hard linked to their match where they can't be reflinked.  They're only
+ * ever hard linked to files in the base sandbox or in other such trees.
+ * The subtrees of dirname named, from its top, in the null-terminated list
+ * share, if any, are skipped.
+ */
+int dedup_tree(
+	struct dedup *d, const char *dirname, const char *base, dev_t dev,
+	int cow, const char **share
+) {
+	struct stat s;
+	if (lstat(dirname, &s)) { return ENOENT == errno ? 0 : -1; }
+	if (!S_ISDIR(s.st_mode)) { return 0; }
+	d->root = dirname;
+	d->rootlen = strlen(dirname);
+	d->base = base;
+	d->cow = cow;
+	d->share = share;
+	return dir_walk(
+		dirname, dirname,
+		0,
+		dev,
+		_dedup_dev,
+		0,
+		0,
+		_dedup_file,
+		_dedup_after,
+		d,
+		0,
+		0
+	);
+}
@@ -0,0 +1,27 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <sys/types.h>
+
+struct dedup;
+struct journal;
+
+/* What a deduplication pass has shared so far.
+ */
+struct dedup_counts {
+	unsigned long reflinked;  /* Sharing extents with their match. */
+	unsigned long linked;     /* Replaced by a hard link to their match. */
+	unsigned long long saved; /* Bytes no longer stored twice. */
+};
+
+void dedup_rate(unsigned long rate);
+
+struct dedup *dedup_new(struct journal *journal, int reflink);
+int dedup_tree(
+	struct dedup *d, const char *dirname, const char *base, dev_t dev,
+	int cow, const char **share
+);
+void dedup_counts(const struct dedup *d, struct dedup_counts *c);
+void dedup_free(struct dedup *d);
+
+#endif
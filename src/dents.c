@@ -0,0 +1,107 @@
+#include "dents.h"
+#include "macros.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Read this much of a directory per getdents64(2), growing the buffer
+ * as needed for larger directories.
+ */
+#define DENTS_BUF (64 * 1024)
+
+/* Read every entry in the directory open on fd.  The entries stay valid
+ * until dents_free.  Returns zero on success.
+ */
+int dents_read(int fd, struct dents *d) {
+	memset(d, 0, sizeof(struct dents));
+	long len;
+	for (;;) {
+		if (DENTS_BUF > d->cap - d->len) {
+			d->cap = d->cap ? 2 * d->cap : DENTS_BUF;
+			FATAL(!(d->buf = (char *)realloc(d->buf, d->cap)), "realloc");
+		}
+		len = syscall(SYS_getdents64, fd, d->buf + d->len, d->cap - d->len);
+		if (0 >= len) { break; }
+		d->len += len;
+	}
+	if (0 > len) { return -1; }
+
+	/* Index the entries now that the buffer won't move.
+	 */
+	size_t off;
+	for (off = 0; off < d->len;) {
+		struct dents_entry *entry = (struct dents_entry *)(d->buf + off);
+		off += entry->reclen;
+		if ('.' == entry->name[0] && (!entry->name[1]
+			|| ('.' == entry->name[1] && !entry->name[2])
+		)) { continue; }
+		if (d->n == d->ncap) {
+			d->ncap = d->ncap ? 2 * d->ncap : 64;
+			FATAL(!(d->entries = (struct dents_entry **)realloc(
+				d->entries, d->ncap * sizeof(struct dents_entry *)
+			)), "realloc");
+		}
+		d->entries[d->n++] = entry;
+	}
+	return 0;
+}
+
+static int _dents_ino(const void *a, const void *b) {
+	uint64_t ino1 = (*(const struct dents_entry **)a)->ino;
+	uint64_t ino2 = (*(const struct dents_entry **)b)->ino;
+	return ino1 < ino2 ? -1 : ino1 > ino2;
+}
+
+/* Sort entries by inode number, which on most filesystems is the order
+ * their inodes are laid out on disk.
+ */
+void dents_sort(struct dents *d) {
+	qsort(d->entries, d->n, sizeof(struct dents_entry *), _dents_ino);
+}
+
+void dents_free(struct dents *d) {
+	free(d->buf);
+	free(d->entries);
+	memset(d, 0, sizeof(struct dents));
+}
+
+/* Stat a name relative to fd without following symbolic links, asking
+ * only for the fields in mask (STATX_*) where statx(2) is available.  The
+ * device and file type are always filled in.  Returns zero on success.
+ */
+int dents_stat(int fd, const char *name, unsigned int mask, struct stat *s) {
+	static int nostatx = 0;
+	if (!nostatx) {
+		struct statx x;
+		if (!statx(fd, name, AT_SYMLINK_NOFOLLOW, mask, &x)) {
+			memset(s, 0, sizeof(struct stat));
+			s->st_dev = makedev(x.stx_dev_major, x.stx_dev_minor);
+			s->st_ino = x.stx_ino;
+			s->st_mode = x.stx_mode;
+			s->st_nlink = x.stx_nlink;
+			s->st_uid = x.stx_uid;
+			s->st_gid = x.stx_gid;
+			s->st_rdev = makedev(x.stx_rdev_major, x.stx_rdev_minor);
+			s->st_size = x.stx_size;
+			s->st_blksize = x.stx_blksize;
+			s->st_blocks = x.stx_blocks;
+			s->st_atim.tv_sec = x.stx_atime.tv_sec;
+			s->st_atim.tv_nsec = x.stx_atime.tv_nsec;
+			s->st_mtim.tv_sec = x.stx_mtime.tv_sec;
+			s->st_mtim.tv_nsec = x.stx_mtime.tv_nsec;
+			s->st_ctim.tv_sec = x.stx_ctime.tv_sec;
+			s->st_ctim.tv_nsec = x.stx_ctime.tv_nsec;
+			return 0;
+		}
+		if (ENOSYS != errno) { return -1; }
+		nostatx = 1;
+	}
+	return fstatat(fd, name, s, AT_SYMLINK_NOFOLLOW);
+}
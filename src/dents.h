@@ -0,0 +1,33 @@
+#ifndef DENTS_H
+#define DENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* A directory entry exactly as getdents64(2) returns it.
+ */
+struct dents_entry {
+	uint64_t ino;
+	int64_t off;
+	unsigned short reclen;
+	unsigned char type; /* DT_* or DT_UNKNOWN. */
+	char name[];
+};
+
+/* Every entry in a directory except . and .., read in bulk.
+ */
+struct dents {
+	char *buf;
+	size_t len, cap;
+	struct dents_entry **entries;
+	size_t n, ncap;
+};
+
+int dents_read(int fd, struct dents *d);
+void dents_sort(struct dents *d);
+void dents_free(struct dents *d);
+
+int dents_stat(int fd, const char *name, unsigned int mask, struct stat *s);
+
+#endif
@@ -1,247 +1,803 @@
+#include "dents.h"
 #include "dir.h"
 #include "file.h"
+#include "journal.h"
 #include "macros.h"
 #include "message.h"
+#include "pool.h"
+#include "rules.h"
+#include "tree.h"
+#include "uring.h"
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mount.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <unistd.h>
-#include <utime.h>
 
 #ifndef MNT_DETACH
 #define MNT_DETACH 2
 #endif
 
-/* Walk a directory tree recursively, executing callbacks along the way.
- * Subdirectories will be processed in parallel if forks is greater than
- * zero.  Forks is decremented each time we descend into a new level.
+#define DIR_OPEN (O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+
+/* The root of a walk may be reached through a symbolic link, as /home
+ * often is, but nothing beneath it is.
  */
-int dir_walk(
-	const char *src, const char *dest,
-	const char **exclude,
-	dev_t dev,
-	int(*dev_cb)(
-		const char *src, const char *dest,
-		dev_t dev,
-		const struct stat *s,
-		void *ptr
-	),
-	int(*before_cb)(
-		const char *src, const char *dest,
-		const struct stat *s,
-		void *ptr
-	),
-	int(*symlink_cb)(
-		const char *src, const char *dest,
-		const char *basename, const char *pathname,
-		const struct stat *s,
-		void *ptr
-	),
-	int(*hardlink_cb)(
-		const char *src, const char *dest,
-		const char *basename, const char *pathname,
-		const struct stat *s,
-		void *ptr
-	),
-	int(*after_cb)(
-		const char *src, const char *dest,
-		const struct stat *s,
-		void *ptr
-	),
-	void *ptr,
-	const char *m, /* "walking %s" */
-	int forks
+#define DIR_OPEN_ROOT (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+
+/* The root of one destination, which is never walked into.
+ */
+struct dir_root {
+	dev_t dev;
+	ino_t ino;
+};
+
+/* State shared by every directory visited during one walk.  The callbacks
+ * are only consulted by the generic walker; specialized walkers have their
+ * own compiled in (see DIR_WALKER).
+ */
+struct dir_walk {
+	void (*visit)(void *);  /* Walks one directory. */
+	dev_t dev;
+	int(*dev_cb)(const struct dir_entry *e, dev_t dev, void *ptr);
+	int(*before_cb)(const struct dir_entry *e, void *ptr);
+	int(*symlink_cb)(const struct dir_entry *e, void *ptr);
+	int(*hardlink_cb)(const struct dir_entry *e, void *ptr);
+	int(*after_cb)(const struct dir_entry *e, void *ptr);
+	void *ptr;
+	const char *m;
+	const struct tree *tree; /* Entries come from here if not null. */
+	int ignore;             /* Honor RULES_IGNORE files. */
+	struct pool *pool;      /* Null when walking in the calling thread. */
+	struct dir_node *stack; /* Directories waiting when walking serially. */
+	int pending;            /* Directories not yet finished. */
+	int result;
+	int same;               /* Source and destination are the same tree. */
+	int ndests;             /* Destinations written at once. */
+	struct dir_root *roots; /* One per destination. */
+	struct journal **journals; /* One per destination or null. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* A directory's copy in one destination.
+ */
+struct dir_dest {
+	char *path;
+	int fd;
+	int done; /* Non-zero if an earlier walk finished it. */
+};
+
+/* One directory in a walk.  A directory is finished, and its after_cb
+ * run, once it and every directory beneath it has been walked.  Full paths
+ * are kept once per directory for messages and mount(2); everything else
+ * happens relative to srcfd and each destination's fd.  A directory holds
+ * its descriptors open for its children until it's finished if the
+ * descriptor budget allows, otherwise its children fall back to whole
+ * paths.  The source is read once however many destinations there are;
+ * only the callbacks run once per destination.
+ */
+struct dir_node {
+	struct dir_walk *walk;
+	struct dir_node *parent;
+	struct dir_node *next; /* Link in walk->stack. */
+	char *src;
+	const char *name;      /* Basename of src and dests within parent. */
+	uint32_t index;        /* Index in walk->tree. */
+	int live;              /* Non-zero to read it instead (see tree.h). */
+	struct rules_state *rules; /* What's excluded within. */
+	int srcfd;
+	struct dir_stat st;
+	int refs;              /* This directory plus unfinished children. */
+	int before;            /* Non-zero once before_cb has succeeded. */
+	int fds;               /* Descriptors counted against the budget. */
+	int held;              /* Non-zero if they're open for children. */
+	int failed;            /* Non-zero if it or anything beneath failed. */
+	struct dir_dest dests[]; /* One per destination in the walk. */
+};
+
+/* The shared pool of workers that walks directories in parallel.  It's
+ * started by the first parallel walk with dir_workers threads, which
+ * defaults to the number of processors.
+ */
+static struct pool *_dir_pool = 0;
+static int _dir_workers = 0;
+static pthread_mutex_t _dir_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Directory descriptors open across all walks and the most that may be
+ * held open for children, which is half the soft limit on open files.
+ */
+static int _dir_fds = 0;
+static int _dir_fds_max = 0;
+
+/* A forked child doesn't inherit the worker threads so it must start its
+ * own pool if it walks in parallel.
+ */
+static void _dir_pool_forget() { _dir_pool = 0; }
+
+static struct pool *_dir_pool_get() {
+	pthread_mutex_lock(&_dir_pool_lock);
+	if (!_dir_pool) {
+		_dir_pool = pool_new(_dir_workers ?: pool_cpus());
+		static int atfork = 0;
+		if (!atfork) {
+			pthread_atfork(0, 0, _dir_pool_forget);
+			atfork = 1;
+		}
+	}
+	pthread_mutex_unlock(&_dir_pool_lock);
+	return _dir_pool;
+}
+
+/* Set the number of threads used by parallel walks.  Zero means one per
+ * processor.  This must be called before the first parallel walk.
+ */
+void dir_workers(int workers) { _dir_workers = 0 < workers ? workers : 0; }
+
+/* Visit each directory's entries in inode order rather than the order
+ * the filesystem returns them, which on ext4 is hash order and on a cold
+ * cache means seeking all over the inode table.
+ */
+static int _dir_inode_order = 0;
+void dir_inode_order() { _dir_inode_order = 1; }
+
+/* Count directory descriptors being opened or closed.  When opening,
+ * return zero if they may be held open for children, which they may be
+ * while the total stays within the budget.
+ */
+static int _dir_fds_count(int n) {
+	if (!_dir_fds_max) {
+		struct rlimit r;
+		if (getrlimit(RLIMIT_NOFILE, &r) || RLIM_INFINITY == r.rlim_cur) {
+			r.rlim_cur = 1024;
+		}
+		_dir_fds_max = r.rlim_cur / 2;
+	}
+	return __sync_add_and_fetch(&_dir_fds, n) <= _dir_fds_max ? 0 : -1;
+}
+
+/* Allocate a directory with no descriptors open.
+ */
+static struct dir_node *_dir_node_new(struct dir_walk *walk) {
+	struct dir_node *node = (struct dir_node *)calloc(1,
+		sizeof(struct dir_node) + walk->ndests * sizeof(struct dir_dest));
+	FATAL(!node, "calloc");
+	node->walk = walk;
+	node->srcfd = -1;
+	int k;
+	for (k = 0; k < walk->ndests; ++k) { node->dests[k].fd = -1; }
+	return node;
+}
+
+/* Fill in an entry for a directory's own callbacks in the kth destination,
+ * relative to its parent's descriptors if they're being held.
+ */
+static void _dir_entry(struct dir_node *node, int k, struct dir_entry *e) {
+	struct dir_node *parent = node->parent;
+	e->src = node->src;
+	e->dest = node->dests[k].path;
+	if (parent && parent->held) {
+		e->srcfd = parent->srcfd;
+		e->srcname = node->name;
+	}
+	else {
+		e->srcfd = AT_FDCWD;
+		e->srcname = node->src;
+	}
+	if (parent && parent->held && 0 <= parent->dests[k].fd) {
+		e->destfd = parent->dests[k].fd;
+		e->destname = node->name;
+	}
+	else {
+		e->destfd = AT_FDCWD;
+		e->destname = node->dests[k].path;
+	}
+	e->type = S_IFDIR;
+	e->st = &node->st;
+}
+
+/* Point an entry within a directory at that directory's copy in the kth
+ * destination.
+ */
+static inline void _dir_dest(
+	const struct dir_node *node, int k, struct dir_entry *e
 ) {
+	e->dest = node->dests[k].path;
+	e->destfd = node->dests[k].fd;
+}
+
+/* Return the entry's metadata, fetching whichever fields in mask (STATX_*)
+ * haven't been already.  The device and file type are valid whenever
+ * anything is.  Returns a null pointer on failure.
+ */
+const struct stat *dir_stat(const struct dir_entry *e, unsigned int mask) {
+	struct dir_stat *st = e->st;
+	if (!st->mask || mask & ~st->mask) {
+		mask |= st->mask | STATX_TYPE;
+		if (dents_stat(e->srcfd, e->srcname, mask, &st->s)) {
+			perror("statx");
+			return 0;
+		}
+		st->mask = mask;
+	}
+	return &st->s;
+}
+
+/* Close a directory's descriptors.
+ */
+static void _dir_close(struct dir_node *node) {
+	int k;
+	for (k = 0; k < node->walk->ndests; ++k) {
+		struct dir_dest *d = &node->dests[k];
+		if (d->fd != node->srcfd && 0 <= d->fd) { close(d->fd); }
+		d->fd = -1;
+	}
+	if (0 <= node->srcfd) { close(node->srcfd); }
+	node->srcfd = -1;
+	_dir_fds_count(-node->fds);
+	node->fds = 0;
+}
+
+/* Queue a directory to be walked, in the pool if there is one.
+ */
+static void _dir_walk_queue(struct dir_node *node) {
+	struct dir_walk *walk = node->walk;
+	if (walk->pool) { pool_submit(walk->pool, walk->visit, node); }
+	else {
+		node->next = walk->stack;
+		walk->stack = node;
+	}
+}
+
+/* Drop a reference to a directory.  The last reference finishes the
+ * directory, which in turn drops the reference it held on its parent.
+ */
+static inline __attribute__((always_inline)) void _dir_walk_release(
+	struct dir_node *node,
+	int(*after_cb)(const struct dir_entry *e, void *ptr)
+) {
+	while (node && !__sync_sub_and_fetch(&node->refs, 1)) {
+		struct dir_walk *walk = node->walk;
+		struct dir_node *parent = node->parent;
+		int k;
+		_dir_close(node);
+
+		/* Clean up directory.
+		 */
+		for (k = 0; after_cb && node->before && k < walk->ndests; ++k) {
+			if (node->dests[k].done) { continue; }
+			struct dir_entry e;
+			_dir_entry(node, k, &e);
+			if (after_cb(&e, walk->ptr)) {
+				walk->result = -1;
+				node->failed = 1;
+			}
+		}
+
+		/* Journal the directory as finished only if everything beneath
+		 * it is, too.
+		 */
+		for (k = 0; walk->journals && !node->failed && k < walk->ndests; ++k) {
+			if (node->dests[k].done || !walk->journals[k]) { continue; }
+			if (journal_mark(walk->journals[k], node->dests[k].path)) {
+				walk->result = -1;
+			}
+		}
+		if (node->failed && parent) { parent->failed = 1; }
+
+		rules_state_free(node->rules);
+		free(node->src);
+		for (k = 0; k < walk->ndests; ++k) { free(node->dests[k].path); }
+		free(node);
+		pthread_mutex_lock(&walk->lock);
+		if (!--walk->pending) { pthread_cond_broadcast(&walk->cond); }
+		pthread_mutex_unlock(&walk->lock);
+		node = parent;
+	}
+}
+
+/* Return non-zero if name, relative to fd, is the root of a mount, which
+ * catches bind mounts of the filesystem it's on where statx(2) can tell.
+ * (Positive logic.)
+ */
+static int _dir_mount_root(int fd, const char *name) {
+#ifdef STATX_ATTR_MOUNT_ROOT
+	struct statx x;
+	if (!statx(fd, name, AT_SYMLINK_NOFOLLOW | (*name ? 0 : AT_EMPTY_PATH),
+			0, &x)
+		&& x.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT
+		&& x.stx_attributes & STATX_ATTR_MOUNT_ROOT
+	) { return 1; }
+#endif
+	return 0;
+}
+
+/* Return non-zero if the directory open on fd is the root of a mount,
+ * erring on the side of yes.  (Positive logic.)
+ */
+static int _dir_mounted(int fd) {
+	struct stat s1, s2;
+	if (fstat(fd, &s1) || fstatat(fd, "..", &s2, 0)) { return 1; }
+	if (s1.st_dev != s2.st_dev) { return 1; }
+	return _dir_mount_root(fd, "");
+}
+
+/* Remove the links an interrupted walk left in a destination directory so
+ * they can be made again.  Subdirectories are left for their own turn.  A
+ * device dev_cb mounted there is left alone and 1 is returned since
+ * there's nothing more to do.
+ */
+static int _dir_journal_clear(const struct dir_entry *e) {
 	int result = -1;
-	int i;
-	DIR *dirp = 0;
-	char *pathname = 0;
-	int children = 0;
+	struct dents d = {0};
+	size_t i;
+	int fd = openat(e->destfd, e->destname, DIR_OPEN);
+	if (0 > fd) {
+		WARN(ENOENT != errno, "openat");
+		RETURN(0);
+	}
+	if (_dir_mounted(fd)) { RETURN(1); }
+	WARN(dents_read(fd, &d), "getdents64");
+	for (i = 0; i < d.n; ++i) {
+		struct dents_entry *entry = d.entries[i];
+		if (DT_DIR == entry->type) { continue; }
+		if (unlinkat(fd, entry->name, 0) && EISDIR != errno) {
+			WARN(1, "unlinkat");
+		}
+	}
+	result = 0;
+error:
+	dents_free(&d);
+	if (0 <= fd) { close(fd); }
+	return result;
+}
 
-	if (m) { message(m, src); }
+/* Walk one directory.  This is always inlined into a walker whose callbacks
+ * are known at compile time so missing callbacks cost nothing and present
+ * ones are called directly.
+ */
+static inline __attribute__((always_inline)) void _dir_walk_visit(
+	struct dir_node *node,
+	int(*dev_cb)(const struct dir_entry *e, dev_t dev, void *ptr),
+	int(*before_cb)(const struct dir_entry *e, void *ptr),
+	int(*symlink_cb)(const struct dir_entry *e, void *ptr),
+	int(*hardlink_cb)(const struct dir_entry *e, void *ptr),
+	int(*after_cb)(const struct dir_entry *e, void *ptr)
+) {
+	struct dir_walk *walk = node->walk;
+	const char *src = node->src;
+	struct dents d = {0};
+	size_t i;
+	int k;
+
+	if (walk->m) { message(walk->m, src); }
 
-	/* Don't recurse into yourself or excluded directories.
+	struct dir_entry e;
+	_dir_entry(node, 0, &e);
+	const struct stat *s = dir_stat(&e, STATX_INO);
+	if (!s) { goto error; }
+
+	/* Don't recurse into yourself.
 	 */
-	char *srcsrc = strdup(src);
-	FATAL(!srcsrc, "strdup");
-	srcsrc = (char *)realloc(srcsrc, 1 + 2 * strlen(src));
-	FATAL(!srcsrc, "realloc");
-	strcat(srcsrc, src);
-	if (!strcmp(srcsrc, dest)) {
-		free(srcsrc);
-		return 0;
-	}
-	free(srcsrc);
-	for (i = 0; exclude[i]; ++i) {
-		if (!strcmp(src, exclude[i])) { return 0; }
+	for (k = 0; node->parent && k < walk->ndests; ++k) {
+		if (walk->roots[k].ino == s->st_ino
+			&& walk->roots[k].dev == s->st_dev
+		) { goto done; }
 	}
 
-	struct stat s;
-	WARN(lstat(src, &s), "lstat");
+	/* Skip destinations where an earlier walk finished this directory and
+	 * clear out those where it was cut short.
+	 */
+	if (walk->journals) {
+		int todo = 0;
+		for (k = 0; k < walk->ndests; ++k) {
+			struct dir_dest *dd = &node->dests[k];
+			struct journal *j = walk->journals[k];
+			if (!dd->done && j && journal_done(j, dd->path)) { dd->done = 1; }
+			if (dd->done) { continue; }
+			_dir_entry(node, k, &e);
+			switch (j && journal_resumed(j) ? _dir_journal_clear(&e) : 0) {
+			case 0:
+				++todo;
+				break;
+			case 1:
+				dd->done = 1;
+				break;
+			default:
+				goto error;
+			}
+		}
+		if (!todo) { goto done; }
+	}
 
-	/* Handle device boundaries.  Differentiate between false and failure.
+	/* Handle device boundaries in every destination.  Differentiate
+	 * between false and failure.
 	 */
 	if (dev_cb) {
-		switch (dev_cb(src, dest, dev, &s, ptr)) {
-		case 0:
-			break;
-		case 1:
-			return 0;
-		default:
-			return -1;
+		int descend = 1;
+		for (k = 0; k < walk->ndests; ++k) {
+			if (node->dests[k].done) { continue; }
+			_dir_entry(node, k, &e);
+			switch (dev_cb(&e, walk->dev, walk->ptr)) {
+			case 0:
+				break;
+			case 1:
+				descend = 0;
+				break;
+			default:
+				goto error;
+			}
 		}
+		if (!descend) { goto done; }
 	}
 
-	/* Recreate the source in the destination directory.
+	/* Recreate the source in each destination directory.
 	 */
-	if (before_cb && before_cb(src, dest, &s, ptr)) { goto error; }
-	WARN(!(dirp = opendir(src)), "opendir");
-	struct dirent *entry;
-	while ((entry = readdir(dirp))) {
-		char *basename = entry->d_name;
-		if (!strcmp(".", basename)) { continue; }
-		if (!strcmp("..", basename)) { continue; }
-		pathname = file_join(src, basename);
+	for (k = 0; before_cb && k < walk->ndests; ++k) {
+		if (node->dests[k].done) { continue; }
+		_dir_entry(node, k, &e);
+		if (before_cb(&e, walk->ptr)) { goto error; }
+	}
+	node->before = 1;
+	int flags = node->parent ? DIR_OPEN : DIR_OPEN_ROOT;
+	WARN(0 > (node->srcfd = openat(e.srcfd, e.srcname, flags)), "openat");
+	int fds = 1;
+	for (k = 0; k < walk->ndests; ++k) {
+		struct dir_dest *dd = &node->dests[k];
+		if (dd->done) { continue; }
+		if (walk->same) { dd->fd = node->srcfd; }
+		else if (before_cb || symlink_cb || hardlink_cb) {
+			_dir_entry(node, k, &e);
+			WARN(0 > (dd->fd = openat(e.destfd, e.destname, flags)),
+				"openat");
+			++fds;
+		}
+
+		/* Note the root of the destination so it's never walked into.
+		 */
 		struct stat s2;
-		WARN(lstat(pathname, &s2), "lstat");
+		if (!node->parent && 0 <= dd->fd && !fstat(dd->fd, &s2)) {
+			walk->roots[k].dev = s2.st_dev;
+			walk->roots[k].ino = s2.st_ino;
+		}
+	}
+
+	/* Keep these descriptors open for subdirectories if there's room.
+	 */
+	node->fds = fds;
+	node->held = !_dir_fds_count(node->fds);
+
+	/* Take entries from the snapshot if there is one.  Otherwise read the
+	 * whole directory up front and classify entries by the type it reports,
+	 * only calling stat where the filesystem doesn't say.  A file's mode
+	 * and owner can change without changing its directory, which is all a
+	 * snapshot is checked against, so those are always asked of the file
+	 * itself.
+	 */
+	const struct tree *t = node->live ? 0 : walk->tree;
+	size_t n;
+	if (t) { n = t->count[node->index]; }
+	else {
+		WARN(dents_read(node->srcfd, &d), "getdents64");
+		if (_dir_inode_order) { dents_sort(&d); }
+		n = d.n;
+	}
+
+	/* A directory's own rules take precedence over everything above it.
+	 */
+	if (walk->ignore) {
+		for (i = 0; i < n; ++i) {
+			if (strcmp(RULES_IGNORE, t
+				? tree_name(t, t->first[node->index] + i)
+				: d.entries[i]->name
+			)) { continue; }
+			struct rules *r = rules_new(src);
+			int result = rules_loadat(r, node->srcfd, RULES_IGNORE);
+			node->rules = rules_push(node->rules, r);
+			rules_unref(r);
+			if (result) { goto error; }
+			break;
+		}
+	}
+
+	e.src = src;
+	e.srcfd = node->srcfd;
+	_dir_dest(node, 0, &e);
+	for (i = 0; i < n; ++i) {
+		const char *basename;
+		uint32_t index = 0;
+		struct dir_stat st2;
+		st2.mask = 0;
+		e.st = &st2;
+		if (t) {
+			index = t->first[node->index] + i;
+			basename = tree_name(t, index);
+			tree_stat(t, index, &st2.s);
+			st2.mask = TREE_STATX;
+			if (!S_ISDIR(st2.s.st_mode)) {
+				st2.mask &= ~(STATX_MODE | STATX_UID | STATX_GID);
+			}
+			e.srcname = e.destname = basename;
+			e.type = st2.s.st_mode & S_IFMT;
+		}
+		else {
+			struct dents_entry *entry = d.entries[i];
+			basename = entry->name;
+			e.srcname = e.destname = basename;
+			if (DT_UNKNOWN == entry->type) {
+				if (!dir_stat(&e, STATX_TYPE)) { goto error; }
+				e.type = st2.s.st_mode & S_IFMT;
+			}
+			else { e.type = DTTOIF(entry->type); }
+		}
+
+		/* Leave out whatever's excluded.
+		 */
+		struct rules_state *rules = 0;
+		if (node->rules && rules_match(
+			node->rules, basename, S_ISDIR(e.type), &rules
+		)) { continue; }
 
 		/* Handle symbolic links.
 		 */
-		if (S_ISLNK(s2.st_mode)) {
-			if (symlink_cb && symlink_cb(
-				src, dest,
-				basename, pathname,
-				&s2,
-				ptr
-			)) { goto error; }
+		if (S_ISLNK(e.type)) {
+			for (k = 0; symlink_cb && k < walk->ndests; ++k) {
+				if (node->dests[k].done) { continue; }
+				_dir_dest(node, k, &e);
+				if (symlink_cb(&e, walk->ptr)) { goto error; }
+			}
 		}
 
-		/* Recurse into directories.
+		/* Queue directories, which hold a reference to this one until
+		 * they're finished.
 		 */
-		else if (S_ISDIR(s2.st_mode)) {
-			if (forks) {
-				pid_t pid = fork();
-				WARN(-1 == pid, "fork");
-				if (pid) { ++children; }
-				else {
-					char *dest2 = file_join(dest, basename);
-					dir_walk(
-						pathname, dest2,
-						exclude,
-						dev,
-						dev_cb, before_cb, symlink_cb, hardlink_cb, after_cb,
-						ptr,
-						m,
-						forks - 1
-					);
-					free(dest2);
-					exit(0);
-				}
-			}
-			else {
-				char *dest2 = file_join(dest, basename);
-				dir_walk(
-					pathname, dest2,
-					exclude,
-					dev,
-					dev_cb, before_cb, symlink_cb, hardlink_cb, after_cb,
-					ptr,
-					m,
-					0
-				);
-				free(dest2);
+		else if (S_ISDIR(e.type)) {
+			struct dir_node *child = _dir_node_new(walk);
+			child->parent = node;
+			child->src = file_join(src, basename);
+			for (k = 0; k < walk->ndests; ++k) {
+				child->dests[k].path =
+					file_join(node->dests[k].path, basename);
+				child->dests[k].done = node->dests[k].done;
 			}
+			child->name = strrchr(child->src, '/') + 1;
+			child->index = index;
+			child->live = !t || S_ISVTX & st2.s.st_mode;
+			child->rules = rules;
+			child->st = st2;
+			child->refs = 1;
+			__sync_fetch_and_add(&node->refs, 1);
+			pthread_mutex_lock(&walk->lock);
+			++walk->pending;
+			pthread_mutex_unlock(&walk->lock);
+			_dir_walk_queue(child);
 		}
 
 		/* Handle hard links.
 		 */
-		else if (hardlink_cb && hardlink_cb(
-			src, dest, basename, pathname, &s2, ptr
-		)) {
-			goto error;
+		else {
+			for (k = 0; hardlink_cb && k < walk->ndests; ++k) {
+				if (node->dests[k].done) { continue; }
+				_dir_dest(node, k, &e);
+				if (hardlink_cb(&e, walk->ptr)) { goto error; }
+			}
 		}
 
-		free(pathname);
 	}
-	pathname = 0; /* Prevent double-free. */
+	goto done;
 
-	result = 0;
 error:
-	closedir(dirp);
-	free(pathname);
+	walk->result = -1;
+	node->failed = 1;
+done:
 
-	/* Wait on children.
+	/* Wait for any links the callbacks batched before the names and
+	 * descriptors they refer to go away.
 	 */
-	for (; children > 0; --children) {
-		int status;
-		wait(&status);
+	if (uring_flush()) { walk->result = -1; }
+	dents_free(&d);
+	if (!node->held) { _dir_close(node); }
+	_dir_walk_release(node, after_cb);
+}
+
+/* Define a walker specialized for one set of callbacks, any of which may
+ * be 0.
+ */
+#define DIR_WALKER(name, dev_cb, before_cb, symlink_cb, hardlink_cb, after_cb) \
+	static void name(void *arg) { \
+		_dir_walk_visit( \
+			(struct dir_node *)arg, \
+			dev_cb, before_cb, symlink_cb, hardlink_cb, after_cb \
+		); \
+	}
+
+/* The generic walker calls whatever callbacks the walk was given.
+ */
+static void _dir_walk_node(void *arg) {
+	struct dir_walk *walk = ((struct dir_node *)arg)->walk;
+	_dir_walk_visit(
+		(struct dir_node *)arg,
+		walk->dev_cb,
+		walk->before_cb,
+		walk->symlink_cb,
+		walk->hardlink_cb,
+		walk->after_cb
+	);
+}
+
+/* Walk a directory tree recursively, executing callbacks along the way.
+ * Subdirectories will be walked in parallel by the shared pool of workers
+ * if parallel is non-zero, otherwise in the calling thread.  Walks started
+ * from within a worker (a callback that itself walks) are always serial.
+ * Every directory's after_cb runs once everything beneath it is finished.
+ * Returns zero if every directory was walked without error.  Links a
+ * calling walk still has queued in this thread are finished first, and
+ * their failures returned, so this walk's flushes never take the blame
+ * for them or hide them from the caller.
+ */
+static int _dir_walk(
+	const char *src,
+	const char **dests, struct journal **journals, int ndests,
+	const struct tree *tree,
+	struct rules *rules,
+	dev_t dev,
+	void (*visit)(void *),
+	int(*dev_cb)(const struct dir_entry *e, dev_t dev, void *ptr),
+	int(*before_cb)(const struct dir_entry *e, void *ptr),
+	int(*symlink_cb)(const struct dir_entry *e, void *ptr),
+	int(*hardlink_cb)(const struct dir_entry *e, void *ptr),
+	int(*after_cb)(const struct dir_entry *e, void *ptr),
+	void *ptr,
+	const char *m, /* "walking %s" */
+	int parallel
+) {
+	int flushed = uring_flush();
+	struct dir_walk walk = {
+		visit,
+		dev,
+		dev_cb, before_cb, symlink_cb, hardlink_cb, after_cb,
+		ptr,
+		m,
+		tree,
+		!!rules,
+		0,
+		0,
+		1,
+		0,
+		1 == ndests && !strcmp(src, dests[0]),
+		ndests,
+		0,
+		journals
+	};
+	FATAL(!(walk.roots = (struct dir_root *)calloc(
+		ndests, sizeof(struct dir_root)
+	)), "calloc");
+	pthread_mutex_init(&walk.lock, 0);
+	pthread_cond_init(&walk.cond, 0);
+	if (parallel) {
+		walk.pool = _dir_pool_get();
+		if (pool_worker(walk.pool)) { walk.pool = 0; }
+	}
+
+	struct dir_node *node = _dir_node_new(&walk);
+	int k;
+	FATAL(!(node->src = strdup(src)), "strdup");
+	for (k = 0; k < ndests; ++k) {
+		FATAL(!(node->dests[k].path = strdup(dests[k])), "strdup");
 	}
+	node->name = node->src;
+	node->rules = rules_start(rules, src);
+	if (tree) {
+		tree_stat(tree, 0, &node->st.s);
+		node->st.mask = TREE_STATX;
+		node->live = !!(S_ISVTX & node->st.s.st_mode);
+	}
+	else if (!stat(src, &node->st.s)) { node->st.mask = STATX_BASIC_STATS; }
+	node->refs = 1;
+	_dir_walk_queue(node);
 
-	/* Clean up directory.
+	/* Walk serially until the stack is empty or wait for the pool to
+	 * finish every directory.
 	 */
-	if (after_cb && after_cb(src, dest, &s, ptr)) { result = -1; }
+	if (walk.pool) {
+		pthread_mutex_lock(&walk.lock);
+		while (walk.pending) { pthread_cond_wait(&walk.cond, &walk.lock); }
+		pthread_mutex_unlock(&walk.lock);
+	}
+	else {
+		while ((node = walk.stack)) {
+			walk.stack = node->next;
+			walk.visit(node);
+		}
+	}
 
-	return result;
+	free(walk.roots);
+	pthread_mutex_destroy(&walk.lock);
+	pthread_cond_destroy(&walk.cond);
+	return flushed ? -1 : walk.result;
+}
+int dir_walk(
+	const char *src, const char *dest,
+	struct rules *rules,
+	dev_t dev,
+	int(*dev_cb)(const struct dir_entry *e, dev_t dev, void *ptr),
+	int(*before_cb)(const struct dir_entry *e, void *ptr),
+	int(*symlink_cb)(const struct dir_entry *e, void *ptr),
+	int(*hardlink_cb)(const struct dir_entry *e, void *ptr),
+	int(*after_cb)(const struct dir_entry *e, void *ptr),
+	void *ptr,
+	const char *m, /* "walking %s" */
+	int parallel
+) {
+	return _dir_walk(
+		src, &dest, 0, 1,
+		0,
+		rules,
+		dev,
+		_dir_walk_node,
+		dev_cb, before_cb, symlink_cb, hardlink_cb, after_cb,
+		ptr,
+		m,
+		parallel
+	);
 }
 
 /* Copy a directory tree and execute callbacks on the non-directory links
- * within each one.
+ * within each one.  A directory that already exists in the destination,
+ * as one made ahead of time for the root might, is adopted.
  */
-int dir_copy_before(
-	const char *src, const char *dest, const struct stat *s, void *ptr
-) {
-	WARN(mkdir(dest, s->st_mode), "mkdir");
-	WARN(lchown(dest, s->st_uid, s->st_gid), "lchown");
-	WARN(chmod(dest, s->st_mode), "chmod");
+int dir_copy_before(const struct dir_entry *e, void *ptr) {
+	const struct stat *s = dir_stat(e,
+		STATX_MODE | STATX_UID | STATX_GID | STATX_ATIME | STATX_MTIME);
+	if (!s) { goto error; }
+	if (mkdirat(e->destfd, e->destname, s->st_mode)) {
+		struct stat s2;
+		WARN(EEXIST != errno
+			|| fstatat(e->destfd, e->destname, &s2, AT_SYMLINK_NOFOLLOW)
+			|| !S_ISDIR(s2.st_mode), "mkdirat");
+	}
+	WARN(fchownat(
+		e->destfd, e->destname, s->st_uid, s->st_gid, AT_SYMLINK_NOFOLLOW
+	), "fchownat");
+	WARN(fchmodat(e->destfd, e->destname, s->st_mode, 0), "fchmodat");
 	return 0;
 error:
 	return -1;
 }
-int dir_copy_after(
-	const char *src, const char *dest, const struct stat *s, void *ptr
-) {
-	struct utimbuf times = {s->st_atime, s->st_mtime};
-	if (utime(dest, &times) && ENOENT != errno) { WARN(1, "utime"); }
+int dir_copy_after(const struct dir_entry *e, void *ptr) {
+	const struct stat *s = dir_stat(e, STATX_ATIME | STATX_MTIME);
+	if (!s) { goto error; }
+	struct timespec times[2] = {s->st_atim, s->st_mtim};
+	if (utimensat(
+		e->destfd, e->destname, times, AT_SYMLINK_NOFOLLOW
+	) && ENOENT != errno) { WARN(1, "utimensat"); }
 	return 0;
 error:
 	return -1;
 }
 int dir_copy(
 	const char *src, const char *dest,
-	const char **exclude,
+	struct rules *rules,
 	dev_t dev,
-	int(*dev_cb)(
-		const char *src, const char *dest,
-		dev_t dev,
-		const struct stat *s,
-		void *ptr
-	),
-	int(*symlink_cb)(
-		const char *src, const char *dest,
-		const char *basename, const char *pathname,
-		const struct stat *s,
-		void *ptr
-	),
-	int(*hardlink_cb)(
-		const char *src, const char *dest,
-		const char *basename, const char *pathname,
-		const struct stat *s,
-		void *ptr
-	),
+	int(*dev_cb)(const struct dir_entry *e, dev_t dev, void *ptr),
+	int(*symlink_cb)(const struct dir_entry *e, void *ptr),
+	int(*hardlink_cb)(const struct dir_entry *e, void *ptr),
 	void *ptr,
 	const char *m, /* "walking %s" */
-	int forks
+	int parallel
 ) {
 	return dir_walk(
 		src, dest,
-		exclude,
+		rules,
 		dev,
 		dev_cb,
 		dir_copy_before,
@@ -250,7 +806,7 @@ int dir_copy(
 		dir_copy_after,
 		ptr,
 		m,
-		forks
+		parallel
 	);
 }
 
@@ -259,33 +815,26 @@ int dir_copy(
  * because that tends to cause errors.
  * TODO Recurse through more than one level of child devices.
  */
-static int _dir_mount_dev(
-	const char *src, const char *dest,
-	dev_t dev,
-	const struct stat *s,
-	void *ptr
-) {
-	if (dev == s->st_dev) { return 0; } /* Keep going. */
-	message("recursively mounting %s\n", src);
-	WARN(mount(src, dest, 0, MS_BIND, 0), "mount");
+static int _dir_mount_dev(const struct dir_entry *e, dev_t dev, void *ptr) {
+	if (dev == e->st->s.st_dev) { return 0; } /* Keep going. */
+	message("recursively mounting %s\n", e->src);
+	WARN(mount(e->src, e->dest, 0, MS_BIND, 0), "mount");
 	return 1; /* Don't descend. */
 error:
 	return -1;
 }
+DIR_WALKER(_dir_walk_mount, _dir_mount_dev, 0, 0, 0, 0)
 int dir_mount(const char *src, const char *dest, dev_t dev) {
 	message("mounting %s\n", src);
 	WARN(mount(src, dest, 0, MS_BIND, 0), "mount");
 	if (!strcmp("/proc", &src[strlen(src) - 5])) { return 0; }
-	const char *exclude[] = {0};
-	return dir_walk(
-		src, dest,
-		exclude,
-		dev,
-		_dir_mount_dev,
-		0,
-		0,
+	return _dir_walk(
+		src, &dest, 0, 1,
 		0,
 		0,
+		dev,
+		_dir_walk_mount,
+		_dir_mount_dev, 0, 0, 0, 0,
 		0,
 		0,
 		0
@@ -299,36 +848,33 @@ error:
  * to cause errors.
  * TODO Recurse through more than one level of child devices.
  */
-static int _dir_umount_dev(
-	const char *src, const char *dest,
-	dev_t dev,
-	const struct stat *s,
-	void *ptr
-) {
-	if (dev == s->st_dev) { return 0; } /* Keep going. */
-	message("recursively unmounting %s\n", src);
-	WARN(umount2(src, MNT_DETACH), "umount2");
+static int _dir_umount_dev(const struct dir_entry *e, dev_t dev, void *ptr) {
+	if (dev == e->st->s.st_dev) { return 0; } /* Keep going. */
+	message("recursively unmounting %s\n", e->src);
+	WARN(umount2(e->src, MNT_DETACH), "umount2");
 	return 1; /* Don't descend. */
 error:
 	return -1;
 }
+DIR_WALKER(_dir_walk_umount, _dir_umount_dev, 0, 0, 0, 0)
 int dir_umount(const char *dirname, dev_t dev) {
 	message("unmounting %s\n", dirname);
+
+	/* Parts of /proc can't be read, so unmount it whether or not every
+	 * device beneath it could be found.
+	 */
 	if (!strcmp("/proc", &dirname[strlen(dirname) - 5])) {
-		const char *exclude[] = {0};
-		if (dir_walk(
-			dirname, dirname,
-			exclude,
-			dev,
-			_dir_umount_dev,
-			0,
-			0,
+		_dir_walk(
+			dirname, &dirname, 0, 1,
 			0,
 			0,
+			dev,
+			_dir_walk_umount,
+			_dir_umount_dev, 0, 0, 0, 0,
 			0,
 			0,
 			0
-		)) { goto error; }
+		);
 	}
 	WARN(umount2(dirname, MNT_DETACH), "umount2");
 	return 0;
@@ -336,40 +882,365 @@ error:
 	return -1;
 }
 
-/* If we're at a device boundary, create a placeholder and move on.
+/* Where shallow copies keep anchors, if anywhere, and counts of what
+ * became of the files they linked.
  */
-int dir_shallowcopy_dev(
-	const char *src, const char *dest,
-	dev_t dev,
-	const struct stat *s,
-	void *ptr
+static char *_dir_anchors = 0;
+static struct dir_nlink _dir_nlink = {0, 0, 0, 0, 0, 0};
+
+/* Whether shallow copies share extents instead of linking (see
+ * dir_reflink).
+ */
+static int _dir_reflink = 0;
+
+/* Keep anchors in dirname, which must be on the same filesystem as the
+ * destinations of shallow copies.  A file that can take no more hard
+ * links is copied there once and new destinations link to that copy in
+ * its place until it, too, is full and another is made.  Without anchors
+ * such files are copied into every destination.
+ */
+void dir_anchors(const char *dirname) {
+	free(_dir_anchors);
+	FATAL(!(_dir_anchors = strdup(dirname)), "strdup");
+}
+
+/* Have shallow copies give every file in each destination its own inode
+ * if reflink is non-zero, with regular files sharing their source's
+ * extents, so there are no links to run out of and nothing done to a
+ * file in a destination can reach its source.  Regular files that can't
+ * share extents are hard linked after all.
+ */
+void dir_reflink(int reflink) { _dir_reflink = reflink; }
+
+/* Fill in counts of what shallow copies in this process have done with
+ * the files they linked.
+ */
+void dir_nlink(struct dir_nlink *n) { *n = _dir_nlink; }
+
+/* Note that a file with nlink links has been linked.
+ */
+static void _dir_nlink_count(nlink_t nlink) {
+	__sync_add_and_fetch(&_dir_nlink.linked, 1);
+	unsigned long max = _dir_nlink.max;
+	while (max < nlink
+		&& !__sync_bool_compare_and_swap(&_dir_nlink.max, max, nlink)
+	) { max = _dir_nlink.max; }
+}
+
+/* Link name2 to an anchor for the regular file name1, described by s,
+ * making the anchor if there isn't one.  Anchors are sharded into
+ * directories by inode and named for the file's device, inode,
+ * modification time, and size, so a file that's replaced or changed gets
+ * new ones.  A generation number follows that's bumped each time one
+ * fills up.  Anchors are made under a temporary name and linked into
+ * place so nobody links to one that's half copied.
+ */
+static int _dir_anchor(
+	int fd1, const char *name1, int fd2, const char *name2,
+	const struct stat *s
 ) {
-	if (dev == s->st_dev) { return 0; } /* Keep going. */
-	dir_copy_before(src, dest, s, ptr);
-	dir_copy_after(src, dest, s, ptr);
-	dir_mount(src, dest, s->st_dev);
-	return 1; /* Don't descend. */
+	int result = -1, gen, made = 0;
+	char dirname[PATH_MAX], pathname[PATH_MAX], tmp[PATH_MAX];
+	snprintf(dirname, PATH_MAX, "%s/%02x",
+		_dir_anchors, (unsigned int)(s->st_ino & 0xff));
+	if (mkdir(_dir_anchors, 0700) && EEXIST != errno) { WARN(1, "mkdir"); }
+	if (mkdir(dirname, 0700) && EEXIST != errno) { WARN(1, "mkdir"); }
+	for (gen = 0;; ++gen) {
+		if (PATH_MAX <= snprintf(pathname, PATH_MAX,
+			"%s/%lx-%lx-%lx.%09lx-%lx.%d", dirname,
+			(unsigned long)s->st_dev, (unsigned long)s->st_ino,
+			(unsigned long)s->st_mtim.tv_sec,
+			(unsigned long)s->st_mtim.tv_nsec,
+			(unsigned long)s->st_size, gen
+		)) { goto error; }
+		if (!linkat(AT_FDCWD, pathname, fd2, name2, 0)) { RETURN(0); }
+		if (EMLINK == errno) { continue; }
+		if (ENOENT != errno || 2 < ++made) { goto error; }
+		if (PATH_MAX <= snprintf(tmp, PATH_MAX, "%s~%d-%lx", pathname,
+			(int)getpid(), (unsigned long)pthread_self()
+		)) { goto error; }
+		if (file_copyat(fd1, name1, AT_FDCWD, tmp)) {
+			unlink(tmp);
+			goto error;
+		}
+		int result2 = link(tmp, pathname), errsv = errno;
+		unlink(tmp);
+		if (result2 && EEXIST != errsv) { goto error; }
+		--gen; /* Link to it. */
+	}
+error:
+	return result;
 }
 
-/* Hard link symbolic links so they remain symbolic links.
+/* Make name2 anew as a copy of the symbolic link, device, FIFO, or
+ * socket name1, described by s.
  */
-int dir_shallowcopy_symlink(
-	const char *src, const char *dest,
-	const char *basename, const char *pathname,
-	const struct stat *s,
-	void *ptr
+static int _dir_make(
+	int fd1, const char *name1, int fd2, const char *name2,
+	const struct stat *s
 ) {
+	if (S_ISLNK(s->st_mode)) {
+		char buf[PATH_MAX + 1];
+		ssize_t len = readlinkat(fd1, name1, buf, PATH_MAX);
+		WARN(0 > len, "readlinkat");
+		buf[len] = 0; /* readlink(2) doesn't set a null terminator. */
+		WARN(symlinkat(buf, fd2, name2), "symlinkat");
+	}
+	else {
+		WARN(mknodat(fd2, name2, s->st_mode, s->st_rdev), "mknodat");
+	}
+	WARN(fchownat(fd2, name2, s->st_uid, s->st_gid, AT_SYMLINK_NOFOLLOW),
+		"fchownat");
+	return 0;
+error:
+	return -1;
+}
+
+/* Stand in for a hard link the filesystem refused because the source has
+ * as many links as it can take (EMLINK).  Regular files share extents if
+ * the filesystem can, otherwise link to an anchor, and as a last resort
+ * are copied.  Anything else is made anew.
+ */
+static int _dir_link_retry(
+	int fd1, const char *name1, int fd2, const char *name2
+) {
+	if (EMLINK != errno) {
+		perror("linkat");
+		return -1;
+	}
+	__sync_sub_and_fetch(&_dir_nlink.linked, 1);
+	struct stat s;
+	WARN(fstatat(fd1, name1, &s, AT_SYMLINK_NOFOLLOW), "fstatat");
+	if (S_ISREG(s.st_mode)) {
+		if (!file_reflinkat(fd1, name1, fd2, name2)) {
+			__sync_add_and_fetch(&_dir_nlink.reflinked, 1);
+			return 0;
+		}
+		if (_dir_anchors && !_dir_anchor(fd1, name1, fd2, name2, &s)) {
+			__sync_add_and_fetch(&_dir_nlink.anchored, 1);
+			return 0;
+		}
+		if (file_copyat(fd1, name1, fd2, name2)) { goto error; }
+	}
+	else if (_dir_make(fd1, name1, fd2, name2, &s)) { goto error; }
+	__sync_add_and_fetch(&_dir_nlink.copied, 1);
+	return 0;
+error:
+	return -1;
+}
+
+/* Hard link name2, relative to fd2, to name1, relative to fd1, standing in
+ * for the link as a shallow copy would if name1 can take no more.
+ */
+int dir_linkat(int fd1, const char *name1, int fd2, const char *name2) {
+	__sync_add_and_fetch(&_dir_nlink.linked, 1);
+	if (!linkat(fd1, name1, fd2, name2, 0)) { return 0; }
+	if (EMLINK != errno) {
+		__sync_sub_and_fetch(&_dir_nlink.linked, 1);
+		return -1;
+	}
+	return _dir_link_retry(fd1, name1, fd2, name2);
+}
+
+/* Link e's destination to its source or, if shallow copies share extents,
+ * give it its own inode.
+ */
+static int _dir_link(const struct dir_entry *e) {
+	const struct stat *s = dir_stat(e, _dir_reflink
+		? STATX_MODE | STATX_UID | STATX_GID | STATX_NLINK
+		: STATX_MODE | STATX_NLINK);
+	if (!s) { return -1; }
+	if (_dir_reflink) {
+		if (S_ISREG(s->st_mode)
+			? !file_reflinkat(e->srcfd, e->srcname, e->destfd, e->destname)
+			: !_dir_make(e->srcfd, e->srcname, e->destfd, e->destname, s)
+		) {
+			__sync_add_and_fetch(&_dir_nlink.cloned, 1);
+			return 0;
+		}
+		if (!S_ISREG(s->st_mode)) { return -1; }
+	}
+	_dir_nlink_count(s->st_nlink);
+	return uring_linkat(e->srcfd, e->srcname, e->destfd, e->destname, 0,
+		_dir_link_retry);
+}
+
+/* Remove the anchors in dirname that nothing links to any more.
+ */
+int dir_anchors_prune(const char *dirname) {
 	int result = -1;
-	char *pathname2 = 0;
-	pathname2 = file_join(dest, basename);
-	WARN(link(pathname, pathname2), "link");
+	int fd = -1, fd2 = -1;
+	struct dents d = {0}, d2 = {0};
+	size_t i, j;
+	if (0 > (fd = open(dirname, DIR_OPEN))) {
+		WARN(ENOENT != errno, "open");
+		RETURN(0);
+	}
+	WARN(dents_read(fd, &d), "getdents64");
+	for (i = 0; i < d.n; ++i) {
+		if (DT_DIR != d.entries[i]->type) { continue; }
+		WARN(0 > (fd2 = openat(fd, d.entries[i]->name, DIR_OPEN)),
+			"openat");
+		WARN(dents_read(fd2, &d2), "getdents64");
+		for (j = 0; j < d2.n; ++j) {
+			struct stat s;
+			if (fstatat(fd2, d2.entries[j]->name, &s, AT_SYMLINK_NOFOLLOW)
+				|| !S_ISREG(s.st_mode) || 1 < s.st_nlink
+			) { continue; }
+			if (unlinkat(fd2, d2.entries[j]->name, 0) && ENOENT != errno) {
+				WARN(1, "unlinkat");
+			}
+		}
+		dents_free(&d2);
+		close(fd2);
+		fd2 = -1;
+	}
 	result = 0;
 error:
-	free(pathname2);
+	dents_free(&d);
+	dents_free(&d2);
+	if (0 <= fd2) { close(fd2); }
+	if (0 <= fd) { close(fd); }
 	return result;
 }
 
-/* Hard link normal files unless they're setuid, setgid, sticky, or not a
+/* Hard link symbolic links so they remain symbolic links.  Links are
+ * batched through io_uring where it's available and finished by the time
+ * the walk leaves the directory.
+ */
+int dir_shallowcopy_symlink(const struct dir_entry *e, void *ptr) {
+	if (_dir_reflink) { return _dir_link(e); }
+	__sync_add_and_fetch(&_dir_nlink.linked, 1);
+	return uring_linkat(e->srcfd, e->srcname, e->destfd, e->destname, 0,
+		_dir_link_retry);
+}
+
+/* Files that are always deep copied, as their paths in a sandbox.  Each
+ * shallow copy resolves them to inodes once, too, so hard links to them
+ * are caught wherever they are.
+ */
+static const char *_dir_special_paths[] = {
+	"/var/lib/dpkg/lock",
+	"/var/lib/dpkg/lock-frontend",
+	"/var/lib/dpkg/triggers/Lock",
+	0
+};
+#define DIR_SPECIAL (sizeof(_dir_special_paths) / sizeof(char *))
+struct dir_special {
+	dev_t dev;
+	ino_t ino; /* Zero if the path doesn't exist. */
+};
+static void _dir_special(struct dir_special *special) {
+	int i;
+	for (i = 0; _dir_special_paths[i]; ++i) {
+		struct stat s;
+		if (lstat(_dir_special_paths[i], &s)) { s.st_dev = s.st_ino = 0; }
+		special[i].dev = s.st_dev;
+		special[i].ino = s.st_ino;
+	}
+}
+static int _dir_special_find(
+	const struct dir_special *special, const struct stat *s
+) {
+	int i;
+	for (i = 0; _dir_special_paths[i]; ++i) {
+		if (special[i].ino
+			&& s->st_ino == special[i].ino
+			&& s->st_dev == special[i].dev
+		) { return 1; }
+	}
+	return 0;
+}
+
+/* Subtrees bind mounted read-only from the base sandbox instead of
+ * walked, as their paths there, and how much of a directory's source to
+ * strip to find its path there.  A sandbox can't change them, so a clone
+ * shares them straight from the base sandbox, too.
+ */
+struct dir_share {
+	const char **paths; /* Null-terminated or null. */
+	size_t rootlen;
+};
+static void _dir_share(
+	struct dir_share *share, const char *root, const char **paths
+) {
+	share->paths = paths;
+	share->rootlen = strlen(root);
+	while (share->rootlen && '/' == root[share->rootlen - 1]) {
+		--share->rootlen;
+	}
+}
+
+/* Return the path in the base sandbox of the directory e if it's shared,
+ * otherwise a null pointer.
+ */
+static const char *_dir_shared(
+	const struct dir_share *share, const struct dir_entry *e
+) {
+	int i;
+	if (!share->paths) { return 0; }
+	for (i = 0; share->paths[i]; ++i) {
+		if (!strcmp(share->paths[i], &e->src[share->rootlen])) {
+			return share->paths[i];
+		}
+	}
+	return 0;
+}
+
+/* Bind mount a shared subtree read-only over dest.  The bind has to be
+ * made before it can be made read-only.
+ */
+static int _dir_share_mount(const char *src, const char *dest) {
+	message("sharing %s\n", src);
+	WARN(mount(src, dest, 0, MS_BIND, 0), "mount");
+	if (mount(0, dest, 0, MS_BIND | MS_REMOUNT | MS_RDONLY, 0)) {
+		perror("mount");
+		umount2(dest, MNT_DETACH);
+		goto error;
+	}
+	return 0;
+error:
+	return -1;
+}
+
+/* What shallow copies hand their callbacks.
+ */
+struct dir_shallow {
+	struct dir_special special[DIR_SPECIAL];
+	struct dir_share share;
+};
+
+/* If we're at a device boundary, or at a shared subtree, create a
+ * placeholder, mount over it, and move on.
+ */
+int dir_shallowcopy_dev(const struct dir_entry *e, dev_t dev, void *ptr) {
+	const struct dir_shallow *shallow = (const struct dir_shallow *)ptr;
+	if (dev == e->st->s.st_dev) {
+		const char *src = shallow ? _dir_shared(&shallow->share, e) : 0;
+		if (!src) { return 0; } /* Keep going. */
+		if (dir_copy_before(e, ptr) || dir_copy_after(e, ptr)) { return -1; }
+		return _dir_share_mount(src, e->dest) ? -1 : 1;
+	}
+	if (dir_copy_before(e, ptr) || dir_copy_after(e, ptr)
+		|| dir_mount(e->src, e->dest, e->st->s.st_dev)
+	) { return -1; }
+	return 1; /* Don't descend. */
+}
+
+/* Sockets that are never copied, matched by the prefixes of their
+ * directory and name.
+ */
+static const struct {
+	const char *dir, *name;
+	size_t dirlen, namelen;
+} _dir_sockets[] = {
+	{"/tmp/ssh-", "agent.", 9, 6},
+	{0, 0, 0, 0}
+};
+
+/* Return what a shallow copy does with name, described by s, in dirname,
+ * which is its directory's path as a sandbox sees it.  Normal files are
+ * hard linked (DIR_LINK) unless they're setuid, setgid, sticky, or not a
  * regular file, symbolic link, directory, FIFO, or socket.  These special
  * conditions are a in response to dpkg(1)'s procedure for removing previous
  * versions of files.  A new inode is allocated for the new version and it
@@ -377,170 +1248,357 @@ error:
  * above criteria have their mode set to 0600 right before they're unlinked.
  * See chmodsafe_unlink_statted in src/help.c in the dpkg(1) source code for
  * more detail.  We add block and character special files to the list of
- * conditions because we still want to hard link these.
+ * conditions because we still want to hard link these.  Those, and the
+ * dpkg(1) lock file and its kin, found by path or, if special isn't a null
+ * pointer, by inode, are deep copied (DIR_COPY).  ssh-agent(1) sockets are
+ * left out (DIR_SKIP).
  */
-int dir_shallowcopy_hardlink(
-	const char *src, const char *dest,
-	const char *basename, const char *pathname,
-	const struct stat *s,
-	void *ptr
+int dir_classify(
+	const struct dir_special *special,
+	const char *dirname, const char *name, const struct stat *s
 ) {
-	int result = -1;
-	char *pathname2 = 0;
-	pathname2 = file_join(dest, basename);
-
-	/* Deep copy files that are `setuid` and such. */
+	int i;
 	if (s->st_mode & (S_ISUID | S_ISGID | S_ISVTX) || !(s->st_mode & (
 		S_IFREG | S_IFLNK | S_IFDIR | S_IFIFO | S_IFSOCK | S_IFBLK | S_IFCHR
-	))) {
-		if (file_copy(pathname, pathname2)) { goto error; }
+	))) { return DIR_COPY; }
+	if (S_ISREG(s->st_mode)) {
+		if (special && _dir_special_find(special, s)) { return DIR_COPY; }
+		size_t len = strlen(dirname);
+		for (i = 0; _dir_special_paths[i]; ++i) {
+			const char *path = _dir_special_paths[i];
+			if (!strncmp(dirname, path, len) && '/' == path[len]
+				&& !strcmp(name, &path[len + 1])
+			) { return DIR_COPY; }
+		}
 	}
-
-	/* Deep copy the `dpkg`(1) lock file. */
-	else if (!strcmp("/var/lib/dpkg/lock", pathname)) {
-		if (file_copy(pathname, pathname2)) { goto error; }
+	else if (S_ISSOCK(s->st_mode)) {
+		for (i = 0; _dir_sockets[i].dir; ++i) {
+			if (!strncmp(_dir_sockets[i].dir, dirname, _dir_sockets[i].dirlen)
+				&& !strncmp(
+					_dir_sockets[i].name, name, _dir_sockets[i].namelen
+				)
+			) { return DIR_SKIP; }
+		}
 	}
+	return DIR_LINK;
+}
 
-	/* Don't shallow copy `ssh-agent`(1) sockets. */
-	else if (S_ISSOCK(s->st_mode)
-		&& !strncmp("/tmp/ssh-", pathname, 9)
-		&& !strncmp("agent.", basename, 6)
-	) { rmdir(dest); }
-
-	else { WARN(link(pathname, pathname2), "link"); }
-	result = 0;
+/* Hard link a file, or deep copy it or leave it out, as dir_classify says.
+ */
+int dir_shallowcopy_hardlink(const struct dir_entry *e, void *ptr) {
+	const struct dir_shallow *shallow = (const struct dir_shallow *)ptr;
+	const struct stat *s = dir_stat(e, STATX_MODE | STATX_INO | STATX_NLINK);
+	if (!s) { goto error; }
+	switch (dir_classify(
+		shallow ? shallow->special : 0,
+		shallow ? &e->src[shallow->share.rootlen] : e->src, e->srcname, s
+	)) {
+	case DIR_COPY:
+		if (file_copyat(
+			e->srcfd, e->srcname, e->destfd, e->destname
+		)) { goto error; }
+		break;
+	case DIR_SKIP:
+		break;
+	default:
+		if (_dir_link(e)) { goto error; }
+	}
+	return 0;
 error:
-	free(pathname2);
-	return result;
+	return -1;
 }
 
 /* Shallow copy a directory tree, attempting to rebind other devices.
  * Excluded directories will not be copied.
  */
-int dir_shallowcopy(
-	const char *src, const char *dest, dev_t dev, const char **exclude
+DIR_WALKER(_dir_walk_shallowcopy,
+	dir_shallowcopy_dev,
+	dir_copy_before,
+	dir_shallowcopy_symlink,
+	dir_shallowcopy_hardlink,
+	dir_copy_after
+)
+static int _dir_shallowcopy(
+	const char *src, const struct tree *tree,
+	const char **dests, struct journal **journals, int ndests,
+	dev_t dev, struct rules *rules, const char **share
 ) {
-	return dir_copy(
-		src, dest,
-		exclude,
+	struct dir_shallow shallow;
+	_dir_special(shallow.special);
+	_dir_share(&shallow.share, src, share);
+	return _dir_walk(
+		src, dests, journals, ndests,
+		tree,
+		rules,
 		dev,
+		_dir_walk_shallowcopy,
 		dir_shallowcopy_dev,
+		dir_copy_before,
 		dir_shallowcopy_symlink,
 		dir_shallowcopy_hardlink,
-		0,
+		dir_copy_after,
+		&shallow,
 		"shallow copying %s\n",
-		3
+		1
 	);
 }
+int dir_shallowcopy(
+	const char *src, const char *dest, dev_t dev, struct rules *rules
+) {
+	return _dir_shallowcopy(src, 0, &dest, 0, 1, dev, rules, 0);
+}
+
+/* Shallow copy a directory tree into each of ndests destinations, reading
+ * the source only once.  If journals isn't null, each destination with a
+ * journal skips directories it says are finished and records those that
+ * finish.  If share isn't null, the directories it lists, as paths in the
+ * base sandbox, are bind mounted read-only from there instead of copied.
+ */
+int dir_shallowcopy_many(
+	const char *src,
+	const char **dests, struct journal **journals, int ndests,
+	dev_t dev, struct rules *rules, const char **share
+) {
+	return _dir_shallowcopy(
+		src, 0, dests, journals, ndests, dev, rules, share);
+}
+
+/* Shallow copy a snapshot taken by tree_scan into each of ndests
+ * destinations, reading no directories in its source but those it left
+ * out as too volatile.  rules should be those it was taken with so they
+ * apply to those, too.
+ */
+int dir_shallowcopy_tree_many(
+	const struct tree *tree,
+	const char **dests, struct journal **journals, int ndests,
+	dev_t dev, struct rules *rules, const char **share
+) {
+	return _dir_shallowcopy(
+		tree->root, tree, dests, journals, ndests, dev, rules, share);
+}
 
 /* Create new symbolic links that will look just like the old symbolic
  * links.
  */
-static int _dir_deepcopy_symlink(
-	const char *src, const char *dest,
-	const char *basename, const char *pathname,
-	const struct stat *s,
-	void *ptr
-) {
-	int result = -1;
-	char *pathname2 = 0;
+static int _dir_deepcopy_symlink(const struct dir_entry *e, void *ptr) {
 	char buf[PATH_MAX + 1];
-	ssize_t len = readlink(pathname, buf, PATH_MAX);
-	WARN(0 > len, "readlink");
+	ssize_t len = readlinkat(e->srcfd, e->srcname, buf, PATH_MAX);
+	WARN(0 > len, "readlinkat");
 	buf[len] = 0; /* readlink(2) doesn't set a null terminator. */
-	pathname2 = file_join(dest, basename);
-	WARN(symlink(buf, pathname2), "symlink");
-	WARN(lchown(pathname2, s->st_uid, s->st_gid), "lchown");
+	WARN(symlinkat(buf, e->destfd, e->destname), "symlinkat");
+	const struct stat *s = dir_stat(e, STATX_UID | STATX_GID);
+	if (!s) { goto error; }
+	WARN(fchownat(
+		e->destfd, e->destname, s->st_uid, s->st_gid, AT_SYMLINK_NOFOLLOW
+	), "fchownat");
 	/*
-	struct utimbuf times = {s->st_atime, s->st_mtime};
-	WARN(utime(pathname2, &times), "utime");
+	struct timespec times[2] = {s->st_atim, s->st_mtim};
+	WARN(utimensat(
+		e->destfd, e->destname, times, AT_SYMLINK_NOFOLLOW
+	), "utimensat");
 	*/
-	result = 0;
+	return 0;
 error:
-	free(pathname2);
-	return result;
+	return -1;
 }
 
-/* Copy regular files.
+/* Files with more than one link in the source, keyed by their device,
+ * inode, and destination, so each is copied once per destination and its
+ * other names are linked to that copy.  Whoever finds a file first copies
+ * it while anyone else who finds it waits to link to the copy, so the
+ * link's directory is never touched after it's finished.
  */
-static int _dir_deepcopy_hardlink(
-	const char *src, const char *dest,
-	const char *basename, const char *pathname,
-	const struct stat *s,
-	void *ptr
+struct dir_links {
+	GHashTable *table;
+	size_t srclen;     /* Length of the walk's source. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+struct dir_link {
+	char *path; /* The copy. */
+	int state;  /* Zero while it's being copied, -1 if it couldn't be. */
+};
+static void _dir_link_free(void *ptr) {
+	struct dir_link *l = (struct dir_link *)ptr;
+	free(l->path);
+	free(l);
+}
+
+/* Return the key for a file in the destination an entry is in, which is
+ * found by taking the entry's directory within the source off the end of
+ * its directory within the destination.
+ */
+static char *_dir_links_key(
+	const struct dir_links *links, const struct dir_entry *e,
+	const struct stat *s
 ) {
-	int result = -1;
-	char *pathname2 = 0;
-	pathname2 = file_join(dest, basename);
-	if (file_copy(pathname, pathname2)) { goto error; }
-	result = 0;
-error:
-	free(pathname2);
-	return result;
+	size_t len = strlen(e->dest) - (strlen(e->src) - links->srclen);
+	while (1 < len && '/' == e->dest[len - 1]) { --len; }
+	char *key = 0;
+	FATAL(0 > asprintf(&key, "%lu %lu %.*s", (unsigned long)s->st_dev,
+		(unsigned long)s->st_ino, (int)len, e->dest), "asprintf");
+	return key;
+}
+
+/* Copy regular files, copying those with more than one link once and
+ * linking their other names to the copy.  A name that can't be linked
+ * gets a copy of its own.
+ */
+static int _dir_deepcopy_hardlink(const struct dir_entry *e, void *ptr) {
+	struct dir_links *links = (struct dir_links *)ptr;
+	const struct stat *s = dir_stat(e, STATX_NLINK | STATX_INO);
+	if (!s) { return -1; }
+	if (!links || 1 >= s->st_nlink) {
+		return file_copyat(e->srcfd, e->srcname, e->destfd, e->destname);
+	}
+
+	char *key = _dir_links_key(links, e, s);
+	pthread_mutex_lock(&links->lock);
+	struct dir_link *l =
+		(struct dir_link *)g_hash_table_lookup(links->table, key);
+	if (!l) {
+		FATAL(!(l = (struct dir_link *)calloc(1, sizeof(struct dir_link))),
+			"calloc");
+		l->path = file_join(e->dest, e->destname);
+		g_hash_table_insert(links->table, key, l);
+		pthread_mutex_unlock(&links->lock);
+		int result =
+			file_copyat(e->srcfd, e->srcname, e->destfd, e->destname);
+		pthread_mutex_lock(&links->lock);
+		l->state = result ? -1 : 1;
+		pthread_cond_broadcast(&links->cond);
+		pthread_mutex_unlock(&links->lock);
+		return result;
+	}
+	free(key);
+	while (!l->state) { pthread_cond_wait(&links->cond, &links->lock); }
+	int state = l->state;
+	pthread_mutex_unlock(&links->lock);
+	if (0 < state
+		&& !linkat(AT_FDCWD, l->path, e->destfd, e->destname, 0)
+	) { return 0; }
+	return file_copyat(e->srcfd, e->srcname, e->destfd, e->destname);
 }
 
 /* Deep copy a directory tree.  Excluded directories will not be copied.
  */
-int dir_deepcopy(const char *src, const char *dest, const char **exclude) {
-	return dir_copy(
-		src, dest,
-		exclude,
+DIR_WALKER(_dir_walk_deepcopy,
+	0,
+	dir_copy_before,
+	_dir_deepcopy_symlink,
+	_dir_deepcopy_hardlink,
+	dir_copy_after
+)
+static int _dir_deepcopy(
+	const char *src,
+	const char **dests, struct journal **journals, int ndests,
+	struct rules *rules
+) {
+	struct dir_links links;
+	links.table = g_hash_table_new_full(
+		g_str_hash, g_str_equal, free, _dir_link_free);
+	FATAL(!links.table, "g_hash_table_new_full");
+	links.srclen = strlen(src);
+	pthread_mutex_init(&links.lock, 0);
+	pthread_cond_init(&links.cond, 0);
+	int result = _dir_walk(
+		src, dests, journals, ndests,
 		0,
+		rules,
 		0,
+		_dir_walk_deepcopy,
+		0,
+		dir_copy_before,
 		_dir_deepcopy_symlink,
 		_dir_deepcopy_hardlink,
-		0,
+		dir_copy_after,
+		&links,
 		"deep copying %s\n",
-		3
+		1
 	);
+	g_hash_table_destroy(links.table);
+	pthread_mutex_destroy(&links.lock);
+	pthread_cond_destroy(&links.cond);
+	return result;
+}
+int dir_deepcopy(const char *src, const char *dest, struct rules *rules) {
+	return _dir_deepcopy(src, &dest, 0, 1, rules);
 }
 
-/* Recursively remount all devices in a directory tree.
+/* Deep copy a directory tree into each of ndests destinations, reading
+ * its directories only once.  journals are as for dir_shallowcopy_many.
  */
-static int _dir_remount_dev(
-	const char *src, const char *dest,
-	dev_t dev,
-	const struct stat *s,
-	void *ptr
+int dir_deepcopy_many(
+	const char *src,
+	const char **dests, struct journal **journals, int ndests,
+	struct rules *rules
 ) {
-	if (dev == s->st_dev) { return 0; } /* Keep going. */
-	message("mounting %s\n", dest);
+	return _dir_deepcopy(src, dests, journals, ndests, rules);
+}
+
+/* Recursively remount all devices and shared subtrees in a directory
+ * tree.
+ */
+static int _dir_remount_dev(const struct dir_entry *e, dev_t dev, void *ptr) {
+	const struct dir_share *share = (const struct dir_share *)ptr;
+	if (dev == e->st->s.st_dev) {
+		const char *src = _dir_shared(share, e);
+		if (!src) { return 0; } /* Keep going. */
+
+		/* A subtree that's new since the sandbox was made has no
+		 * placeholder and stays out of it.
+		 */
+		struct stat s2;
+		if (fstatat(e->destfd, e->destname, &s2, AT_SYMLINK_NOFOLLOW)) {
+			WARN(ENOENT != errno, "fstatat");
+			return 1;
+		}
+		if (!_dir_mount_root(e->destfd, e->destname)) {
+			if (_dir_share_mount(src, e->dest)) { goto error; }
+		}
+		return 1; /* Don't descend. */
+	}
+	message("mounting %s\n", e->dest);
 	struct stat s2;
-	WARN(lstat(dest, &s2), "lstat");
-	if (s->st_dev != s2.st_dev) { dir_mount(src, dest, s->st_dev); }
+	WARN(fstatat(
+		e->destfd, e->destname, &s2, AT_SYMLINK_NOFOLLOW
+	), "fstatat");
+	if (e->st->s.st_dev != s2.st_dev
+		&& dir_mount(e->src, e->dest, e->st->s.st_dev)
+	) { goto error; }
 	return 1; /* Don't descend. */
 error:
 	return -1;
 }
+DIR_WALKER(_dir_walk_remount, _dir_remount_dev, 0, 0, 0, 0)
 int dir_remount(
-	const char *src, const char *dest, dev_t dev, const char **exclude
+	const char *src, const char *dest, dev_t dev, struct rules *rules,
+	const char **share
 ) {
-	return dir_walk(
-		src, dest,
-		exclude,
-		dev,
-		_dir_remount_dev,
-		0,
-		0,
-		0,
-		0,
+	struct dir_share share2;
+	_dir_share(&share2, src, share);
+	return _dir_walk(
+		src, &dest, 0, 1,
 		0,
+		rules,
+		dev,
+		_dir_walk_remount,
+		_dir_remount_dev, 0, 0, 0, 0,
+		&share2,
 		0,
-		3
+		1
 	);
 }
 
-/* If we're at a device boundary, unmount and move on.
+/* If we're at a device boundary or a bind mount, such as a shared
+ * subtree, unmount and move on.
  */
-static int _dir_unlink_dev(
-	const char *src, const char *dest,
-	dev_t dev,
-	const struct stat *s,
-	void *ptr
-) {
-	if (dev == s->st_dev) { return 0; } /* Keep going. */
-	dir_umount(src, s->st_dev);
-	WARN(rmdir(src), "rmdir");
+static int _dir_unlink_dev(const struct dir_entry *e, dev_t dev, void *ptr) {
+	if (dev == e->st->s.st_dev
+		&& !_dir_mount_root(e->srcfd, e->srcname)
+	) { return 0; } /* Keep going. */
+	dir_umount(e->src, e->st->s.st_dev);
+	WARN(unlinkat(e->srcfd, e->srcname, AT_REMOVEDIR), "unlinkat");
 	return 1; /* Don't descend. */
 error:
 	return -1;
@@ -548,13 +1606,8 @@ error:
 
 /* Unlink symbolic and hard links.
  */
-static int _dir_unlink_link(
-	const char *src, const char *dest,
-	const char *basename, const char *pathname,
-	const struct stat *s,
-	void *ptr
-) {
-	WARN(unlink(pathname), "unlink");
+static int _dir_unlink_link(const struct dir_entry *e, void *ptr) {
+	WARN(unlinkat(e->srcfd, e->srcname, 0), "unlinkat");
 	return 0;
 error:
 	return -1;
@@ -562,12 +1615,8 @@ error:
 
 /* Clean up directories.
  */
-static int _dir_unlink_after(
-	const char *src, const char *dest,
-	const struct stat *s,
-	void *ptr
-) {
-	WARN(rmdir(src), "rmdir");
+static int _dir_unlink_after(const struct dir_entry *e, void *ptr) {
+	WARN(unlinkat(e->srcfd, e->srcname, AT_REMOVEDIR), "unlinkat");
 	return 0;
 error:
 	return -1;
@@ -576,12 +1625,20 @@ error:
 /* Perform the equivalent of `rm -rf` on the given directory tree, attempting
  * to unmount other devices.
  */
+DIR_WALKER(_dir_walk_unlink,
+	_dir_unlink_dev,
+	0,
+	_dir_unlink_link,
+	_dir_unlink_link,
+	_dir_unlink_after
+)
 int dir_unlink(const char *dirname, dev_t dev) {
-	const char *exclude[] = {0};
-	return dir_walk(
-		dirname, dirname,
-		exclude,
+	return _dir_walk(
+		dirname, &dirname, 0, 1,
+		0,
+		0,
 		dev,
+		_dir_walk_unlink,
 		_dir_unlink_dev,
 		0,
 		_dir_unlink_link,
@@ -589,6 +1646,6 @@ int dir_unlink(const char *dirname, dev_t dev) {
 		_dir_unlink_after,
 		0,
 		"unlinking %s\n",
-		0
+		1
 	);
 }
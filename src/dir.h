@@ -4,105 +4,125 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+struct dir_special;
+struct journal;
+struct rules;
+struct tree;
+
+/* Metadata for an entry, filled in only as callbacks ask for it.
+ */
+struct dir_stat {
+	struct stat s;
+	unsigned int mask; /* STATX_* fields that are valid. */
+};
+
+/* What dir_walk callbacks are given.  Names are relative to the open
+ * directories srcfd and destfd so callbacks can use the *at(2) family
+ * rather than resolving whole paths.  For a directory's own callbacks
+ * (dev_cb, before_cb and after_cb), src and dest are that directory and
+ * srcfd and destfd are its parents.  For links, src and dest are the
+ * directories containing them.  Either descriptor may be AT_FDCWD, in
+ * which case its name is a whole path.  The file type is always known;
+ * anything else must be fetched with dir_stat.
+ */
+struct dir_entry {
+	const char *src, *dest;
+	int srcfd, destfd;
+	const char *srcname, *destname;
+	mode_t type;
+	struct dir_stat *st;
+};
+
+const struct stat *dir_stat(const struct dir_entry *e, unsigned int mask);
+
+void dir_workers(int workers);
+void dir_inode_order();
+
 int dir_walk(
 	const char *src, const char *dest,
-	const char **exclude,
+	struct rules *rules,
 	dev_t dev,
-	int(*dev_cb)(
-		const char *src, const char *dest,
-		dev_t dev,
-		const struct stat *s,
-		void *ptr
-	),
-	int(*before_cb)(
-		const char *src, const char *dest,
-		const struct stat *s,
-		void *ptr
-	),
-	int(*symlink_cb)(
-		const char *src, const char *dest,
-		const char *basename, const char *pathname,
-		const struct stat *s,
-		void *ptr
-	),
-	int(*hardlink_cb)(
-		const char *src, const char *dest,
-		const char *basename, const char *pathname,
-		const struct stat *s,
-		void *ptr
-	),
-	int(*after_cb)(
-		const char *src, const char *dest,
-		const struct stat *s,
-		void *ptr
-	),
+	int(*dev_cb)(const struct dir_entry *e, dev_t dev, void *ptr),
+	int(*before_cb)(const struct dir_entry *e, void *ptr),
+	int(*symlink_cb)(const struct dir_entry *e, void *ptr),
+	int(*hardlink_cb)(const struct dir_entry *e, void *ptr),
+	int(*after_cb)(const struct dir_entry *e, void *ptr),
 	void *ptr,
 	const char *m, /* "walking %s" */
-	int forks
+	int parallel
 );
 
-int dir_copy_before(
-	const char *src, const char *dest, const struct stat *s, void *ptr
-);
-int dir_copy_after(
-	const char *src, const char *dest, const struct stat *s, void *ptr
-);
+int dir_copy_before(const struct dir_entry *e, void *ptr);
+int dir_copy_after(const struct dir_entry *e, void *ptr);
 int dir_copy(
 	const char *src, const char *dest,
-	const char **exclude,
+	struct rules *rules,
 	dev_t dev,
-	int(*dev_cb)(
-		const char *src, const char *dest,
-		dev_t dev,
-		const struct stat *s,
-		void *ptr
-	),
-	int(*symlink_cb)(
-		const char *src, const char *dest,
-		const char *basename, const char *pathname,
-		const struct stat *s,
-		void *ptr
-	),
-	int(*hardlink_cb)(
-		const char *src, const char *dest,
-		const char *basename, const char *pathname,
-		const struct stat *s,
-		void *ptr
-	),
+	int(*dev_cb)(const struct dir_entry *e, dev_t dev, void *ptr),
+	int(*symlink_cb)(const struct dir_entry *e, void *ptr),
+	int(*hardlink_cb)(const struct dir_entry *e, void *ptr),
 	void *ptr,
 	const char *m, /* "walking %s" */
-	int forks
+	int parallel
 );
 
 int dir_mount(const char *src, const char *dest, dev_t dev);
 int dir_umount(const char *dirname, dev_t dev);
 
-int dir_shallowcopy_dev(
-	const char *src, const char *dest,
-	dev_t dev,
-	const struct stat *s,
-	void *ptr
+/* What shallow copies did with the files they hard linked.
+ */
+struct dir_nlink {
+	unsigned long linked;    /* Hard linked. */
+	unsigned long reflinked; /* Past the link limit, sharing extents. */
+	unsigned long anchored;  /* Past the link limit, linked to an anchor. */
+	unsigned long copied;    /* Past the link limit, copied. */
+	unsigned long max;       /* Most links any of them had. */
+	unsigned long cloned;    /* Given their own inodes instead. */
+};
+
+void dir_anchors(const char *dirname);
+void dir_reflink(int reflink);
+int dir_anchors_prune(const char *dirname);
+void dir_nlink(struct dir_nlink *n);
+int dir_linkat(int fd1, const char *name1, int fd2, const char *name2);
+
+/* What a shallow copy does with an entry (see dir_classify).
+ */
+#define DIR_LINK 0 /* Hard link it. */
+#define DIR_COPY 1 /* Deep copy it. */
+#define DIR_SKIP 2 /* Leave it out. */
+
+int dir_classify(
+	const struct dir_special *special,
+	const char *dirname, const char *name, const struct stat *s
 );
-int dir_shallowcopy_symlink(
-	const char *src, const char *dest,
-	const char *basename, const char *pathname,
-	const struct stat *s,
-	void *ptr
+int dir_shallowcopy_dev(const struct dir_entry *e, dev_t dev, void *ptr);
+int dir_shallowcopy_symlink(const struct dir_entry *e, void *ptr);
+int dir_shallowcopy_hardlink(const struct dir_entry *e, void *ptr);
+int dir_shallowcopy(
+	const char *src, const char *dest, dev_t dev, struct rules *rules
 );
-int dir_shallowcopy_hardlink(
-	const char *src, const char *dest,
-	const char *basename, const char *pathname,
-	const struct stat *s,
-	void *ptr
+int dir_shallowcopy_many(
+	const char *src,
+	const char **dests, struct journal **journals, int ndests,
+	dev_t dev, struct rules *rules, const char **share
 );
-int dir_shallowcopy(
-	const char *src, const char *dest, dev_t dev, const char **exclude
+int dir_shallowcopy_tree_many(
+	const struct tree *tree,
+	const char **dests, struct journal **journals, int ndests,
+	dev_t dev, struct rules *rules, const char **share
 );
 
-int dir_deepcopy(const char *src, const char *dest, const char **exclude);
+int dir_deepcopy(const char *src, const char *dest, struct rules *rules);
+int dir_deepcopy_many(
+	const char *src,
+	const char **dests, struct journal **journals, int ndests,
+	struct rules *rules
+);
 
 int dir_remount(
-	const char *src, const char *dest, dev_t dev, const char **exclude
+	const char *src, const char *dest, dev_t dev, struct rules *rules,
+	const char **share
 );
 
 int dir_unlink(const char *dirname, dev_t dev);
@@ -7,10 +7,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <utime.h>
+
+/* From <linux/fs.h>, which doesn't mix well with glibc's headers.
+ */
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+/* Size of the buffer used when the kernel can't copy for us.
+ */
+#define FILE_BUFSIZE (1 << 20)
+
+/* Whether copy_file_range(2) might work.  Cleared the first time the
+ * kernel says it doesn't exist.
+ */
+static int _file_copy_range = 1;
 
 char *file_join(const char *dirname, const char *basename) {
 	char *result = 0;
@@ -30,26 +45,166 @@ char *file_join(const char *dirname, const char *basename) {
 	return result;
 }
 
-int file_copy(const char *pathname1, const char *pathname2) {
+/* Copy len bytes at offset off from fd1 to the same offset in fd2 through
+ * a buffer.  If len is negative, copy until the end of fd1 instead.
+ */
+static int _file_copybuf(int fd1, int fd2, off_t off, off_t len) {
 	int result = -1;
-	int fd1 = -1, fd2 = -1;
+	char *buf = (char *)malloc(FILE_BUFSIZE);
+	FATAL(!buf, "malloc");
+	while (len) {
+		size_t size = 0 > len || FILE_BUFSIZE < len ? FILE_BUFSIZE : len;
+		ssize_t r = pread(fd1, buf, size, off);
+		if (0 > r && EINTR == errno) { continue; }
+		if (0 > r) { goto error; }
+		if (!r) { break; }
+		ssize_t i;
+		for (i = 0; i < r;) {
+			ssize_t w = pwrite(fd2, buf + i, r - i, off + i);
+			if (0 > w && EINTR == errno) { continue; }
+			if (0 > w) { goto error; }
+			i += w;
+		}
+		off += r;
+		if (0 < len) { len -= r; }
+	}
+	result = 0;
+error:
+	free(buf);
+	return result;
+}
+
+/* Copy len bytes at offset off from fd1 to the same offset in fd2, in the
+ * kernel if it's able and through a buffer if not.
+ */
+static int _file_copyrange(int fd1, int fd2, off_t off, off_t len) {
+	loff_t off1 = off, off2 = off;
+	while (len && _file_copy_range) {
+		ssize_t w = copy_file_range(fd1, &off1, fd2, &off2, len, 0);
+		if (0 < w) {
+			len -= w;
+			continue;
+		}
+		if (!w) { return 0; } /* It's shrunk. */
+		if (EINTR == errno) { continue; }
+		if (ENOSYS == errno) { _file_copy_range = 0; }
+		else if (EXDEV != errno && EINVAL != errno
+			&& EOPNOTSUPP != errno && EBADF != errno
+		) { return -1; }
+		break;
+	}
+	if (!len) { return 0; }
+	return _file_copybuf(fd1, fd2, off1, len);
+}
+
+/* Copy the contents of the file open on fd1 into the empty file open on
+ * fd2.  Filesystems that can share extents with a reflink do so and the
+ * rest copy in the kernel where they can.  Holes stay holes.  Returns -1,
+ * with errno set, on failure.
+ */
+int file_copyfd(int fd1, int fd2) {
 	struct stat s;
-	WARN(lstat(pathname1, &s), "lstat");
-	WARN(0 > (fd1 = open(pathname1, O_RDONLY)), "open");
-	WARN(0 > (fd2 = open(pathname2, O_WRONLY|O_CREAT, s.st_mode)), "open");
-	char buf[4096];
-	int len = -1;
-	while (0 < (len = read(fd1, buf, 4096))) {
-		WARN(0 > write(fd2, buf, len), "write");
-	}
-	WARN(0 > len, "read");
-	WARN(lchown(pathname2, s.st_uid, s.st_gid), "lchown");
-	WARN(chmod(pathname2, s.st_mode), "chmod");
-	struct utimbuf times = {s.st_atime, s.st_mtime};
-	WARN(utime(pathname2, &times), "utime");
+	if (fstat(fd1, &s)) { return -1; }
+
+	/* Files that don't know their size are copied to the end.
+	 */
+	if (!S_ISREG(s.st_mode) || !s.st_size) {
+		return _file_copybuf(fd1, fd2, 0, -1);
+	}
+
+	if (!ioctl(fd2, FICLONE, fd1)) { return 0; }
+
+	/* Copy only the data, seeking past holes, and then set the size in
+	 * case the file ends in one.
+	 */
+	off_t off = 0;
+	while (off < s.st_size) {
+		off_t data = lseek(fd1, off, SEEK_DATA), hole;
+		if (0 > data) {
+			if (ENXIO == errno) { break; } /* Nothing but holes left. */
+			data = off;
+			hole = s.st_size;
+		}
+		else if (0 > (hole = lseek(fd1, data, SEEK_HOLE))) {
+			hole = s.st_size;
+		}
+		if (hole > s.st_size) { hole = s.st_size; }
+		if (hole <= data) { break; }
+		if (_file_copyrange(fd1, fd2, data, hole - data)) { return -1; }
+		off = hole;
+	}
+	return ftruncate(fd2, s.st_size);
+}
+
+/* Copy a file and its metadata.  Names are relative to the directories
+ * open on fd1 and fd2, either of which may be AT_FDCWD.  If reflink is
+ * non-zero, the new file must share all its extents with the old or there
+ * is no new file and errno is left as FICLONE set it.
+ */
+static int _file_copyat(
+	int fd1, const char *name1, int fd2, const char *name2, int reflink
+) {
+	int result = -1;
+	int src = -1, dest = -1;
+	struct stat s;
+	WARN(fstatat(fd1, name1, &s, AT_SYMLINK_NOFOLLOW), "fstatat");
+	WARN(0 > (src = openat(fd1, name1, O_RDONLY)), "openat");
+	if (reflink) {
+		if (0 > (dest = openat(
+			fd2, name2, O_WRONLY|O_CREAT|O_EXCL, s.st_mode
+		))) { goto error; }
+		if (ioctl(dest, FICLONE, src)) {
+			int errsv = errno;
+			unlinkat(fd2, name2, 0);
+			errno = errsv;
+			goto error;
+		}
+	}
+	else {
+		WARN(0 > (dest = openat(
+			fd2, name2, O_WRONLY|O_CREAT|O_TRUNC, s.st_mode
+		)), "openat");
+		WARN(file_copyfd(src, dest), "file_copyfd");
+	}
+	WARN(fchown(dest, s.st_uid, s.st_gid), "fchown");
+	WARN(fchmod(dest, s.st_mode), "fchmod");
+	struct timespec times[2] = {s.st_atim, s.st_mtim};
+	WARN(futimens(dest, times), "futimens");
 	result = 0;
 error:
-	close(fd1);
-	close(fd2);
+	close(src);
+	close(dest);
+	return result;
+}
+
+int file_copyat(int fd1, const char *name1, int fd2, const char *name2) {
+	return _file_copyat(fd1, name1, fd2, name2, 0);
+}
+
+/* Copy a file and its metadata by sharing its extents, failing quietly if
+ * the filesystem can't.
+ */
+int file_reflinkat(int fd1, const char *name1, int fd2, const char *name2) {
+	return _file_copyat(fd1, name1, fd2, name2, 1);
+}
+
+/* Return non-zero if files in dirname can share extents, which is tried
+ * with a pair of anonymous files.  (Positive logic.)
+ */
+int file_reflinkable(const char *dirname) {
+	int result = 0;
+	int fd1 = -1, fd2 = -1;
+	if (0 > (fd1 = open(dirname, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600))
+		|| 1 != write(fd1, "", 1)
+		|| 0 > (fd2 = open(dirname, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600))
+	) { goto error; }
+	result = !ioctl(fd2, FICLONE, fd1);
+error:
+	if (0 <= fd2) { close(fd2); }
+	if (0 <= fd1) { close(fd1); }
 	return result;
 }
+
+int file_copy(const char *pathname1, const char *pathname2) {
+	return file_copyat(AT_FDCWD, pathname1, AT_FDCWD, pathname2);
+}
@@ -2,6 +2,10 @@
 #define FILE_H
 
 char *file_join(const char *dirname, const char *basename);
+int file_copyfd(int fd1, int fd2);
+int file_copyat(int fd1, const char *name1, int fd2, const char *name2);
+int file_reflinkat(int fd1, const char *name1, int fd2, const char *name2);
+int file_reflinkable(const char *dirname);
 int file_copy(const char *pathname1, const char *pathname2);
 
 #endif
@@ -0,0 +1,165 @@
+#include "journal.h"
+#include "macros.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A journal records which directories of a tree being built are finished
+ * so an interrupted build can pick up where it stopped.  The file holds a
+ * header line identifying what's being built followed by the path of each
+ * finished directory relative to root, one per line, appended as they
+ * finish.  Only the entries present when it's opened are consulted, so
+ * lookups need no lock.
+ */
+struct journal {
+	int fd;
+	char *root; /* Without a trailing /. */
+	size_t rootlen;
+	GHashTable *done;
+	int resumed;
+};
+
+/* Return pathname relative to the journal's root, "." for the root itself,
+ * or a null pointer if it's outside.
+ */
+static const char *_journal_key(
+	const struct journal *j, const char *pathname
+) {
+	if (strncmp(j->root, pathname, j->rootlen)) { return 0; }
+	pathname += j->rootlen;
+	if (!*pathname) { return "."; }
+	if ('/' != *pathname) { return 0; }
+	return pathname + 1;
+}
+
+/* Append one line in a single write(2) so lines from different threads
+ * never interleave.
+ */
+static int _journal_line(int fd, const char *s) {
+	char buf[PATH_MAX + 1];
+	size_t len = strlen(s);
+	if (PATH_MAX <= len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memcpy(buf, s, len);
+	buf[len++] = '\n';
+	return len == write(fd, buf, len) ? 0 : -1;
+}
+
+/* Open the journal at pathname for building the tree at root.  If it was
+ * left by a build of the same thing, as named by header, its entries are
+ * kept and journal_resumed is true.  Otherwise it starts over.  Only one
+ * process may hold a journal open; others fail with EAGAIN or EACCES.
+ */
+struct journal *journal_open(
+	const char *pathname, const char *root, const char *header
+) {
+	struct journal *j = 0;
+	char *buf = 0;
+	FATAL(!(j = (struct journal *)calloc(1, sizeof(struct journal))),
+		"calloc");
+	FATAL(!(j->root = strdup(root)), "strdup");
+	j->rootlen = strlen(root);
+	while (j->rootlen && '/' == j->root[j->rootlen - 1]) {
+		j->root[--j->rootlen] = 0;
+	}
+	j->done = g_hash_table_new_full(g_str_hash, g_str_equal, free, 0);
+	FATAL(!j->done, "g_hash_table_new_full");
+	WARN(0 > (j->fd = open(
+		pathname, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644
+	)), "open");
+	struct flock lock;
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = 0;
+	lock.l_len = 1;
+	if (fcntl(j->fd, F_SETLK, &lock)) { goto error; }
+
+	struct stat s;
+	WARN(fstat(j->fd, &s), "fstat");
+	FATAL(!(buf = (char *)malloc(s.st_size + 1)), "malloc");
+	size_t len = 0;
+	while (len < s.st_size) {
+		ssize_t n = pread(j->fd, &buf[len], s.st_size - len, len);
+		WARN(0 > n, "pread");
+		if (!n) { break; }
+		len += n;
+	}
+	buf[len] = 0;
+
+	size_t headerlen = strlen(header);
+	if (headerlen < len
+		&& !strncmp(buf, header, headerlen)
+		&& '\n' == buf[headerlen]
+	) {
+		char *line = &buf[headerlen + 1], *end;
+		while ((end = strchr(line, '\n'))) {
+			*end = 0;
+			char *key = strdup(line);
+			FATAL(!key, "strdup");
+			g_hash_table_insert(j->done, key, key);
+			line = end + 1;
+		}
+
+		/* Drop a line torn by a crash so the next starts on its own.
+		 */
+		if (*line) { WARN(ftruncate(j->fd, line - buf), "ftruncate"); }
+		j->resumed = 1;
+	}
+	else {
+		WARN(ftruncate(j->fd, 0), "ftruncate");
+		WARN(_journal_line(j->fd, header), "write");
+	}
+
+	free(buf);
+	return j;
+error:
+	free(buf);
+	journal_close(j);
+	return 0;
+}
+
+/* Return non-zero if the journal was left by an earlier build of the same
+ * thing.  (Positive logic.)
+ */
+int journal_resumed(const struct journal *j) {
+	return j->resumed;
+}
+
+/* Return non-zero if an earlier build finished the directory at pathname.
+ * (Positive logic.)
+ */
+int journal_done(const struct journal *j, const char *pathname) {
+	const char *key = _journal_key(j, pathname);
+	return key && g_hash_table_lookup(j->done, key);
+}
+
+/* Record that the directory at pathname is finished.
+ */
+int journal_mark(struct journal *j, const char *pathname) {
+	const char *key = _journal_key(j, pathname);
+	if (!key) { return 0; }
+	WARN(_journal_line(j->fd, key), "write");
+	return 0;
+error:
+	return -1;
+}
+
+/* Close the journal, leaving the file for whoever removes it.
+ */
+void journal_close(struct journal *j) {
+	if (!j) { return; }
+	int errsv = errno;
+	if (0 <= j->fd) { close(j->fd); }
+	g_hash_table_destroy(j->done);
+	free(j->root);
+	free(j);
+	errno = errsv;
+}
@@ -0,0 +1,14 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+struct journal;
+
+struct journal *journal_open(
+	const char *pathname, const char *root, const char *header
+);
+int journal_resumed(const struct journal *j);
+int journal_done(const struct journal *j, const char *pathname);
+int journal_mark(struct journal *j, const char *pathname);
+void journal_close(struct journal *j);
+
+#endif
@@ -0,0 +1,448 @@
+#include "dir.h"
+#include "file.h"
+#include "lazy.h"
+#include "macros.h"
+#include "rules.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+/* A lazy directory is a placeholder with its source's owner, mode, and
+ * times that's filled from the same place in the tree it was copied from
+ * the first time it's needed.  Until then it carries LAZY_XATTR, which is
+ * removed once every entry in it has been linked or, for directories,
+ * made into lazy directories in turn.  Directories nobody looks in are
+ * never filled, so their contents are whatever the source has when they
+ * are.
+ */
+#define LAZY_XATTR "trusted.sandbox.lazy"
+
+#define LAZY_OPEN (O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+
+/* How long a chain of sandboxes, each cloned from the next, may be.
+ */
+#define LAZY_DEPTH 64
+
+/* A tree in a shadow directory followed by the trees it's filled from,
+ * nearest first, and the devices they're on.  The last is in the base
+ * sandbox and is never lazy.  Descriptors are used so the trees can still
+ * be reached from inside a chroot(2).  If rootfs is non-zero they're
+ * whole sandboxes (see LAZY_ROOTFS).  top is where the trees are in a
+ * sandbox, empty for whole sandboxes.
+ */
+struct lazy {
+	int n, rootfs;
+	int fds[LAZY_DEPTH];
+	dev_t devs[LAZY_DEPTH];
+	char top[PATH_MAX];
+	struct rules *rules; /* Anchored at /, or null. */
+};
+
+/* Open the tree at pathname, such as /var/sandboxes/.name/etc, and the
+ * trees it's filled from, found through each sandbox's `parent` file.
+ * rules, which may be a null pointer, say what's left out of directories
+ * filled from the base sandbox, as they would be from a copy made up
+ * front.  Returns a null pointer if pathname isn't in a shadow directory.
+ */
+struct lazy *lazy_open(const char *pathname, struct rules *rules) {
+	const char *prefix = "/var/sandboxes/.";
+	size_t len = strlen(prefix);
+	if (strncmp(prefix, pathname, len)) { return 0; }
+	const char *top = strchr(&pathname[len], '/');
+	if (!top || !top[1]) { return 0; }
+	struct lazy *l = (struct lazy *)calloc(1, sizeof(struct lazy));
+	FATAL(!l, "calloc");
+
+	char tree[PATH_MAX], name[NAME_MAX + 1];
+	size_t namelen = top - &pathname[len];
+	if (NAME_MAX < namelen) { goto error; }
+	memcpy(name, &pathname[len], namelen);
+	name[namelen] = 0;
+	if (PATH_MAX <= snprintf(tree, PATH_MAX, "%s", pathname)) { goto error; }
+	l->rootfs = !strcmp(LAZY_ROOTFS, top);
+	if (PATH_MAX <= snprintf(l->top, PATH_MAX, "%s",
+		l->rootfs ? "" : top)) { goto error; }
+	if (rules) { l->rules = rules_ref(rules); }
+	for (;;) {
+		if (LAZY_DEPTH == l->n) {
+			errno = ELOOP;
+			WARN(1, tree);
+		}
+		WARN(0 > (l->fds[l->n] = open(tree, LAZY_OPEN)), tree);
+		struct stat s;
+		WARN(fstat(l->fds[l->n], &s), tree);
+		l->devs[l->n++] = s.st_dev;
+		if (!*name) { break; }
+
+		/* The base sandbox's `parent` file is empty.
+		 */
+		char parent[PATH_MAX];
+		if (PATH_MAX <= snprintf(parent, PATH_MAX, "%s%s/parent",
+			prefix, name)) { goto error; }
+		int fd = open(parent, O_RDONLY);
+		WARN(0 > fd, parent);
+		ssize_t n = read(fd, name, NAME_MAX);
+		close(fd);
+		WARN(0 > n, parent);
+		name[n] = 0;
+		name[strcspn(name, "\n")] = 0;
+		if (*name) {
+			if (PATH_MAX <= snprintf(tree, PATH_MAX, "%s%s%s",
+				prefix, name, top)) { goto error; }
+		}
+		else if (PATH_MAX <= snprintf(tree, PATH_MAX, "%s",
+			l->rootfs ? "/" : top
+		)) { goto error; }
+	}
+	return l;
+
+error:
+	lazy_free(l);
+	return 0;
+}
+
+void lazy_free(struct lazy *l) {
+	if (!l) { return; }
+	int i;
+	for (i = 0; i < l->n; ++i) { close(l->fds[i]); }
+	rules_unref(l->rules);
+	free(l);
+}
+
+/* Make name2 a directory with the owner, mode, and times of the directory
+ * name1, described by s, that's lazy if lazy is non-zero.  If name2
+ * already exists it's left alone.
+ */
+static int _lazy_placeholder(
+	const struct stat *s, int fd2, const char *name2, int lazy
+) {
+	int result = -1;
+	int fd = -1;
+	if (mkdirat(fd2, name2, 0700)) {
+		WARN(EEXIST != errno, "mkdirat");
+		RETURN(0);
+	}
+	WARN(0 > (fd = openat(fd2, name2, LAZY_OPEN)), "openat");
+	if (lazy) { WARN(fsetxattr(fd, LAZY_XATTR, "", 0, 0), "fsetxattr"); }
+	WARN(fchown(fd, s->st_uid, s->st_gid), "fchown");
+	WARN(fchmod(fd, s->st_mode & 07777), "fchmod");
+	struct timespec times[2] = {s->st_atim, s->st_mtim};
+	WARN(futimens(fd, times), "futimens");
+	result = 0;
+error:
+	if (0 <= fd) { close(fd); }
+	return result;
+}
+
+/* Make name2 a lazy directory standing in for the directory name1.  If
+ * name2 already exists it's left alone.
+ */
+int lazy_placeholder(int fd1, const char *name1, int fd2, const char *name2) {
+	struct stat s;
+	if (fstatat(fd1, name1, &s, AT_SYMLINK_NOFOLLOW)) {
+		perror("fstatat");
+		return -1;
+	}
+	return _lazy_placeholder(&s, fd2, name2, 1);
+}
+
+/* Return non-zero if the directory open on fd hasn't been filled.
+ * (Positive logic.)
+ */
+static int _lazy_pending(int fd) {
+	return 0 <= fgetxattr(fd, LAZY_XATTR, 0, 0);
+}
+
+/* Return non-zero if name is a lazy directory that hasn't been filled.
+ * (Positive logic.)
+ */
+int lazy_pending(int fd, const char *name) {
+	int fd2 = openat(fd, name, LAZY_OPEN);
+	if (0 > fd2) { return 0; }
+	int result = _lazy_pending(fd2);
+	close(fd2);
+	return result;
+}
+
+/* Link name1 to name2, copying it instead if it can take no more links.
+ */
+static int _lazy_link(int fd1, const char *name1, int fd2, const char *name2) {
+	if (!linkat(fd1, name1, fd2, name2, 0) || EEXIST == errno) { return 0; }
+	if (EMLINK != errno) {
+		perror("linkat");
+		return -1;
+	}
+	struct stat s;
+	if (fstatat(fd1, name1, &s, AT_SYMLINK_NOFOLLOW)) {
+		perror("fstatat");
+		return -1;
+	}
+	if (S_ISLNK(s.st_mode)) {
+		char buf[PATH_MAX];
+		ssize_t len = readlinkat(fd1, name1, buf, PATH_MAX - 1);
+		if (0 > len) {
+			perror("readlinkat");
+			return -1;
+		}
+		buf[len] = 0;
+		if (symlinkat(buf, fd2, name2)) {
+			perror("symlinkat");
+			return -1;
+		}
+		return 0;
+	}
+	return file_copyat(fd1, name1, fd2, name2);
+}
+
+/* Deep copy name1 to name2 unless name2 already exists.
+ */
+static int _lazy_copy(int fd1, const char *name1, int fd2, const char *name2) {
+	struct stat s;
+	if (!fstatat(fd2, name2, &s, AT_SYMLINK_NOFOLLOW)) { return 0; }
+	return file_copyat(fd1, name1, fd2, name2);
+}
+
+/* Find where the directory pathname, relative to the root of the trees,
+ * is in a sandbox.
+ */
+static int _lazy_dirname(
+	const struct lazy *l, const char *pathname, char *dirname
+) {
+	while ('.' == pathname[0] && '/' == pathname[1]) { pathname += 2; }
+	if (!strcmp(".", pathname)) { pathname = ""; }
+	if (PATH_MAX <= snprintf(dirname, PATH_MAX, "%s%s%s",
+		l->top, *pathname ? "/" : "", pathname)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+/* Find the rules for the directory pathname, relative to the root of
+ * tree i, as a walk of the whole tree would have them: l->rules followed
+ * down from the top, under each directory's own RULES_IGNORE.  Only the
+ * base sandbox is filtered; anything else was when it was filled itself.
+ * *state is a null pointer if nothing applies.
+ */
+static int _lazy_rules(
+	const struct lazy *l, int i, const char *pathname,
+	struct rules_state **state
+) {
+	int result = -1;
+	int fd = -1, srcfd = l->fds[i];
+	char buf[PATH_MAX], dirname[PATH_MAX], *c, *saveptr;
+	*state = 0;
+	if (!l->rules || i + 1 != l->n) { return 0; }
+	*state = rules_start(l->rules, *l->top ? l->top : "/");
+	strncpy(buf, pathname, PATH_MAX - 1);
+	buf[PATH_MAX - 1] = 0;
+	strncpy(dirname, l->top, PATH_MAX);
+	c = strtok_r(buf, "/", &saveptr);
+	for (;;) {
+		if (!faccessat(srcfd, RULES_IGNORE, F_OK, AT_SYMLINK_NOFOLLOW)) {
+			struct rules *r = rules_new(*dirname ? dirname : "/");
+			int result2 = rules_loadat(r, srcfd, RULES_IGNORE);
+			*state = rules_push(*state, r);
+			rules_unref(r);
+			if (result2) { goto error; }
+		}
+		while (c && !strcmp(".", c)) { c = strtok_r(0, "/", &saveptr); }
+		if (!c) { break; }
+		struct rules_state *next;
+		rules_match(*state, c, 1, &next);
+		rules_state_free(*state);
+		*state = next;
+		size_t len = strlen(dirname);
+		if (PATH_MAX <= snprintf(&dirname[len], PATH_MAX - len, "/%s", c)) {
+			errno = ENAMETOOLONG;
+			WARN(1, c);
+		}
+		int fd2 = openat(srcfd, c, LAZY_OPEN);
+		WARN(0 > fd2, "openat");
+		if (0 <= fd) { close(fd); }
+		srcfd = fd = fd2;
+		c = strtok_r(0, "/", &saveptr);
+	}
+	result = 0;
+error:
+	if (0 <= fd) { close(fd); }
+	if (result) {
+		rules_state_free(*state);
+		*state = 0;
+	}
+	return result;
+}
+
+/* Return non-zero if the directory name in pathname, described by s,
+ * stays empty when it's copied from tree i: a mount point, which is
+ * mounted over in the sandbox instead, or /var/sandboxes in the base
+ * sandbox, which no sandbox should see.  (Positive logic.)
+ */
+static int _lazy_empty(
+	const struct lazy *l, int i, const char *pathname, const char *name,
+	const struct stat *s
+) {
+	if (s->st_dev != l->devs[i]) { return 1; }
+	if (!l->rootfs || i + 1 != l->n) { return 0; }
+	while ('.' == pathname[0] && '/' == pathname[1]) { pathname += 2; }
+	return !strcmp("var", pathname) && !strcmp("sandboxes", name);
+}
+
+/* Fill the directory pathname, relative to the root of tree i, from tree
+ * i + 1, filling that first if it's lazy, too.  Entries are linked,
+ * copied, or left out as a shallow copy would (see dir_classify) and
+ * filtered by l->rules (see _lazy_rules).  A directory that's gone from
+ * the source is left empty.  Fills of the same directory, as by two
+ * sandboxfs threads, take turns under flock(2), and whoever comes second
+ * finds it filled, so nothing removed from it since comes back.
+ */
+static int _lazy_fill(struct lazy *l, int i, const char *pathname) {
+	int result = -1;
+	int fd = -1, srcfd = -1;
+	DIR *dir = 0;
+	struct rules_state *rules = 0;
+	char dirname[PATH_MAX];
+	if (i + 1 >= l->n) { RETURN(0); }
+	if (0 > (fd = openat(l->fds[i], pathname, LAZY_OPEN))) {
+		WARN(ENOENT != errno && ENOTDIR != errno, "openat");
+		RETURN(0);
+	}
+	if (!_lazy_pending(fd)) { RETURN(0); }
+	WARN(flock(fd, LOCK_EX), "flock");
+	if (!_lazy_pending(fd)) { RETURN(0); }
+	if (_lazy_fill(l, i + 1, pathname)) { goto error; }
+
+	if (0 > (srcfd = openat(l->fds[i + 1], pathname, LAZY_OPEN))) {
+		WARN(ENOENT != errno && ENOTDIR != errno, "openat");
+	}
+	else {
+		WARN(_lazy_dirname(l, pathname, dirname), pathname);
+		if (_lazy_rules(l, i + 1, pathname, &rules)) { goto error; }
+		WARN(!(dir = fdopendir(srcfd)), "fdopendir");
+		struct dirent *entry;
+		errno = 0;
+		while ((entry = readdir(dir))) {
+			const char *name = entry->d_name;
+			if ('.' == name[0]
+				&& (!name[1] || ('.' == name[1] && !name[2]))
+			) { continue; }
+			struct stat s;
+			WARN(fstatat(srcfd, name, &s, AT_SYMLINK_NOFOLLOW), "fstatat");
+			if (rules_match(rules, name, S_ISDIR(s.st_mode), 0)) {
+				errno = 0;
+				continue;
+			}
+			if (S_ISDIR(s.st_mode)) {
+				if (_lazy_placeholder(&s, fd, name,
+					!_lazy_empty(l, i + 1, pathname, name, &s)
+				)) { goto error; }
+			}
+			else {
+				int how = dir_classify(0, dirname, name, &s);
+				if (DIR_COPY == how && _lazy_copy(srcfd, name, fd, name)) {
+					goto error;
+				}
+				if (DIR_LINK == how && _lazy_link(srcfd, name, fd, name)) {
+					goto error;
+				}
+			}
+			errno = 0;
+		}
+		WARN(errno, "readdir");
+	}
+
+	/* Only now is it safe for anyone to read it without filling it.
+	 */
+	WARN(fremovexattr(fd, LAZY_XATTR) && ENODATA != errno, "fremovexattr");
+	result = 0;
+error:
+	rules_state_free(rules);
+	if (dir) { closedir(dir); }
+	else if (0 <= srcfd) { close(srcfd); }
+	if (0 <= fd) { close(fd); }
+	return result;
+}
+
+/* Fill every lazy directory along pathname, which is relative to the root
+ * of the tree and may start with a /, so it can be looked up just as if
+ * the tree had been copied up front.  If self is non-zero, fill pathname,
+ * too, so it can be listed or changed.  Nothing that doesn't exist is an
+ * error.
+ */
+int lazy_fill(struct lazy *l, const char *pathname, int self) {
+	char buf[PATH_MAX];
+	while ('/' == *pathname) { ++pathname; }
+	if (PATH_MAX <= strlen(pathname)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (_lazy_fill(l, 0, ".")) { return -1; }
+	const char *p = pathname;
+	while (*p) {
+		p += strcspn(p, "/");
+		if (!*p && !self) { break; }
+		memcpy(buf, pathname, p - pathname);
+		buf[p - pathname] = 0;
+		if (_lazy_fill(l, 0, buf)) { return -1; }
+		while ('/' == *p) { ++p; }
+	}
+	return 0;
+}
+
+/* Fill the directory pathname, relative to the root of tree 0, and every
+ * directory beneath it.
+ */
+static int _lazy_fill_tree(struct lazy *l, const char *pathname) {
+	int result = -1;
+	int fd = -1;
+	DIR *dir = 0;
+	if (_lazy_fill(l, 0, pathname)) { goto error; }
+	WARN(0 > (fd = openat(l->fds[0], pathname, LAZY_OPEN)), "openat");
+	WARN(!(dir = fdopendir(fd)), "fdopendir");
+	struct dirent *entry;
+	errno = 0;
+	while ((entry = readdir(dir))) {
+		const char *name = entry->d_name;
+		if ('.' == name[0]
+			&& (!name[1] || ('.' == name[1] && !name[2]))
+		) { continue; }
+		unsigned char type = entry->d_type;
+		if (DT_UNKNOWN == type) {
+			struct stat s;
+			WARN(fstatat(fd, name, &s, AT_SYMLINK_NOFOLLOW), "fstatat");
+			if (S_ISDIR(s.st_mode)) { type = DT_DIR; }
+		}
+		if (DT_DIR == type) {
+			char buf[PATH_MAX];
+			if (PATH_MAX <= snprintf(buf, PATH_MAX, "%s/%s",
+				pathname, name)) {
+				errno = ENAMETOOLONG;
+				WARN(1, name);
+			}
+			if (_lazy_fill_tree(l, buf)) { goto error; }
+		}
+		errno = 0;
+	}
+	WARN(errno, "readdir");
+	result = 0;
+error:
+	if (dir) { closedir(dir); }
+	else if (0 <= fd) { close(fd); }
+	return result;
+}
+
+/* Fill the whole tree so it no longer depends on the trees it's filled
+ * from.
+ */
+int lazy_fill_tree(struct lazy *l) {
+	return _lazy_fill_tree(l, ".");
+}
@@ -0,0 +1,20 @@
+#ifndef LAZY_H
+#define LAZY_H
+
+/* The tree in a shadow directory holding a whole sandbox, which is filled
+ * from the base sandbox's root.
+ */
+#define LAZY_ROOTFS "/rootfs"
+
+struct lazy;
+struct rules;
+
+struct lazy *lazy_open(const char *pathname, struct rules *rules);
+void lazy_free(struct lazy *l);
+
+int lazy_placeholder(int fd1, const char *name1, int fd2, const char *name2);
+int lazy_pending(int fd, const char *name);
+int lazy_fill(struct lazy *l, const char *pathname, int self);
+int lazy_fill_tree(struct lazy *l);
+
+#endif
@@ -0,0 +1,192 @@
+#include "macros.h"
+#include "manifest.h"
+#include "message.h"
+#include "rules.h"
+#include "tree.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MANIFEST_OPEN (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+
+/* Return non-zero if a is later than b.  (Positive logic.)
+ */
+static int _manifest_later(const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec > b->tv_sec
+		|| (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
+/* Return non-zero if entry i, described by s, is as the manifest has it.
+ * (Positive logic.)  Directories change ctime whenever they or their
+ * entries change.  Files do, too, each time they're linked into a sandbox,
+ * so only their contents are checked.  The contents of other devices and
+ * sticky directories aren't in the manifest, so only their mount points
+ * matter.
+ */
+static int _manifest_same(
+	const struct tree *t, uint32_t i, const struct stat *s, dev_t dev
+) {
+	int dir = S_ISDIR(t->mode[i]);
+	if ((s->st_mode & S_IFMT) != (t->mode[i] & S_IFMT)) { return 0; }
+	if (dir && s->st_dev != t->dev[i]) { return 0; }
+	if (s->st_dev != dev || S_ISVTX & t->mode[i]) { return 1; }
+	const struct timespec *time1 = dir ? &s->st_ctim : &s->st_mtim;
+	const struct timespec *time2 = dir ? &t->ctime[i] : &t->mtime[i];
+	return time1->tv_sec == time2->tv_sec && time1->tv_nsec == time2->tv_nsec;
+}
+
+/* Return non-zero if the directories and RULES_IGNORE files beneath
+ * directory i, open on fd, are as the manifest has them.  (Positive
+ * logic.)  Only directories with something to check are opened.
+ */
+static int _manifest_valid_dir(
+	const struct tree *t, uint32_t i, int fd, dev_t dev
+) {
+	uint32_t j, k;
+	for (j = t->first[i]; j < t->first[i] + t->count[i]; ++j) {
+		const char *name = tree_name(t, j);
+		int dir = S_ISDIR(t->mode[j]);
+		if (!dir && strcmp(RULES_IGNORE, name)) { continue; }
+		struct stat s;
+		if (fstatat(fd, name, &s, AT_SYMLINK_NOFOLLOW)
+			|| !_manifest_same(t, j, &s, dev)
+		) { return 0; }
+		if (!dir || s.st_dev != dev || S_ISVTX & t->mode[j]) { continue; }
+		for (k = t->first[j]; k < t->first[j] + t->count[j]; ++k) {
+			if (S_ISDIR(t->mode[k])
+				|| !strcmp(RULES_IGNORE, tree_name(t, k))
+			) { break; }
+		}
+		if (k == t->first[j] + t->count[j]) { continue; }
+		int fd2 = openat(fd, name, MANIFEST_OPEN | O_NOFOLLOW);
+		if (0 > fd2) { return 0; }
+		int result = _manifest_valid_dir(t, j, fd2, dev);
+		close(fd2);
+		if (!result) { return 0; }
+	}
+	return 1;
+}
+
+/* Return non-zero if a manifest written at time still describes the tree
+ * rooted at root.  (Positive logic.)  Any of the stamps changing since
+ * then invalidates it without looking further.  Otherwise every directory
+ * that was read, and every RULES_IGNORE file, must be unchanged, which
+ * costs one stat each, relative to its parent, but never reads a
+ * directory.  Files swapped in by rename change their directory, so
+ * that's covered, too.  Changes to a file's mode or owner in place aren't,
+ * which is why walks ask files for those (see _dir_walk_visit).
+ */
+static int _manifest_valid(
+	const struct tree *t, const struct timespec *time,
+	const char *root, dev_t dev, const char **stamps
+) {
+	struct stat s;
+	int i, result = 0;
+	if (strcmp(root, t->root) || dev != t->dev[0]) { return 0; }
+	for (i = 0; stamps[i]; ++i) {
+		if (!lstat(stamps[i], &s) && !_manifest_later(time, &s.st_mtim)) {
+			return 0;
+		}
+	}
+	int fd = open(root, MANIFEST_OPEN);
+	if (0 > fd) { return 0; }
+	if (!fstat(fd, &s) && _manifest_same(t, 0, &s, dev)) {
+		result = _manifest_valid_dir(t, 0, fd, dev);
+	}
+	close(fd);
+	return result;
+}
+
+/* Scan the tree rooted at root and save it to pathname, replacing any
+ * manifest there atomically.  The manifest is dated to just before the
+ * scan began so nothing that changed during it can be missed.  Failing
+ * to save isn't fatal; the tree is returned either way.
+ */
+static struct tree *_manifest_scan(
+	const char *pathname, const char *root, struct rules *rules, dev_t dev
+) {
+	struct timespec times[2];
+	clock_gettime(CLOCK_REALTIME, &times[0]);
+	--times[0].tv_sec; /* File times come from a coarser clock. */
+	times[1] = times[0];
+	message("scanning %s\n", root);
+	struct tree *t = tree_scan(root, rules, dev);
+	if (!t) { return 0; }
+	char tmp[PATH_MAX];
+	int fd = -1;
+	WARN(PATH_MAX <= snprintf(
+		tmp, PATH_MAX, "%s.XXXXXX", pathname
+	), "snprintf");
+	WARN(0 > (fd = mkstemp(tmp)), "mkstemp");
+	if (tree_save(t, fd)) { goto error; }
+	WARN(fchmod(fd, 0644), "fchmod");
+	WARN(futimens(fd, times), "futimens");
+	WARN(rename(tmp, pathname), "rename");
+	close(fd);
+	return t;
+error:
+	if (0 <= fd) {
+		unlink(tmp);
+		close(fd);
+	}
+	return t;
+}
+
+/* Map the manifest at pathname if it's still good, filling in s with its
+ * status.  Returns a null pointer if not.
+ */
+static struct tree *_manifest_load(
+	const char *pathname, const char *root, dev_t dev, const char **stamps,
+	struct stat *s
+) {
+	struct tree *t = 0;
+	int fd = open(pathname, O_RDONLY | O_CLOEXEC);
+	if (0 > fd) { return 0; }
+	if (!fstat(fd, s) && (t = tree_load(fd)) && !_manifest_valid(
+		t, &s->st_mtim, root, dev, stamps
+	)) {
+		tree_free(t);
+		t = 0;
+	}
+	close(fd);
+	return t;
+}
+
+/* Return a snapshot of the tree rooted at root, as tree_scan would take
+ * it with the given rules and device, from the manifest at pathname if
+ * it's still good or by scanning and saving a new one if not.  stamps are
+ * files, such as dpkg(1)'s status file, that invalidate the manifest
+ * whenever they change.  Returns a null pointer on failure.
+ */
+struct tree *manifest_open(
+	const char *pathname,
+	const char *root, struct rules *rules, dev_t dev,
+	const char **stamps
+) {
+	struct stat s;
+	struct tree *t = _manifest_load(pathname, root, dev, stamps, &s);
+	if (!t) { t = _manifest_scan(pathname, root, rules, dev); }
+	return t;
+}
+
+/* Return non-zero if the manifest at pathname is still good, filling in s
+ * with its status.  (Positive logic.)  Every scan saves a new file, so its
+ * inode and modification time identify the version of the tree it holds.
+ */
+int manifest_fresh(
+	const char *pathname, const char *root, dev_t dev, const char **stamps,
+	struct stat *s
+) {
+	struct tree *t = _manifest_load(pathname, root, dev, stamps, s);
+	if (!t) { return 0; }
+	tree_free(t);
+	return 1;
+}
@@ -0,0 +1,25 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <sys/types.h>
+
+/* Where the base sandbox's manifest is kept.  Sandbox names can't start
+ * with a `.`, so this can't collide with a shadow directory.
+ */
+#define MANIFEST "/var/sandboxes/..manifest"
+
+struct rules;
+struct stat;
+struct tree;
+
+struct tree *manifest_open(
+	const char *pathname,
+	const char *root, struct rules *rules, dev_t dev,
+	const char **stamps
+);
+int manifest_fresh(
+	const char *pathname, const char *root, dev_t dev, const char **stamps,
+	struct stat *s
+);
+
+#endif
@@ -9,10 +9,10 @@
 #include <stdlib.h>
 #include <string.h>
 
-static __thread char *_message_prefix = 0;
-static __thread size_t _message_prefix_len = 0;
-static __thread int _message_quiet_default = 0;
-static __thread int _message_quiet = 0;
+static char *_message_prefix = 0;
+static size_t _message_prefix_len = 0;
+static int _message_quiet_default = 0;
+static int _message_quiet = 0;
 
 int message_init(const char *progname) {
 	if (_message_prefix) { return 0; }
@@ -0,0 +1,190 @@
+#include "macros.h"
+#include "pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* A task is a function and its argument.
+ */
+struct pool_task {
+	void (*fn)(void *);
+	void *arg;
+};
+
+/* Each worker owns a double-ended queue of tasks.  The owner pushes and
+ * pops at the tail so it works depth-first through whatever it most
+ * recently discovered.  Idle workers steal from the head, which holds the
+ * oldest and therefore (in a tree walk) the largest pieces of work.
+ */
+struct pool_deque {
+	pthread_mutex_t lock;
+	struct pool_task *tasks;
+	size_t head, tail, cap;
+};
+
+struct pool {
+	int workers;
+	struct pool_deque *deques;
+	unsigned int next; /* Round-robin target for outside submissions. */
+	int queued;        /* Tasks sitting in any deque. */
+	int sleeping;      /* Workers waiting on cond. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* Which pool and deque belong to the current thread, if it's a worker.
+ */
+static __thread struct pool *_pool_self = 0;
+static __thread struct pool_deque *_pool_deque = 0;
+
+/* Return the number of online processors, which is the default number
+ * of workers.
+ */
+int pool_cpus() {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return 0 < cpus ? (int)cpus : 1;
+}
+
+static void _pool_push(struct pool_deque *d, void (*fn)(void *), void *arg) {
+	pthread_mutex_lock(&d->lock);
+	if (d->tail - d->head == d->cap) {
+		size_t cap = d->cap ? 2 * d->cap : 64, i;
+		struct pool_task *tasks =
+			(struct pool_task *)malloc(cap * sizeof(struct pool_task));
+		FATAL(!tasks, "malloc");
+		for (i = d->head; i < d->tail; ++i) {
+			tasks[i - d->head] = d->tasks[i % d->cap];
+		}
+		free(d->tasks);
+		d->tasks = tasks;
+		d->tail -= d->head;
+		d->head = 0;
+		d->cap = cap;
+	}
+	struct pool_task *t = &d->tasks[d->tail++ % d->cap];
+	t->fn = fn;
+	t->arg = arg;
+	pthread_mutex_unlock(&d->lock);
+}
+
+/* Take a task from the tail (owner) or head (thief) of a deque.  Return
+ * zero if a task was found.
+ */
+static int _pool_pop(struct pool_deque *d, int steal, struct pool_task *t) {
+	int result = -1;
+	pthread_mutex_lock(&d->lock);
+	if (d->head != d->tail) {
+		if (steal) { *t = d->tasks[d->head++ % d->cap]; }
+		else { *t = d->tasks[--d->tail % d->cap]; }
+		result = 0;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return result;
+}
+
+/* Find work for the given worker: its own deque first, then everyone
+ * else's, starting with its neighbor so thieves spread out.
+ */
+static int _pool_find(struct pool *pool, int i, struct pool_task *t) {
+	if (!_pool_pop(&pool->deques[i], 0, t)) { return 0; }
+	int j;
+	for (j = 1; j < pool->workers; ++j) {
+		if (!_pool_pop(&pool->deques[(i + j) % pool->workers], 1, t)) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+struct pool_start {
+	struct pool *pool;
+	int i;
+};
+
+static void *_pool_worker(void *ptr) {
+	struct pool_start *start = (struct pool_start *)ptr;
+	struct pool *pool = start->pool;
+	int i = start->i;
+	free(start);
+	_pool_self = pool;
+	_pool_deque = &pool->deques[i];
+	for (;;) {
+		struct pool_task t;
+		if (!_pool_find(pool, i, &t)) {
+			__sync_fetch_and_sub(&pool->queued, 1);
+			t.fn(t.arg);
+			continue;
+		}
+
+		/* Sleep until someone queues more work.  The count is checked
+		 * under the lock that submitters signal under so no wakeups
+		 * are lost.
+		 */
+		pthread_mutex_lock(&pool->lock);
+		++pool->sleeping;
+		while (!pool->queued) { pthread_cond_wait(&pool->cond, &pool->lock); }
+		--pool->sleeping;
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return 0;
+}
+
+/* Start a pool with the given number of worker threads.  Pools live until
+ * the process exits.
+ */
+struct pool *pool_new(int workers) {
+	struct pool *pool = 0;
+	int i;
+	if (1 > workers) { workers = 1; }
+	FATAL(!(pool = (struct pool *)calloc(1, sizeof(struct pool))), "calloc");
+	FATAL(!(pool->deques = (struct pool_deque *)calloc(
+		workers, sizeof(struct pool_deque)
+	)), "calloc");
+	pool->workers = workers;
+	pthread_mutex_init(&pool->lock, 0);
+	pthread_cond_init(&pool->cond, 0);
+	for (i = 0; i < workers; ++i) {
+		pthread_mutex_init(&pool->deques[i].lock, 0);
+	}
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < workers; ++i) {
+		struct pool_start *start =
+			(struct pool_start *)malloc(sizeof(struct pool_start));
+		FATAL(!start, "malloc");
+		start->pool = pool;
+		start->i = i;
+		pthread_t thread;
+		errno = pthread_create(&thread, &attr, _pool_worker, start);
+		FATAL(errno, "pthread_create");
+	}
+	pthread_attr_destroy(&attr);
+	return pool;
+}
+
+/* Return non-zero if the current thread is one of this pool's workers.
+ * (Positive logic.)
+ */
+int pool_worker(const struct pool *pool) {
+	return pool && pool == _pool_self;
+}
+
+/* Queue a task.  Workers push onto their own deque; everyone else deals
+ * tasks out round-robin.
+ */
+void pool_submit(struct pool *pool, void (*fn)(void *), void *arg) {
+	struct pool_deque *d = _pool_deque;
+	if (pool != _pool_self) {
+		d = &pool->deques[
+			__sync_fetch_and_add(&pool->next, 1) % pool->workers
+		];
+	}
+	__sync_fetch_and_add(&pool->queued, 1);
+	_pool_push(d, fn, arg);
+	pthread_mutex_lock(&pool->lock);
+	if (pool->sleeping) { pthread_cond_signal(&pool->cond); }
+	pthread_mutex_unlock(&pool->lock);
+}
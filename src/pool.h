@@ -0,0 +1,11 @@
+#ifndef POOL_H
+#define POOL_H
+
+struct pool;
+
+int pool_cpus();
+struct pool *pool_new(int workers);
+int pool_worker(const struct pool *pool);
+void pool_submit(struct pool *pool, void (*fn)(void *), void *arg);
+
+#endif
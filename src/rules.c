@@ -0,0 +1,405 @@
+#include "macros.h"
+#include "rules.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <glib.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Patterns are compiled into a trie of path components.  Literal
+ * components are looked up in a hash table, glob components are tried
+ * with fnmatch(3), and ** becomes a node that matches any number of
+ * components, itself included.  A rule ends at the node its last component
+ * leads to.  Evaluating a path means carrying the set of live nodes down
+ * one component at a time, so each directory costs its parent's set, not
+ * its depth.
+ */
+struct rules_node {
+	GHashTable *literal; /* Components to child indices plus one. */
+	char **globs;
+	uint32_t *globchildren;
+	uint32_t nglobs;
+	uint32_t star;       /* The child reached by **, zero if none. */
+	int loop;            /* Non-zero for ** nodes. */
+	int any, dir;        /* Rules ending here, for anything and for
+	                      * directories only.  Each is one plus the rule's
+	                      * index, negated for ! rules, or zero. */
+};
+
+struct rules {
+	char *root; /* Where anchored patterns start, without a trailing /. */
+	size_t rootlen;
+	int refs;
+	struct rules_node *nodes;
+	uint32_t n, cap;
+	int count;
+	int final; /* The first rule that beats every layer, or zero. */
+};
+
+/* The live nodes of every rule set that applies to a directory.  Rule
+ * sets pushed by deeper .sandboxignore files get higher layers and beat
+ * shallower ones.
+ */
+struct rules_active {
+	struct rules *r;
+	uint32_t node;
+	int layer;
+};
+struct rules_state {
+	int top;
+	uint32_t n, cap;
+	struct rules_active *active;
+};
+
+static uint32_t _rules_node(struct rules *r) {
+	if (r->n == r->cap) {
+		r->cap = r->cap ? 2 * r->cap : 16;
+		FATAL(!(r->nodes = (struct rules_node *)realloc(
+			r->nodes, r->cap * sizeof(struct rules_node)
+		)), "realloc");
+	}
+	memset(&r->nodes[r->n], 0, sizeof(struct rules_node));
+	return r->n++;
+}
+
+/* Start an empty rule set whose anchored patterns are relative to root.
+ */
+struct rules *rules_new(const char *root) {
+	struct rules *r = (struct rules *)calloc(1, sizeof(struct rules));
+	FATAL(!r, "calloc");
+	FATAL(!(r->root = strdup(root)), "strdup");
+	r->rootlen = strlen(r->root);
+	while (r->rootlen && '/' == r->root[r->rootlen - 1]) {
+		r->root[--r->rootlen] = 0;
+	}
+	r->refs = 1;
+	_rules_node(r);
+	return r;
+}
+
+struct rules *rules_ref(struct rules *r) {
+	__sync_fetch_and_add(&r->refs, 1);
+	return r;
+}
+
+void rules_unref(struct rules *r) {
+	if (!r || __sync_sub_and_fetch(&r->refs, 1)) { return; }
+	uint32_t i, j;
+	for (i = 0; i < r->n; ++i) {
+		struct rules_node *node = &r->nodes[i];
+		if (node->literal) { g_hash_table_destroy(node->literal); }
+		for (j = 0; j < node->nglobs; ++j) { free(node->globs[j]); }
+		free(node->globs);
+		free(node->globchildren);
+	}
+	free(r->nodes);
+	free(r->root);
+	free(r);
+}
+
+static uint32_t _rules_star(struct rules *r, uint32_t i) {
+	if (!r->nodes[i].star) {
+		uint32_t j = _rules_node(r);
+		r->nodes[j].loop = 1;
+		r->nodes[i].star = j;
+	}
+	return r->nodes[i].star;
+}
+
+static uint32_t _rules_literal(struct rules *r, uint32_t i, const char *c) {
+	if (!r->nodes[i].literal) {
+		r->nodes[i].literal =
+			g_hash_table_new_full(g_str_hash, g_str_equal, free, 0);
+		FATAL(!r->nodes[i].literal, "g_hash_table_new_full");
+	}
+	gpointer value = g_hash_table_lookup(r->nodes[i].literal, c);
+	if (value) { return GPOINTER_TO_UINT(value) - 1; }
+	uint32_t j = _rules_node(r);
+	char *key = strdup(c);
+	FATAL(!key, "strdup");
+	g_hash_table_insert(r->nodes[i].literal, key, GUINT_TO_POINTER(j + 1));
+	return j;
+}
+
+static uint32_t _rules_glob(struct rules *r, uint32_t i, const char *c) {
+	struct rules_node *node = &r->nodes[i];
+	uint32_t k;
+	for (k = 0; k < node->nglobs; ++k) {
+		if (!strcmp(c, node->globs[k])) { return node->globchildren[k]; }
+	}
+	uint32_t j = _rules_node(r);
+	node = &r->nodes[i]; /* _rules_node may have moved it. */
+	FATAL(!(node->globs = (char **)realloc(
+		node->globs, (node->nglobs + 1) * sizeof(char *)
+	)), "realloc");
+	FATAL(!(node->globchildren = (uint32_t *)realloc(
+		node->globchildren, (node->nglobs + 1) * sizeof(uint32_t)
+	)), "realloc");
+	FATAL(!(node->globs[node->nglobs] = strdup(c)), "strdup");
+	node->globchildren[node->nglobs++] = j;
+	return j;
+}
+
+/* Add one rule, in the style of gitignore(5): blank lines and lines
+ * starting with # are ignored, a leading ! re-includes what an earlier
+ * rule excluded, a trailing / matches only directories, and patterns
+ * containing a / are anchored to the root while the rest match at any
+ * depth.  Components may use fnmatch(3) globs and ** matches zero or more
+ * directories.  Later rules take precedence.
+ */
+int rules_add(struct rules *r, const char *pattern) {
+	char buf[PATH_MAX], *p = buf, *c, *saveptr;
+	size_t len = strlen(pattern);
+	if (PATH_MAX <= len) {
+		errno = ENAMETOOLONG;
+		perror(pattern);
+		return -1;
+	}
+	memcpy(buf, pattern, len + 1);
+	while (len && strchr(" \t\r\n", buf[len - 1])) { buf[--len] = 0; }
+	if (!*p || '#' == *p) { return 0; }
+	int negate = '!' == *p;
+	if (negate) { ++p; }
+	else if ('\\' == *p && ('#' == p[1] || '!' == p[1])) { ++p; }
+	int dir = 0;
+	while (len && '/' == buf[len - 1]) {
+		buf[--len] = 0;
+		dir = 1;
+	}
+	int anchored = !!strchr(p, '/');
+	while ('/' == *p) { ++p; }
+	if (!*p) { return 0; }
+
+	uint32_t i = anchored ? 0 : _rules_star(r, 0);
+	for (c = strtok_r(p, "/", &saveptr); c; c = strtok_r(0, "/", &saveptr)) {
+		if (!strcmp("**", c)) { i = _rules_star(r, i); }
+		else if (strpbrk(c, "*?[\\")) { i = _rules_glob(r, i, c); }
+		else { i = _rules_literal(r, i, c); }
+	}
+	int rule = ++r->count * (negate ? -1 : 1);
+	if (dir) { r->nodes[i].dir = rule; }
+	else { r->nodes[i].any = rule; }
+	return 0;
+}
+
+/* Have every rule added from now on take precedence over the rule sets
+ * of any RULES_IGNORE file, so nothing beneath can re-include what they
+ * exclude.
+ */
+void rules_final(struct rules *r) {
+	if (!r->final) { r->final = r->count + 1; }
+}
+
+/* Add every rule in the file open on fd, which is closed.
+ */
+static int _rules_loadfd(struct rules *r, int fd, const char *pathname) {
+	int result = -1;
+	FILE *f = fdopen(fd, "r");
+	if (!f) { close(fd); }
+	WARN(!f, pathname);
+	char *line = 0;
+	size_t n = 0;
+	while (0 < getline(&line, &n, f)) {
+		if (rules_add(r, line)) { goto error; }
+	}
+	WARN(ferror(f), pathname);
+	result = 0;
+error:
+	free(line);
+	if (f) { fclose(f); }
+	return result;
+}
+
+/* Add every rule in a file.  A missing file has no rules.
+ */
+int rules_load(struct rules *r, const char *pathname) {
+	int fd = open(pathname, O_RDONLY | O_CLOEXEC);
+	if (0 > fd && ENOENT == errno) { return 0; }
+	if (0 > fd) {
+		perror(pathname);
+		return -1;
+	}
+	return _rules_loadfd(r, fd, pathname);
+}
+int rules_loadat(struct rules *r, int fd, const char *name) {
+	int fd2 = openat(fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (0 > fd2 && ENOENT == errno) { return 0; }
+	if (0 > fd2) {
+		perror(name);
+		return -1;
+	}
+	return _rules_loadfd(r, fd2, name);
+}
+
+static struct rules_state *_rules_state(int top) {
+	struct rules_state *state =
+		(struct rules_state *)calloc(1, sizeof(struct rules_state));
+	FATAL(!state, "calloc");
+	state->top = top;
+	return state;
+}
+
+/* Make a node live, along with whatever ** nodes follow it, since those
+ * match zero components.
+ */
+static void _rules_activate(
+	struct rules_state *state, struct rules *r, uint32_t i, int layer
+) {
+	while (1) {
+		uint32_t j;
+		for (j = 0; j < state->n; ++j) {
+			if (state->active[j].r == r && state->active[j].node == i) {
+				return;
+			}
+		}
+		if (state->n == state->cap) {
+			state->cap = state->cap ? 2 * state->cap : 4;
+			FATAL(!(state->active = (struct rules_active *)realloc(
+				state->active, state->cap * sizeof(struct rules_active)
+			)), "realloc");
+		}
+		state->active[state->n].r = rules_ref(r);
+		state->active[state->n].node = i;
+		state->active[state->n].layer = layer;
+		++state->n;
+		if (!(i = r->nodes[i].star)) { return; }
+	}
+}
+
+/* Compare a rule from r against the best one found so far.
+ */
+static void _rules_best(
+	const struct rules *r, int rule, int layer, int *best, int *bestlayer
+) {
+	if (!rule) { return; }
+	if (r->final && abs(rule) >= r->final) { layer = INT_MAX; }
+	if (layer > *bestlayer
+		|| (layer == *bestlayer && abs(rule) > abs(*best))
+	) {
+		*best = rule;
+		*bestlayer = layer;
+	}
+}
+
+/* Follow name from every live node.  Return the deciding rule, zero if
+ * none applies, and if next isn't null the live nodes for name's children.
+ */
+static int _rules_advance(
+	const struct rules_state *state, const char *name, int dir,
+	struct rules_state **next
+) {
+	int best = 0, bestlayer = -1;
+	struct rules_state *state2 = next ? _rules_state(state->top) : 0;
+	uint32_t i, k;
+	for (i = 0; i < state->n; ++i) {
+		struct rules *r = state->active[i].r;
+		int layer = state->active[i].layer;
+		const struct rules_node *node = &r->nodes[state->active[i].node];
+		uint32_t found[3], nfound = 0, *globs = 0, nglobs = 0;
+		if (node->literal) {
+			gpointer value = g_hash_table_lookup(node->literal, name);
+			if (value) { found[nfound++] = GPOINTER_TO_UINT(value) - 1; }
+		}
+		if (node->loop) { found[nfound++] = state->active[i].node; }
+		for (k = 0; k < node->nglobs; ++k) {
+			if (fnmatch(node->globs[k], name, 0)) { continue; }
+			FATAL(!(globs = (uint32_t *)realloc(
+				globs, (nglobs + 1) * sizeof(uint32_t)
+			)), "realloc");
+			globs[nglobs++] = node->globchildren[k];
+		}
+		for (k = 0; k < nfound + nglobs; ++k) {
+			uint32_t j = k < nfound ? found[k] : globs[k - nfound];
+
+			/* Rules ending at a ** node reached this way match too.
+			 */
+			uint32_t l;
+			for (l = j; l; l = r->nodes[l].star) {
+				_rules_best(r, r->nodes[l].any, layer, &best, &bestlayer);
+				if (dir) {
+					_rules_best(r, r->nodes[l].dir, layer,
+						&best, &bestlayer);
+				}
+			}
+			if (state2) { _rules_activate(state2, r, j, layer); }
+		}
+		free(globs);
+	}
+	if (next) {
+		if (!state2->n) {
+			rules_state_free(state2);
+			state2 = 0;
+		}
+		*next = state2;
+	}
+	return best;
+}
+
+/* Return the live nodes for the directory dirname, which is the root of a
+ * walk.  If it's beneath the rule set's root, anchored patterns are
+ * followed down to it.
+ */
+struct rules_state *rules_start(struct rules *r, const char *dirname) {
+	if (!r) { return 0; }
+	struct rules_state *state = _rules_state(0);
+	_rules_activate(state, r, 0, 0);
+	if (strncmp(r->root, dirname, r->rootlen)
+		|| ('/' != dirname[r->rootlen] && dirname[r->rootlen])
+	) { return state; }
+	char buf[PATH_MAX], *c, *saveptr;
+	strncpy(buf, dirname + r->rootlen, PATH_MAX - 1);
+	buf[PATH_MAX - 1] = 0;
+	for (c = strtok_r(buf, "/", &saveptr); c; c = strtok_r(0, "/", &saveptr)) {
+		struct rules_state *state2;
+		_rules_advance(state, c, 1, &state2);
+		rules_state_free(state);
+		if (!(state = state2)) { break; }
+	}
+	return state;
+}
+
+/* Add a rule set, anchored at the directory state describes, that takes
+ * precedence over everything already there.  Returns the state, which is
+ * new if it was null.
+ */
+struct rules_state *rules_push(struct rules_state *state, struct rules *r) {
+	if (!state) { state = _rules_state(0); }
+	_rules_activate(state, r, 0, ++state->top);
+	return state;
+}
+
+/* Return non-zero if name, in the directory state describes, is excluded.
+ * (Positive logic.)  If it's a directory and isn't excluded, *next is set
+ * to the state for its contents, which the caller must free.  A null
+ * state has no rules.
+ */
+int rules_match(
+	const struct rules_state *state, const char *name, int dir,
+	struct rules_state **next
+) {
+	if (!state) {
+		if (next) { *next = 0; }
+		return 0;
+	}
+	int rule = _rules_advance(state, name, dir, dir ? next : 0);
+	if (0 < rule && dir && next) {
+		rules_state_free(*next);
+		*next = 0;
+	}
+	else if (!dir && next) { *next = 0; }
+	return 0 < rule;
+}
+
+void rules_state_free(struct rules_state *state) {
+	if (!state) { return; }
+	uint32_t i;
+	for (i = 0; i < state->n; ++i) { rules_unref(state->active[i].r); }
+	free(state->active);
+	free(state);
+}
@@ -0,0 +1,32 @@
+#ifndef RULES_H
+#define RULES_H
+
+/* Rules for what to leave out of new sandboxes, in the style of
+ * gitignore(5).  Each directory may have its own in RULES_IGNORE.
+ */
+#define RULES_CONFIG "/etc/sandboxignore"
+
+/* Rules for a directory tree that apply only beneath it.
+ */
+#define RULES_IGNORE ".sandboxignore"
+
+struct rules;
+struct rules_state;
+
+struct rules *rules_new(const char *root);
+struct rules *rules_ref(struct rules *r);
+void rules_unref(struct rules *r);
+int rules_add(struct rules *r, const char *pattern);
+void rules_final(struct rules *r);
+int rules_load(struct rules *r, const char *pathname);
+int rules_loadat(struct rules *r, int fd, const char *name);
+
+struct rules_state *rules_start(struct rules *r, const char *dirname);
+struct rules_state *rules_push(struct rules_state *state, struct rules *r);
+int rules_match(
+	const struct rules_state *state, const char *name, int dir,
+	struct rules_state **next
+);
+void rules_state_free(struct rules_state *state);
+
+#endif
@@ -1,10 +1,19 @@
+#include "changes.h"
+#include "config.h"
+#include "dedup.h"
 #include "dir.h"
 #include "file.h"
+#include "journal.h"
+#include "lazy.h"
 #include "macros.h"
+#include "manifest.h"
 #include "message.h"
+#include "rules.h"
 #include "sandbox.h"
 #include "services.h"
+#include "snapshot.h"
 #include "sudo.h"
+#include "tree.h"
 #include "util.h"
 
 #include <dirent.h>
@@ -13,14 +22,139 @@
 #include <glib.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <regex.h>
+#include <mntent.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/xattr.h>
+#include <time.h>
 #include <unistd.h>
 
+/* What's left out of the shallow copy of a sandbox to be handled on its
+ * own.
+ */
+static const char *_sandbox_shallow[] = {
+	"/etc", "/var/sandboxes", "/root", "/home", 0
+};
+
+/* Directories sandboxfs takes over in a sandbox, copying each file from its
+ * shadow directory the first time it's changed.  /etc always is; /root and
+ * /home are when they could be shared when the sandbox was built.
+ */
+static const char *_sandbox_fuse[] = {"/etc", "/root", "/home", 0};
+
+/* Trees in a shadow directory that may be lazy: those sandboxfs takes over
+ * and, in sandboxes it serves whole, the whole sandbox.
+ */
+static const char *_sandbox_lazy_trees[] = {
+	"/etc", "/root", "/home", LAZY_ROOTFS, 0
+};
+
+/* Files whose changes invalidate the base sandbox's manifest outright.
+ */
+static const char *_sandbox_stamps[] = {
+	"/var/lib/dpkg/status", RULES_CONFIG, 0
+};
+
+/* Copies of the base sandbox built ahead of time, if CONFIG asks for a
+ * pool.  Each entry is a directory holding `root`, `shadow`, and `base`,
+ * which identifies the version of the base sandbox it was built from.
+ * Entries are hidden behind a leading `.` while they're built and carry a
+ * `~` and the owner's pid while they're claimed or discarded.
+ */
+#define SANDBOX_POOL "/var/sandboxes/..pool"
+#define SANDBOX_POOL_LOCK "/var/sandboxes/..pool.lock"
+#define SANDBOX_POOL_TRIES 3
+
+/* Sandboxes being built, each a directory holding `root`, `shadow`, and
+ * a `journal` of the directories finished so far.  They're moved into
+ * place only once complete, and a build that's interrupted resumes from
+ * its journal the next time the sandbox is created.
+ */
+#define SANDBOX_PARTIAL "/var/sandboxes/..partial"
+
+/* Copies of base files that have as many hard links as their filesystem
+ * allows, which new sandboxes link to instead (see dir_anchors).
+ */
+#define SANDBOX_ANCHORS "/var/sandboxes/..anchors"
+
+/* The bottom layer of sandboxes kept by overlayfs, mounted at `root` with
+ * its changes in `upper` and `work`.  overlayfs won't stack a sandbox on
+ * a layer that contains it, as the base sandbox contains every sandbox,
+ * so sandboxes built from the base sandbox stack on this overlay of it,
+ * which only hides /var/sandboxes.
+ */
+#define SANDBOX_OVERLAY "/var/sandboxes/..overlay"
+
+/* The journal of the directories the deduplication pass under way has
+ * finished, so an interrupted pass picks up where it stopped.  It's
+ * removed once the pass is complete.
+ */
+#define SANDBOX_DEDUP "/var/sandboxes/..dedup"
+
+/* The journal of changes to the base sandbox kept while sandbox-changes(1)
+ * tracks them (see changes_track).  A sandbox's own are kept in `changes`
+ * in its shadow directory.
+ */
+#define SANDBOX_CHANGES "/var/sandboxes/..changes"
+
+/* Whether new sandboxes leave the trees sandboxfs serves to be filled as
+ * they're used (see sandbox_lazy).
+ */
+static int _sandbox_lazy = 0;
+
+/* Return rules anchored at root that leave out the given paths and, if
+ * config is non-zero, whatever's in RULES_CONFIG.  The paths come last
+ * and are final (see rules_final) so nothing, not even a RULES_IGNORE
+ * file, can re-include them.  Returns a null pointer on failure.
+ */
+static struct rules *_sandbox_rules(
+	const char *root, const char **paths, int config
+) {
+	struct rules *rules = rules_new(root);
+	int i;
+	if (config && rules_load(rules, RULES_CONFIG)) { goto error; }
+	rules_final(rules);
+	for (i = 0; paths[i]; ++i) {
+		if (rules_add(rules, paths[i])) { goto error; }
+	}
+	return rules;
+error:
+	rules_unref(rules);
+	return 0;
+}
+
+/* Open the lazy tree at shadow, such as /var/sandboxes/.name/root, which
+ * is filtered by RULES_CONFIG where it's filled from the base sandbox, as
+ * a copy made up front would be.  /etc never is.
+ */
+static struct lazy *_sandbox_lazy_open(const char *shadow) {
+	const char *top = strrchr(shadow, '/');
+	if (top && !strcmp("/etc", top)) { return lazy_open(shadow, 0); }
+	const char *exclude[] = {0};
+	struct rules *rules = _sandbox_rules("/", exclude, 1);
+	if (!rules) { return 0; }
+	struct lazy *l = lazy_open(shadow, rules);
+	rules_unref(rules);
+	return l;
+}
+
+/* Build the trees sandboxfs serves in new sandboxes lazily if lazy is
+ * non-zero: each starts as a placeholder and sandboxfs fills a directory
+ * from the source the first time it's looked in, so a sandbox costs
+ * nothing for what it never uses.
+ */
+void sandbox_lazy(int lazy) {
+	_sandbox_lazy = lazy;
+}
+
 /* Return non-zero if the given name is a valid sandbox name.
  * (Positive logic.)
  */
@@ -54,6 +188,93 @@ int sandbox_exists(const char *name, char *pathname) {
 	return result;
 }
 
+/* Read the first line of the named file in the named sandbox's shadow
+ * directory into buf, which must hold size bytes.
+ */
+static int _sandbox_read(
+	const char *name, const char *basename, char *buf, size_t size
+) {
+	char pathname[PATH_MAX];
+	snprintf(pathname, PATH_MAX, "/var/sandboxes/.%s/%s", name, basename);
+	int fd = open(pathname, O_RDONLY);
+	if (0 > fd) { return -1; }
+	ssize_t len = read(fd, buf, size - 1);
+	close(fd);
+	if (0 > len) { return -1; }
+	buf[len] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	return 0;
+}
+
+/* Return non-zero if the top-level directory of pathname is shared through
+ * FUSE in the named sandbox, setting shadow, which must hold PATH_MAX bytes,
+ * to where pathname lives in the sandbox's shadow directory.
+ * (Positive logic.)
+ */
+static int _sandbox_shared(
+	const char *name, const char *pathname, char *shadow
+) {
+	size_t len = strcspn(&pathname[1], "/") + 1;
+	snprintf(shadow, PATH_MAX, "/var/sandboxes/.%s%.*s",
+		name, (int)len, pathname);
+	struct stat s;
+	int result = !lstat(shadow, &s) && S_ISDIR(s.st_mode);
+	snprintf(shadow, PATH_MAX, "/var/sandboxes/.%s%s", name, pathname);
+	return result;
+}
+
+/* Fill the lazy directories along pathname in the named sandbox's shadow
+ * directory, where its top-level directory must be shared.
+ */
+static int _sandbox_fill(const char *name, const char *pathname) {
+	char shadow[PATH_MAX];
+	size_t len = strcspn(&pathname[1], "/") + 1;
+	snprintf(shadow, PATH_MAX, "/var/sandboxes/.%s%.*s",
+		name, (int)len, pathname);
+	struct lazy *l = _sandbox_lazy_open(shadow);
+	if (!l) { return -1; }
+	int result = lazy_fill(l, &pathname[len], 0);
+	lazy_free(l);
+	return result;
+}
+
+/* Fill every lazy directory in the sandboxes built lazily from the named
+ * sandbox so they no longer need it.
+ */
+static int _sandbox_fill_clones(const char *name) {
+	int result = -1;
+	int i, j;
+	char **names = sandbox_list();
+	if (!names) { goto error; }
+	for (i = 0; names[i]; ++i) {
+		char pathname[PATH_MAX], parent[NAME_MAX + 1];
+		snprintf(pathname, PATH_MAX, "/var/sandboxes/.%s/lazy", names[i]);
+		if (access(pathname, F_OK)) { continue; }
+		if (_sandbox_read(names[i], "parent", parent, sizeof(parent))
+			|| strcmp(name, parent)
+		) { continue; }
+
+		message("filling sandbox %s\n", names[i]);
+		for (j = 0; _sandbox_lazy_trees[j]; ++j) {
+			char shadow[PATH_MAX];
+			if (!_sandbox_shared(names[i], _sandbox_lazy_trees[j], shadow)) {
+				continue;
+			}
+			struct lazy *l = _sandbox_lazy_open(shadow);
+			int result2 = l ? lazy_fill_tree(l) : -1;
+			lazy_free(l);
+			if (result2) { goto error; }
+		}
+		snprintf(pathname, PATH_MAX, "/var/sandboxes/.%s/lazy", names[i]);
+		unlink(pathname);
+	}
+	result = 0;
+error:
+	util_nlist_free((void **)names);
+	free(names);
+	return result;
+}
+
 /* Break the current process and all its future children out of the sandbox
  * by creating a chroot we're not in and ascending to the original root
  * directory.  If name is not a null pointer, set the name of the sandbox we
@@ -108,68 +329,1322 @@ char **sandbox_list() {
 	int i = 0, ii = -1, j = 0;
 	struct dirent **namelist = 0;
 
-	if (sandbox_breakout(0)) { goto error; }
-	if (0 > (ii = scandir("/var/sandboxes", &namelist, 0, alphasort))) {
-		goto error;
+	if (sandbox_breakout(0)) { goto error; }
+	if (0 > (ii = scandir("/var/sandboxes", &namelist, 0, alphasort))) {
+		goto error;
+	}
+	FATAL(!(result = (char **)calloc(ii - 2 + 1, sizeof(char *))), "calloc");
+	for (i = 0, j = 0; i < ii; ++i) {
+		if ('.' == *namelist[i]->d_name) { continue; }
+		if (!(result[j++] = strdup(namelist[i]->d_name))) {
+			perror("strdup");
+			util_ilist_free_partial((void **)result, 0, j, -1);
+			free(result);
+			result = 0;
+			goto error;
+		}
+	}
+	result[j] = 0;
+
+error:
+	util_ilist_free((void **)namelist, ii);
+	free(namelist);
+	return result;
+}
+
+/* Return the name of the current sandbox.
+ */
+char *sandbox_which() {
+	char name[NAME_MAX];
+	sandbox_breakout(name);
+	char *result = 0;
+	FATAL(!(result = strdup(name)), "strdup");
+	return result;
+}
+
+/* Return the subtrees a sandbox built from srcname bind mounts read-only
+ * from the base sandbox instead of copying, as a null-terminated list to
+ * free with util_nlist_free and free.  For the base sandbox they're the
+ * absolute paths `share` in CONFIG names.  Any other sandbox shares
+ * exactly what it shares itself, as recorded in its shadow directory,
+ * since it can't have changed them and hard links can't cross into its
+ * binds.
+ */
+static char **_sandbox_share(const char *srcname) {
+	char *buf = 0, *saveptr = 0, *path;
+	int fd = -1, i = 0;
+	if (strcmp("/", srcname)) {
+		char pathname[PATH_MAX];
+		struct stat s;
+		snprintf(pathname, PATH_MAX, "/var/sandboxes/.%s/share", srcname);
+		if (0 <= (fd = open(pathname, O_RDONLY)) && !fstat(fd, &s)) {
+			FATAL(!(buf = (char *)calloc(s.st_size + 1, 1)), "calloc");
+			if (s.st_size != read(fd, buf, s.st_size)) { *buf = 0; }
+		}
+		if (0 <= fd) { close(fd); }
+	}
+	else if (config_get("share")) {
+		FATAL(!(buf = strdup(config_get("share"))), "strdup");
+	}
+	char **paths = (char **)calloc(
+		(buf ? strlen(buf) / 2 : 0) + 2, sizeof(char *));
+	FATAL(!paths, "calloc");
+	for (path = buf ? strtok_r(buf, " \t\n", &saveptr) : 0; path;
+		path = strtok_r(0, " \t\n", &saveptr)
+	) {
+		size_t len = strlen(path);
+		while (1 < len && '/' == path[len - 1]) { path[--len] = 0; }
+		if ('/' != *path || 1 == len) {
+			fprintf(stderr, "%s: not sharing %s\n", CONFIG, path);
+			continue;
+		}
+		FATAL(!(paths[i++] = strdup(path)), "strdup");
+	}
+	free(buf);
+	return paths;
+}
+
+/* One stage of building sandboxes.  Stages have no walks in common so
+ * each runs in its own thread, where its walk shares the directory pool's
+ * workers and descriptor budget with the others'.  That lets the deep
+ * copy, which spends its time moving data, overlap the shallow copies,
+ * which spend theirs on metadata, without running more at once than a
+ * single walk would.  Each stage reads its source once and writes every
+ * destination.
+ */
+struct sandbox_stage {
+	int (*fn)(const struct sandbox_stage *stage);
+	const char *srcname, *src, **dests;
+	struct journal **journals;
+	int ndests;
+	struct rules *rules;
+	const char **share; /* See _sandbox_share. */
+	int result;
+	pthread_t thread;
+};
+
+/* Shallow copy most of the filesystem.  The base sandbox changes rarely
+ * enough that it's replayed from its manifest rather than walked each
+ * time.
+ */
+static int _sandbox_stage_shallow(const struct sandbox_stage *stage) {
+	int result = -1;
+	struct stat s;
+	WARN(lstat(stage->src, &s), "lstat");
+	if (strcmp("/", stage->srcname)) {
+		result = dir_shallowcopy_many(stage->src, stage->dests,
+			stage->journals, stage->ndests, s.st_dev, stage->rules,
+			stage->share);
+	}
+	else {
+		struct tree *tree = manifest_open(
+			MANIFEST, stage->src, stage->rules, s.st_dev, _sandbox_stamps);
+		result = tree ? dir_shallowcopy_tree_many(tree, stage->dests,
+			stage->journals, stage->ndests, s.st_dev, stage->rules,
+			stage->share) : -1;
+		tree_free(tree);
+	}
+error:
+	return result;
+}
+
+/* Shallow copy /etc, or /root or /home if they're shared, from the
+ * appropriate source into the shadow directories.  sandboxfs copies each
+ * file the first time it's changed.
+ */
+static int _sandbox_stage_shadow(const struct sandbox_stage *stage) {
+	int result = -1;
+	struct stat s;
+	WARN(lstat(stage->src, &s), "lstat");
+
+	/* Whatever a lazy source hasn't filled yet must be, or it would be
+	 * copied empty.
+	 */
+	char pathname[PATH_MAX];
+	snprintf(pathname, PATH_MAX, "/var/sandboxes/.%s/lazy", stage->srcname);
+	if (strcmp("/", stage->srcname) && !access(pathname, F_OK)) {
+		struct lazy *l = _sandbox_lazy_open(stage->src);
+		if (!l) { goto error; }
+		int result2 = lazy_fill_tree(l);
+		lazy_free(l);
+		if (result2) { goto error; }
+	}
+	result = dir_shallowcopy_many(stage->src, stage->dests,
+		stage->journals, stage->ndests, s.st_dev, stage->rules, 0);
+error:
+	return result;
+}
+
+/* Stand a lazy directory in for /etc, or /root or /home if they're
+ * shared, in the shadow directories for sandboxfs to fill as it's used
+ * (see _sandbox_lazy_open).  A copy that was started as a shallow copy,
+ * by a build that's being resumed, is finished as one.
+ */
+static int _sandbox_stage_lazy(const struct sandbox_stage *stage) {
+	int result = -1;
+	int i;
+	for (i = 0; i < stage->ndests; ++i) {
+		struct stat s;
+		if (lstat(stage->dests[i], &s)) {
+			WARN(ENOENT != errno, "lstat");
+			if (lazy_placeholder(
+				AT_FDCWD, stage->src, AT_FDCWD, stage->dests[i]
+			)) { goto error; }
+		}
+		else if (!lazy_pending(AT_FDCWD, stage->dests[i])) {
+			struct sandbox_stage stage2 = *stage;
+			stage2.dests = &stage->dests[i];
+			stage2.journals = stage->journals ? &stage->journals[i] : 0;
+			stage2.ndests = 1;
+			if (_sandbox_stage_shadow(&stage2)) { goto error; }
+		}
+	}
+	result = 0;
+error:
+	return result;
+}
+
+/* Deep copy /root or /home, if the source has one.
+ */
+static int _sandbox_stage_deep(const struct sandbox_stage *stage) {
+	int result = -1;
+	struct stat s;
+	if (lstat(stage->src, &s)) {
+		WARN(ENOENT != errno, "lstat");
+		RETURN(0);
+	}
+	result = dir_deepcopy_many(stage->src,
+		stage->dests, stage->journals, stage->ndests, stage->rules);
+error:
+	return result;
+}
+
+static void *_sandbox_stage(void *ptr) {
+	struct sandbox_stage *stage = (struct sandbox_stage *)ptr;
+	stage->result = stage->fn(stage);
+	return 0;
+}
+
+/* Make a directory a build needs, which may be there already if the
+ * build is being resumed.
+ */
+static int _sandbox_mkdir(const char *pathname, int resume) {
+	if (mkdir(pathname, 0755) && (!resume || EEXIST != errno)) {
+		perror("mkdir");
+		return -1;
+	}
+	return 0;
+}
+
+/* Start sandboxfs serving root from its shadow directory.
+ */
+static int _sandbox_sandboxfs(const char *root) {
+	pid_t pid;
+	WARN(0 > (pid = fork()), "fork");
+	if (!pid) {
+		execlp("sandboxfs", "sandboxfs", "-oallow_other", root, (char *)0);
+		perror("execlp");
+		exit(-1);
+	}
+	int status;
+	do { wait(&status); }
+	while (!WIFEXITED(status));
+	if (WEXITSTATUS(status)) {
+		message("sandboxfs misbehaving, skipping\n");
+		goto error;
+	}
+	return 0;
+error:
+	return -1;
+}
+
+/* How a sandbox keeps its copy of its source.  The hardlink backend
+ * shallow copies the source into the sandbox.  The reflink backend does,
+ * too, but gives every file its own inode sharing its source's extents,
+ * and on btrfs clones a sandbox by snapshotting it.  The sandboxfs backend
+ * copies nothing: sandboxfs serves the whole sandbox from a lazy tree in
+ * its shadow directory, filled a directory at a time from the source as
+ * it's used, and copies each file the first time it's changed.  The
+ * overlay backend stacks an empty upper directory in the sandbox's shadow
+ * directory on the source with overlayfs, so making a sandbox copies
+ * nothing and a file is copied only once it's changed, but the sandbox
+ * must be mounted to be used.
+ *
+ * make makes the sandbox at dest, given its shadow directory, and sets
+ * upper, which must hold PATH_MAX bytes, to where the trees it doesn't
+ * take from its source go.  It returns 1 if the sandbox already holds a
+ * copy of its source, with placeholders where the source has them.  hide,
+ * if not null, hides the source beneath such a tree.  stage, if not null,
+ * copies the source into the sandbox.  mount, if not null, mounts the
+ * named sandbox at dirname unless it's mounted already.  unlink takes the
+ * sandbox at dirname apart.  If reflink is non-zero, shallow copies share
+ * extents rather than hard linking (see dir_reflink), which needs a
+ * filesystem that can.  If whole is non-zero, sandboxfs serves the whole
+ * sandbox from its shadow directory and nothing is copied.
+ */
+struct sandbox_backend {
+	const char *name;
+	int reflink, whole;
+	int (*make)(
+		const char *srcname, const char *dest, const char *shadow,
+		int resume, char *upper
+	);
+	int (*hide)(const char *pathname);
+	int (*stage)(const struct sandbox_stage *stage);
+	int (*mount)(const char *name, const char *dirname);
+	int (*unlink)(const char *dirname);
+};
+
+static int _sandbox_hardlink_make(
+	const char *srcname, const char *dest, const char *shadow,
+	int resume, char *upper
+) {
+	strncpy(upper, dest, PATH_MAX);
+	return _sandbox_mkdir(dest, resume);
+}
+
+static int _sandbox_hardlink_unlink(const char *dirname) {
+	struct stat s;
+	WARN(lstat(dirname, &s), "lstat");
+	return dir_unlink(dirname, s.st_dev);
+error:
+	return -1;
+}
+
+/* On btrfs, snapshot a source sandbox that's a subvolume, which copies it
+ * in constant time, and make other sandboxes subvolumes so they can be
+ * snapshotted in turn.  The base sandbox is never snapshotted since that
+ * would take /var/sandboxes and everything RULES_CONFIG leaves out
+ * along with it.
+ */
+static int _sandbox_reflink_make(
+	const char *srcname, const char *dest, const char *shadow,
+	int resume, char *upper
+) {
+	char src[PATH_MAX];
+	strncpy(upper, dest, PATH_MAX);
+	snprintf(src, PATH_MAX, "/var/sandboxes/%s", srcname);
+	if (strcmp("/", srcname) && snapshot_capable(src)) {
+		if (resume && snapshot_capable(dest)) { return 1; }
+		WARN(snapshot_make(src, dest), "snapshot");
+		return 1;
+	}
+	if (!snapshot_subvolume(dest)) { return 0; }
+	return _sandbox_mkdir(dest, resume);
+error:
+	return -1;
+}
+
+/* Unmount everything mounted beneath dirname, deepest first.
+ */
+static int _sandbox_umount_beneath(const char *dirname) {
+	int result = -1;
+	int i, n = 0;
+	char **pathnames = 0;
+	size_t len = strlen(dirname);
+	FILE *f = setmntent("/proc/self/mounts", "r");
+	WARN(!f, "setmntent");
+	struct mntent *m;
+	while ((m = getmntent(f))) {
+		if (strncmp(dirname, m->mnt_dir, len) || '/' != m->mnt_dir[len]) {
+			continue;
+		}
+		FATAL(!(pathnames = (char **)realloc(
+			pathnames, (n + 2) * sizeof(char *)
+		)), "realloc");
+		FATAL(!(pathnames[n++] = strdup(m->mnt_dir)), "strdup");
+		pathnames[n] = 0;
+	}
+	for (i = n - 1; 0 <= i; --i) {
+		message("unmounting %s\n", pathnames[i]);
+		if (umount2(pathnames[i], MNT_DETACH) && EINVAL != errno) {
+			WARN(1, "umount2");
+		}
+	}
+	result = 0;
+error:
+	if (f) { endmntent(f); }
+	util_nlist_free((void **)pathnames);
+	free(pathnames);
+	return result;
+}
+
+/* Bind everything mounted in the base sandbox over the same place in the
+ * sandbox at dirname, in the order it was mounted, wherever it isn't
+ * already.  Sandboxes served whole by sandboxfs are remounted this way
+ * because walking them as dir_remount does would fill every directory.
+ */
+static int _sandbox_remount_table(const char *dirname) {
+	int result = -1;
+	FILE *f = setmntent("/proc/self/mounts", "r");
+	WARN(!f, "setmntent");
+	struct mntent *m;
+	size_t len = strlen("/var/sandboxes");
+	while ((m = getmntent(f))) {
+		if (!strcmp("/", m->mnt_dir)
+			|| (!strncmp("/var/sandboxes", m->mnt_dir, len)
+				&& ('/' == m->mnt_dir[len] || !m->mnt_dir[len]))
+		) { continue; }
+		char pathname[PATH_MAX];
+		struct stat s1, s2;
+		snprintf(pathname, PATH_MAX, "%s%s", dirname, m->mnt_dir);
+		if (lstat(m->mnt_dir, &s1) || lstat(pathname, &s2)
+			|| !S_ISDIR(s2.st_mode) || s1.st_dev == s2.st_dev
+		) { continue; }
+		message("mounting %s\n", m->mnt_dir);
+		WARN(mount(m->mnt_dir, pathname, 0, MS_BIND, 0), "mount");
+	}
+	result = 0;
+error:
+	if (f) { endmntent(f); }
+	return result;
+}
+
+/* Destroy a subvolume in one go once nothing's mounted in it.  Anything
+ * else is walked.
+ */
+static int _sandbox_reflink_unlink(const char *dirname) {
+	if (snapshot_capable(dirname)) {
+		if (_sandbox_umount_beneath(dirname)) { return -1; }
+		if (!snapshot_destroy(dirname)) { return 0; }
+	}
+	return _sandbox_hardlink_unlink(dirname);
+}
+
+/* Return non-zero if something's mounted at pathname, which must be in
+ * /var/sandboxes.  (Positive logic.)
+ */
+static int _sandbox_mounted(const char *pathname) {
+	struct stat s1, s2;
+	return !lstat("/var/sandboxes", &s1) && !lstat(pathname, &s2)
+		&& s1.st_dev != s2.st_dev;
+}
+
+static int _sandbox_overlay_hide(const char *pathname) {
+	WARN(setxattr(pathname, "trusted.overlay.opaque", "y", 1, 0),
+		"setxattr");
+	return 0;
+error:
+	return -1;
+}
+
+/* Mount SANDBOX_OVERLAY unless it's mounted already.
+ */
+static int _sandbox_overlay_base() {
+	const char *dirnames[] = {
+		SANDBOX_OVERLAY,
+		SANDBOX_OVERLAY "/root",
+		SANDBOX_OVERLAY "/upper",
+		SANDBOX_OVERLAY "/work",
+		SANDBOX_OVERLAY "/upper/var",
+		SANDBOX_OVERLAY "/upper/var/sandboxes",
+		0
+	};
+	int i;
+	if (_sandbox_mounted(SANDBOX_OVERLAY "/root")) { return 0; }
+	for (i = 0; dirnames[i]; ++i) {
+		if (_sandbox_mkdir(dirnames[i], 1)) { goto error; }
+	}
+	struct stat s;
+	WARN(lstat("/var", &s), "lstat");
+	WARN(chown(SANDBOX_OVERLAY "/upper/var", s.st_uid, s.st_gid), "chown");
+	WARN(chmod(SANDBOX_OVERLAY "/upper/var", s.st_mode & 07777), "chmod");
+	if (_sandbox_overlay_hide(SANDBOX_OVERLAY "/upper/var/sandboxes")) {
+		goto error;
+	}
+	WARN(mount("overlay", SANDBOX_OVERLAY "/root", "overlay", 0,
+		"lowerdir=/,"
+		"upperdir=" SANDBOX_OVERLAY "/upper,"
+		"workdir=" SANDBOX_OVERLAY "/work"
+	), "mount");
+	return 0;
+error:
+	return -1;
+}
+
+/* Set lower, which must hold PATH_MAX bytes, to the layers a sandbox kept
+ * by overlayfs stacks on to clone the named sandbox, nearest first: the
+ * upper directories of the source and every sandbox it stacks on in turn,
+ * down to SANDBOX_OVERLAY or a sandbox kept some other way.
+ */
+static int _sandbox_overlay_lower(const char *srcname, char *lower) {
+	char backend[NAME_MAX], buf[PATH_MAX];
+	if (!strcmp("/", srcname)) {
+		snprintf(lower, PATH_MAX, "%s/root", SANDBOX_OVERLAY);
+		return 0;
+	}
+	if (_sandbox_read(srcname, "backend", backend, sizeof(backend))
+		|| strcmp("overlay", backend)
+	) {
+		snprintf(lower, PATH_MAX, "/var/sandboxes/%s", srcname);
+		return 0;
+	}
+	WARN(_sandbox_read(srcname, "lower", buf, PATH_MAX), "open");
+	if (PATH_MAX <= snprintf(lower, PATH_MAX, "/var/sandboxes/.%s/upper:%s",
+		srcname, buf
+	)) {
+		message("sandbox %s has too many layers\n", srcname);
+		errno = E2BIG;
+		goto error;
+	}
+	return 0;
+error:
+	return -1;
+}
+
+/* Make the upper and work directories overlayfs keeps the sandbox's
+ * changes in and record what it stacks on in the `lower` file, all in the
+ * shadow directory.  Names are separated by `,` and `:` in overlayfs's
+ * options so they can't contain either.
+ */
+static int _sandbox_overlay_make(
+	const char *srcname, const char *dest, const char *shadow,
+	int resume, char *upper
+) {
+	int result = -1, fd = -1;
+	char lower[PATH_MAX], pathname[PATH_MAX];
+	if (strpbrk(srcname, ",:") || strpbrk(shadow, ",:")) {
+		message("overlayfs can't stack sandboxes named with `,` or `:`\n");
+		errno = EINVAL;
+		goto error;
+	}
+	if (_sandbox_overlay_lower(srcname, lower)
+		|| _sandbox_mkdir(dest, resume)
+	) { goto error; }
+	snprintf(upper, PATH_MAX, "%s/upper", shadow);
+	snprintf(pathname, PATH_MAX, "%s/work", shadow);
+	if (_sandbox_mkdir(upper, resume) || _sandbox_mkdir(pathname, resume)) {
+		goto error;
+	}
+	snprintf(pathname, PATH_MAX, "%s/lower", shadow);
+	WARN(0 > (fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+		"open");
+	WARN(0 > write(fd, lower, strlen(lower)), "write");
+	WARN(0 > write(fd, "\n", 1), "write");
+	result = 0;
+error:
+	if (0 <= fd) { close(fd); }
+	return result;
+}
+
+/* Mount the named sandbox, and SANDBOX_OVERLAY first if it's the bottom
+ * layer.  Sandboxes it stacks on needn't be mounted themselves.
+ */
+static int _sandbox_overlay_mount(const char *name, const char *dirname) {
+	char lower[PATH_MAX], options[3 * PATH_MAX];
+	if (_sandbox_mounted(dirname)) { return 0; }
+	WARN(_sandbox_read(name, "lower", lower, PATH_MAX), "open");
+	const char *base = SANDBOX_OVERLAY "/root";
+	size_t len = strlen(lower), len2 = strlen(base);
+	if (len2 <= len && !strcmp(base, &lower[len - len2])
+		&& _sandbox_overlay_base()
+	) { goto error; }
+	snprintf(options, sizeof(options),
+		"lowerdir=%s,"
+		"upperdir=/var/sandboxes/.%s/upper,"
+		"workdir=/var/sandboxes/.%s/work",
+		lower, name, name);
+	message("mounting %s\n", dirname);
+	WARN(mount("overlay", dirname, "overlay", 0, options), "mount");
+	return 0;
+error:
+	return -1;
+}
+
+/* Unmount the sandbox, with everything mounted in it, and remove its
+ * mount point.  Its files are all in its shadow directory.
+ */
+static int _sandbox_overlay_unlink(const char *dirname) {
+	struct stat s;
+	if (_sandbox_mounted(dirname)) {
+		WARN(lstat(dirname, &s), "lstat");
+		if (dir_umount(dirname, s.st_dev)) { goto error; }
+	}
+	WARN(rmdir(dirname), "rmdir");
+	return 0;
+error:
+	return -1;
+}
+
+/* Make the lazy tree in the shadow directory that sandboxfs serves the
+ * whole sandbox from, and the sandbox as a mount point for it.
+ */
+static int _sandbox_sandboxfs_make(
+	const char *srcname, const char *dest, const char *shadow,
+	int resume, char *upper
+) {
+	char src[PATH_MAX];
+	if (strcmp("/", srcname)) {
+		snprintf(src, PATH_MAX, "/var/sandboxes/.%s%s", srcname, LAZY_ROOTFS);
+	}
+	else { strncpy(src, "/", PATH_MAX); }
+	snprintf(upper, PATH_MAX, "%s%s", shadow, LAZY_ROOTFS);
+	if (_sandbox_mkdir(dest, resume)
+		|| lazy_placeholder(AT_FDCWD, src, AT_FDCWD, upper)
+	) { return -1; }
+	return 0;
+}
+
+static int _sandbox_sandboxfs_mount(const char *name, const char *dirname) {
+	if (_sandbox_mounted(dirname)) { return 0; }
+	message("mounting %s\n", dirname);
+	return _sandbox_sandboxfs(dirname);
+}
+
+/* Unmount sandboxfs, with everything mounted in it, and remove its mount
+ * point.  Its files are all in its shadow directory.
+ */
+static int _sandbox_sandboxfs_unlink(const char *dirname) {
+	if (_sandbox_mounted(dirname)) {
+		if (_sandbox_umount_beneath(dirname)) { goto error; }
+		message("unmounting %s\n", dirname);
+		WARN(umount2(dirname, MNT_DETACH), "umount2");
+	}
+	WARN(rmdir(dirname), "rmdir");
+	return 0;
+error:
+	return -1;
+}
+
+static const struct sandbox_backend _sandbox_backends[] = {
+	{"hardlink", 0, 0,
+		_sandbox_hardlink_make, 0, _sandbox_stage_shallow,
+		0, _sandbox_hardlink_unlink},
+	{"reflink", 1, 0,
+		_sandbox_reflink_make, 0, _sandbox_stage_shallow,
+		0, _sandbox_reflink_unlink},
+	{"sandboxfs", 0, 1,
+		_sandbox_sandboxfs_make, 0, 0,
+		_sandbox_sandboxfs_mount, _sandbox_sandboxfs_unlink},
+	{"overlay", 0, 0,
+		_sandbox_overlay_make, _sandbox_overlay_hide, 0,
+		_sandbox_overlay_mount, _sandbox_overlay_unlink},
+	{0}
+};
+
+/* The backend new sandboxes are kept with (see sandbox_backend), or a
+ * null pointer for whatever `backend` in CONFIG names.
+ */
+static const struct sandbox_backend *_sandbox_backend = 0;
+
+/* Return the named backend, the hardlink backend if name is a null
+ * pointer, or a null pointer if there's no such backend.
+ */
+static const struct sandbox_backend *_sandbox_backend_find(
+	const char *name
+) {
+	int i;
+	if (!name) { return _sandbox_backends; }
+	for (i = 0; _sandbox_backends[i].name; ++i) {
+		if (!strcmp(name, _sandbox_backends[i].name)) {
+			return &_sandbox_backends[i];
+		}
+	}
+	message("there's no %s backend\n", name);
+	errno = EINVAL;
+	return 0;
+}
+
+/* Return the backend the named sandbox is kept with, as recorded in the
+ * `backend` file in its shadow directory.  Sandboxes that predate it, and
+ * the base sandbox, are hard linked.
+ */
+static const struct sandbox_backend *_sandbox_backend_of(const char *name) {
+	char buf[NAME_MAX];
+	if (!strcmp("/", name) || _sandbox_read(name, "backend", buf, NAME_MAX)) {
+		return _sandbox_backends;
+	}
+	return _sandbox_backend_find(buf);
+}
+
+/* Keep new sandboxes with the named backend, `hardlink`, `reflink`,
+ * `sandboxfs`, or `overlay`, instead of whatever `backend` in CONFIG
+ * names.  Clones of sandboxes kept by sandboxfs or overlayfs are always
+ * kept the same way, since they can't be hard linked to it.  Sandboxes are
+ * hard linked after all where /var/sandboxes can't share extents and where
+ * sandboxfs would have to serve a sandbox it can't fill a tree from.
+ */
+int sandbox_backend(const char *name) {
+	const struct sandbox_backend *backend = _sandbox_backend_find(name);
+	if (!backend) { return -1; }
+	_sandbox_backend = backend;
+	return 0;
+}
+
+/* Make a directory in a new sandbox that hides whatever's there in its
+ * source.
+ */
+static int _sandbox_placeholder(
+	const struct sandbox_backend *backend, const char *pathname, int resume
+) {
+	if (_sandbox_mkdir(pathname, resume)) { return -1; }
+	return backend->hide ? backend->hide(pathname) : 0;
+}
+
+/* Copy the source sandbox into the n sandboxes the backend made, whose
+ * roots are at dests, with the trees they don't take from the source at
+ * uppers and the trees sandboxfs serves in their shadow directories at
+ * shadows, running the stages concurrently.  It fails if any stage does.
+ * If copied is non-zero the backend has copied the source already but
+ * for its shadow directory.
+ */
+static int _sandbox_copy(
+	const struct sandbox_backend *backend,
+	const char *srcname, const char *src,
+	const char **dests, const char **uppers, const char **shadows,
+	struct journal **journals, int n, int copied, const char **share
+) {
+	int result = -1;
+	int i, j;
+	struct rules *shallow = 0, *deep = 0;
+	const char *deepcopy[] = {"/root", "/home"};
+	char deepsrc[2][PATH_MAX];
+	int shared[2];
+	char **paths = (char **)calloc(3 * n, sizeof(char *));
+	FATAL(!paths, "calloc");
+	char **shadowdests = paths, **deepdests[2] = {&paths[n], &paths[2 * n]};
+
+	/* Make a placeholder for FUSE to take over /etc before any stage
+	 * needs it.  A sandbox the backend copied has its source's
+	 * placeholders already.
+	 */
+	for (i = 0; i < n; ++i) {
+		int resume = copied || (journals && journal_resumed(journals[i]));
+		char *fuse = file_join(uppers[i], "etc");
+		int result2 = _sandbox_placeholder(backend, fuse, resume);
+		free(fuse);
+		if (result2) { goto error; }
+		shadowdests[i] = file_join(shadows[i], "etc");
+	}
+	char shadowsrc[PATH_MAX];
+	if (strcmp("/", srcname)) {
+		snprintf(shadowsrc, PATH_MAX, "/var/sandboxes/.%s/etc", srcname);
+	}
+	else { strncpy(shadowsrc, "/etc", PATH_MAX); }
+
+	/* Share /root and /home with the source through FUSE, as /etc is, so
+	 * their files are copied only once they're changed.  That takes hard
+	 * links into the shadow directory, so when they're on another
+	 * filesystem, or the source sandbox predates sharing them, they're
+	 * deep copied instead.
+	 */
+	struct stat s1, s2;
+	WARN(lstat(shadows[0], &s1), "lstat");
+	for (j = 0; j < 2; ++j) {
+		if (strcmp("/", srcname)) {
+			snprintf(deepsrc[j], PATH_MAX, "/var/sandboxes/.%s%s",
+				srcname, deepcopy[j]);
+		}
+		else { strncpy(deepsrc[j], deepcopy[j], PATH_MAX); }
+		shared[j] = !lstat(deepsrc[j], &s2) && S_ISDIR(s2.st_mode)
+			&& s1.st_dev == s2.st_dev;
+		if (!shared[j]) {
+			snprintf(deepsrc[j], PATH_MAX, "%s%s",
+				strcmp("/", src) ? src : "", deepcopy[j]);
+		}
+		for (i = 0; i < n; ++i) {
+			int resume = copied || (journals && journal_resumed(journals[i]));
+			if (!shared[j]) {
+				deepdests[j][i] = file_join(uppers[i], deepcopy[j]);
+				if (backend->hide && _sandbox_placeholder(
+					backend, deepdests[j][i], resume
+				)) { goto error; }
+				continue;
+			}
+			char *fuse = file_join(uppers[i], deepcopy[j]);
+			int result2 = _sandbox_placeholder(backend, fuse, resume);
+			free(fuse);
+			if (result2) { goto error; }
+			deepdests[j][i] = file_join(shadows[i], deepcopy[j]);
+		}
+	}
+
+	const char *exclude[] = {"/var/sandboxes", 0};
+	dir_anchors(SANDBOX_ANCHORS);
+	if (!(shallow = _sandbox_rules(src, _sandbox_shallow, 1))) { goto error; }
+	if (!(deep = _sandbox_rules(src, exclude, 1))) { goto error; }
+
+	/* A shared tree from a source sandbox was filtered when that sandbox
+	 * was built and lies outside it, where deep's rules don't reach.
+	 */
+	int (*shadow)(const struct sandbox_stage *stage) =
+		_sandbox_lazy ? _sandbox_stage_lazy : _sandbox_stage_shadow;
+	struct sandbox_stage stages[] = {
+		{backend->stage,
+			srcname, src, dests, journals, n, shallow, share},
+		{shadow,
+			srcname, shadowsrc, (const char **)shadowdests, journals, n, 0},
+		{shared[0] ? shadow : _sandbox_stage_deep,
+			srcname, deepsrc[0], (const char **)deepdests[0], journals, n,
+			shared[0] && strcmp("/", srcname) ? 0 : deep},
+		{shared[1] ? shadow : _sandbox_stage_deep,
+			srcname, deepsrc[1], (const char **)deepdests[1], journals, n,
+			shared[1] && strcmp("/", srcname) ? 0 : deep}
+	};
+	int nstages = sizeof(stages) / sizeof(struct sandbox_stage), failed = 0;
+	if (copied) {
+		stages[0].fn = 0;
+		for (j = 0; j < 2; ++j) {
+			if (!shared[j]) { stages[2 + j].fn = 0; }
+		}
+	}
+	for (i = 0; i < nstages; ++i) {
+		if (!stages[i].fn) { continue; }
+		errno = pthread_create(
+			&stages[i].thread, 0, _sandbox_stage, &stages[i]);
+		FATAL(errno, "pthread_create");
+	}
+	for (i = 0; i < nstages; ++i) {
+		if (!stages[i].fn) { continue; }
+		pthread_join(stages[i].thread, 0);
+		if (stages[i].result) { failed = 1; }
+	}
+
+	/* Report how close the base files are to their filesystem's limit on
+	 * hard links and what became of any past it.
+	 */
+	struct dir_nlink nlink;
+	dir_nlink(&nlink);
+	if (nlink.cloned) {
+		message("gave %lu files their own inodes\n", nlink.cloned);
+	}
+	message("linked %lu files with at most %lu links each\n",
+		nlink.linked, nlink.max);
+	if (nlink.reflinked || nlink.anchored || nlink.copied) {
+		message("%lu files past the link limit: "
+			"%lu reflinked, %lu anchored, %lu copied\n",
+			nlink.reflinked + nlink.anchored + nlink.copied,
+			nlink.reflinked, nlink.anchored, nlink.copied);
+	}
+	if (failed) { goto error; }
+
+	result = 0;
+error:
+	for (i = 0; i < 3 * n; ++i) { free(paths[i]); }
+	free(paths);
+	rules_unref(shallow);
+	rules_unref(deep);
+	return result;
+}
+
+/* Build n copies of the source sandbox at dests with their shadow
+ * directories at shadows, kept with the given backend.  If journals isn't
+ * null, each copy resumes from and records its progress in its journal.
+ */
+static int _sandbox_build(
+	const struct sandbox_backend *backend,
+	const char *srcname, const char *src,
+	const char **dests, const char **shadows, struct journal **journals,
+	int n
+) {
+	int result = -1;
+	int i, j, fd = -1, copied = 0;
+	char **uppers = (char **)calloc(n, sizeof(char *));
+	FATAL(!uppers, "calloc");
+	char **share = _sandbox_share(srcname);
+	dir_reflink(backend->reflink);
+	if (backend->whole) {
+		util_nlist_free((void **)share);
+		*share = 0;
+	}
+
+	/* Make the shadow directory and each new sandbox, which a backend
+	 * that serves the whole sandbox from its shadow directory needs
+	 * nothing more than.
+	 */
+	for (i = 0; i < n; ++i) {
+		int resume = journals && journal_resumed(journals[i]);
+		FATAL(!(uppers[i] = (char *)malloc(PATH_MAX)), "malloc");
+		if (_sandbox_mkdir(shadows[i], resume) || 0 > (copied = backend->make(
+			srcname, dests[i], shadows[i], resume, uppers[i]
+		))) { goto error; }
+	}
+	if (!backend->whole && _sandbox_copy(
+		backend, srcname, src, dests, (const char **)uppers, shadows,
+		journals, n, copied, (const char **)share
+	)) { goto error; }
+
+	/* Write the name of the parent sandbox to the `parent` file in each
+	 * shadow directory.
+	 */
+	for (i = 0; i < n; ++i) {
+		char parent[PATH_MAX];
+		snprintf(parent, PATH_MAX, "%s/parent", shadows[i]);
+		WARN(0 > (fd = open(parent, O_WRONLY | O_CREAT, 0644)), "open");
+		if (strcmp("/", srcname)) {
+			WARN(0 > write(fd, srcname, strlen(srcname)), "write");
+			WARN(0 > write(fd, "\n", 1), "write");
+		}
+		close(fd);
+		fd = -1;
+	}
+
+	/* Record the backend in the `backend` file in each shadow directory.
+	 */
+	for (i = 0; i < n; ++i) {
+		char pathname[PATH_MAX];
+		snprintf(pathname, PATH_MAX, "%s/backend", shadows[i]);
+		WARN(0 > (fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+			"open");
+		WARN(0 > write(fd, backend->name, strlen(backend->name)), "write");
+		WARN(0 > write(fd, "\n", 1), "write");
+		close(fd);
+		fd = -1;
+	}
+
+	/* Leave a `lazy` file in each shadow directory that may still have
+	 * lazy directories so they can be filled if their source is
+	 * destroyed.
+	 */
+	for (i = 0; (_sandbox_lazy || backend->whole) && i < n; ++i) {
+		char pathname[PATH_MAX];
+		snprintf(pathname, PATH_MAX, "%s/lazy", shadows[i]);
+		WARN(0 > (fd = open(pathname, O_WRONLY | O_CREAT, 0644)), "open");
+		close(fd);
+		fd = -1;
+	}
+
+	/* Record the shared subtrees in the `share` file in each shadow
+	 * directory so they're mounted again after a reboot and shared by
+	 * clones.
+	 */
+	for (i = 0; i < n; ++i) {
+		char pathname[PATH_MAX];
+		snprintf(pathname, PATH_MAX, "%s/share", shadows[i]);
+		WARN(0 > (fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+			"open");
+		for (j = 0; share[j]; ++j) {
+			WARN(0 > write(fd, share[j], strlen(share[j])), "write");
+			WARN(0 > write(fd, "\n", 1), "write");
+		}
+		close(fd);
+		fd = -1;
+	}
+
+	/* Link the base sandbox's manifest into the shadow directory of each
+	 * sandbox hard linked to it as `manifest` so sandbox_rebase can tell
+	 * which files are still the ones it was built with.
+	 */
+	for (i = 0; backend == _sandbox_backends && !strcmp("/", srcname)
+		&& i < n; ++i
+	) {
+		char pathname[PATH_MAX];
+		snprintf(pathname, PATH_MAX, "%s/manifest", shadows[i]);
+		unlink(pathname);
+		WARN(link(MANIFEST, pathname) && ENOENT != errno, "link");
+	}
+
+	result = 0;
+error:
+	if (0 <= fd) { close(fd); }
+	for (i = 0; i < n; ++i) { free(uppers[i]); }
+	free(uppers);
+	util_nlist_free((void **)share);
+	free(share);
+	return result;
+}
+
+/* Identify the version of the base sandbox's manifest in buf, which must
+ * hold at least NAME_MAX bytes.  If scan is non-zero and the manifest is
+ * stale, scan the base sandbox again first and identify the new manifest
+ * even if the base sandbox changed too recently for it to count as fresh.
+ * Otherwise returns -1 if the manifest is stale or missing.
+ */
+static int _sandbox_version(char *buf, int scan) {
+	struct stat s;
+	WARN(lstat("/", &s), "lstat");
+	dev_t dev = s.st_dev;
+	if (!manifest_fresh(MANIFEST, "/", dev, _sandbox_stamps, &s)) {
+		if (!scan) { goto error; }
+		struct rules *rules = _sandbox_rules("/", _sandbox_shallow, 1);
+		if (!rules) { goto error; }
+		struct tree *tree =
+			manifest_open(MANIFEST, "/", rules, dev, _sandbox_stamps);
+		rules_unref(rules);
+		if (!tree) { goto error; }
+		tree_free(tree);
+		WARN(lstat(MANIFEST, &s), "lstat");
+	}
+	snprintf(buf, NAME_MAX, "%lu %ld.%09ld\n", (unsigned long)s.st_ino,
+		(long)s.st_mtim.tv_sec, (long)s.st_mtim.tv_nsec);
+	return 0;
+error:
+	return -1;
+}
+
+/* Return non-zero if the pool entry at pathname was built from the given
+ * version of the base sandbox.  (Positive logic.)
+ */
+static int _sandbox_pool_current(const char *pathname, const char *base) {
+	char buf[NAME_MAX], *base2 = file_join(pathname, "base");
+	int fd = open(base2, O_RDONLY);
+	free(base2);
+	if (0 > fd) { return 0; }
+	ssize_t len = read(fd, buf, NAME_MAX - 1);
+	close(fd);
+	if (0 > len) { return 0; }
+	buf[len] = 0;
+	return !strcmp(base, buf);
+}
+
+/* Take exclusive ownership of the pool entry name by renaming it to
+ * include this process's pid.  Sets pathname, which must hold PATH_MAX
+ * bytes, to its new name.  Returns -1 if someone else got there first.
+ */
+static int _sandbox_pool_take(const char *name, char *pathname) {
+	char pathname2[PATH_MAX];
+	snprintf(pathname2, PATH_MAX, "%s/%s", SANDBOX_POOL, name);
+	snprintf(pathname, PATH_MAX, "%s/%s~%d", SANDBOX_POOL, name, getpid());
+	return rename(pathname2, pathname);
+}
+
+/* Remove the root and shadow directories of a sandbox being built at
+ * pathname, whatever state they're in.
+ */
+static int _sandbox_discard_trees(const char *pathname) {
+	int result = 0;
+	int i;
+	const char *names[] = {"root", "shadow", 0};
+	for (i = 0; names[i]; ++i) {
+		struct stat s;
+		char *pathname2 = file_join(pathname, names[i]);
+		if (!lstat(pathname2, &s) && dir_unlink(pathname2, s.st_dev)) {
+			result = -1;
+		}
+		free(pathname2);
+	}
+	return result;
+}
+
+/* Remove a pool entry or partial build this process owns, whatever state
+ * it's in.
+ */
+static int _sandbox_discard(const char *pathname) {
+	int result = _sandbox_discard_trees(pathname);
+	int i;
+	const char *names[] = {"base", "journal", 0};
+	for (i = 0; names[i]; ++i) {
+		char *pathname2 = file_join(pathname, names[i]);
+		unlink(pathname2);
+		free(pathname2);
+	}
+	if (rmdir(pathname)) {
+		perror("rmdir");
+		result = -1;
+	}
+	return result;
+}
+
+/* Move the sandbox built at pathname into place as dest with its shadow
+ * directory at shadow.  The shadow directory goes first so a sandbox is
+ * never seen without one.  If dest has been taken in the meantime,
+ * everything is put back.
+ */
+static int _sandbox_reveal(
+	const char *pathname, const char *dest, const char *shadow
+) {
+	char *root = file_join(pathname, "root");
+	char *shadow2 = file_join(pathname, "shadow");
+	int result = renameat2(AT_FDCWD, shadow2, AT_FDCWD, shadow,
+		RENAME_NOREPLACE);
+	if (!result && (result = renameat2(AT_FDCWD, root, AT_FDCWD, dest,
+		RENAME_NOREPLACE)
+	)) {
+		int errsv = errno;
+		rename(shadow, shadow2);
+		errno = errsv;
+	}
+	if (result) { perror("renameat2"); }
+	free(root);
+	free(shadow2);
+	return result;
+}
+
+/* Claim a pool entry built from the current version of the base sandbox
+ * and move it into place as the sandbox name.  Returns 1 if one was
+ * claimed, 0 if none were available, and -1 on failure.
+ */
+static int _sandbox_pool_claim(
+	const char *name, const char *dest, const char *shadow
+) {
+	int result = 0;
+	int i, ii = -1;
+	struct dirent **namelist = 0;
+	char base[NAME_MAX], pathname[PATH_MAX];
+	if (_sandbox_version(base, 0)) { goto error; }
+	if (0 > (ii = scandir(SANDBOX_POOL, &namelist, 0, alphasort))) {
+		goto error;
+	}
+	for (i = 0; i < ii; ++i) {
+		const char *entry = namelist[i]->d_name;
+		if ('.' == *entry || strchr(entry, '~')) { continue; }
+		snprintf(pathname, PATH_MAX, "%s/%s", SANDBOX_POOL, entry);
+		if (!_sandbox_pool_current(pathname, base)) { continue; }
+		if (_sandbox_pool_take(entry, pathname)) { continue; }
+		if (_sandbox_reveal(pathname, dest, shadow)) {
+			char pathname2[PATH_MAX];
+			snprintf(pathname2, PATH_MAX, "%s/%s", SANDBOX_POOL, entry);
+			rename(pathname, pathname2);
+			result = -1;
+			goto error;
+		}
+		_sandbox_discard(pathname);
+		result = 1;
+		break;
+	}
+error:
+	util_ilist_free((void **)namelist, ii);
+	free(namelist);
+	return result;
+}
+
+/* Build n pool entries at once from the given version of the base
+ * sandbox.  If the base changes while they're being built, they're thrown
+ * away and 1 is returned.
+ */
+static int _sandbox_pool_build(const char *base, int n) {
+	int result = -1;
+	int i, made, result2 = 0;
+	char base2[NAME_MAX];
+	char *pathnames = (char *)malloc(n * PATH_MAX);
+	FATAL(!pathnames, "malloc");
+	char **paths = (char **)calloc(2 * n, sizeof(char *));
+	FATAL(!paths, "calloc");
+	for (made = 0; made < n; ++made) {
+		char *pathname = &pathnames[made * PATH_MAX];
+		snprintf(pathname, PATH_MAX, "%s/.XXXXXX", SANDBOX_POOL);
+		if (!mkdtemp(pathname)) {
+			perror("mkdtemp");
+			result2 = -1;
+			break;
+		}
+		paths[made] = file_join(pathname, "root");
+		paths[n + made] = file_join(pathname, "shadow");
+	}
+	if (!result2) {
+		result2 = _sandbox_build(_sandbox_backends, "/", "/",
+			(const char **)paths, (const char **)&paths[n], 0, n);
+	}
+	if (!result2 && (_sandbox_version(base2, 0) || strcmp(base, base2))) {
+		message("base sandbox changed, discarding\n");
+		result = result2 = 1;
+	}
+	for (i = 0; !result2 && i < n; ++i) {
+		char *base3 = file_join(&pathnames[i * PATH_MAX], "base");
+		int fd = open(base3, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (0 > fd || 0 > write(fd, base, strlen(base))) {
+			perror(base3);
+			result2 = -1;
+		}
+		if (0 <= fd) { close(fd); }
+		free(base3);
+	}
+	if (result2) {
+		for (i = 0; i < made; ++i) {
+			_sandbox_discard(&pathnames[i * PATH_MAX]);
+		}
+		goto error;
+	}
+
+	/* Reveal the finished entries by dropping their leading `.`.
+	 */
+	for (i = 0; i < n; ++i) {
+		char *pathname = &pathnames[i * PATH_MAX], pathname2[PATH_MAX];
+		snprintf(pathname2, PATH_MAX, "%s/%s", SANDBOX_POOL,
+			strrchr(pathname, '/') + 2);
+		WARN(rename(pathname, pathname2), "rename");
+	}
+
+	result = 0;
+error:
+	for (i = 0; i < 2 * n; ++i) { free(paths[i]); }
+	free(paths);
+	free(pathnames);
+	return result;
+}
+
+/* Bring the pool up to size entries built from the current version of the
+ * base sandbox, building all that are missing at once and giving up if it
+ * changes under a few builds in a row.  Only
+ * one process fills the pool at a time, so any hidden entry found is left
+ * over from a failed build.  Entries that were being claimed or discarded
+ * by processes that have since died are removed, too.
+ */
+static int _sandbox_pool_fill(int size) {
+	int result = -1;
+	int fd = -1, i, ii = -1, count = 0, stale = 0;
+	struct dirent **namelist = 0;
+	char base[NAME_MAX], pathname[PATH_MAX];
+
+	if (mkdir(SANDBOX_POOL, 0700) && EEXIST != errno) { WARN(1, "mkdir"); }
+	WARN(0 > (fd = open(
+		SANDBOX_POOL_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0600
+	)), "open");
+	struct flock lock;
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = 0;
+	lock.l_len = 1;
+	WARN(fcntl(fd, F_SETLKW, &lock), "fcntl");
+
+	if (_sandbox_version(base, 1)) { goto error; }
+	WARN(0 > (ii = scandir(SANDBOX_POOL, &namelist, 0, alphasort)),
+		"scandir");
+	for (i = 0; i < ii; ++i) {
+		const char *entry = namelist[i]->d_name;
+		if (!strcmp(".", entry) || !strcmp("..", entry)) { continue; }
+		const char *pid = strchr(entry, '~');
+		snprintf(pathname, PATH_MAX, "%s/%s", SANDBOX_POOL, entry);
+		if ('.' == *entry) { _sandbox_discard(pathname); }
+		else if (pid) {
+			if (kill(atoi(pid + 1), 0) && ESRCH == errno) {
+				_sandbox_discard(pathname);
+			}
+		}
+		else if (_sandbox_pool_current(pathname, base)) { ++count; }
+		else if (!_sandbox_pool_take(entry, pathname)) {
+			_sandbox_discard(pathname);
+		}
 	}
-	FATAL(!(result = (char **)calloc(ii - 2 + 1, sizeof(char *))), "calloc");
-	for (i = 0, j = 0; i < ii; ++i) {
-		if ('.' == *namelist[i]->d_name) { continue; }
-		if (!(result[j++] = strdup(namelist[i]->d_name))) {
-			perror("strdup");
-			util_ilist_free_partial((void **)result, 0, j, -1);
-			free(result);
-			result = 0;
-			goto error;
+
+	/* Count again after each build since entries may have been claimed
+	 * in the meantime.
+	 */
+	while (count < size) {
+		int result2 = _sandbox_pool_build(base, size - count);
+		if (0 > result2) { goto error; }
+		if (result2) {
+			if (SANDBOX_POOL_TRIES == ++stale) { goto error; }
+			if (_sandbox_version(base, 1)) { goto error; }
+			continue;
+		}
+		stale = 0;
+		util_ilist_free((void **)namelist, ii);
+		free(namelist);
+		namelist = 0;
+		WARN(0 > (ii = scandir(SANDBOX_POOL, &namelist, 0, alphasort)),
+			"scandir");
+		for (count = 0, i = 0; i < ii; ++i) {
+			const char *entry = namelist[i]->d_name;
+			if ('.' != *entry && !strchr(entry, '~')) { ++count; }
 		}
 	}
-	result[j] = 0;
 
+	result = 0;
 error:
 	util_ilist_free((void **)namelist, ii);
 	free(namelist);
+	if (0 <= fd) { close(fd); }
 	return result;
 }
 
-/* Return the name of the current sandbox.
+/* Fill the pool in a detached process so the caller doesn't wait.
  */
-char *sandbox_which() {
-	char name[NAME_MAX];
-	sandbox_breakout(name);
-	char *result = 0;
-	FATAL(!(result = strdup(name)), "strdup");
-	return result;
+static void _sandbox_pool_refill(int size) {
+	pid_t pid = fork();
+	if (0 > pid) {
+		perror("fork");
+		return;
+	}
+	if (pid) {
+		waitpid(pid, 0, 0);
+		return;
+	}
+	if (0 > setsid() || 0 > (pid = fork())) { exit(-1); }
+	if (pid) { exit(0); }
+	int fd = open("/dev/null", O_RDWR);
+	if (0 <= fd) {
+		dup2(fd, 0);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		if (2 < fd) { close(fd); }
+	}
+	message_quiet_default(1);
+	message_quiet(1);
+	exit(_sandbox_pool_fill(size) ? -1 : 0);
 }
 
+/* A sandbox being created: where it'll go and where it's built.
+ */
+struct sandbox_new {
+	const char *name;
+	char dest[PATH_MAX], shadow[PATH_MAX];
+	char partial[PATH_MAX], root[PATH_MAX], shadow2[PATH_MAX];
+	struct journal *journal;
+};
+
 static int _sandbox_clone(
-	const char *srcname, const char *destname,
+	const char *srcname, const char **destnames,
 	const char * m, int m_args
 ) {
 	int result = -1;
 	struct stat s;
-	int i, fd = -1;
+	int i, j, n = 0, nbuild = 0, size = 0;
+	struct sandbox_new *news = 0;
+	const char **builds = 0;
+	struct journal **journals = 0;
+	const struct sandbox_backend *backend = 0, *srcbackend = 0;
 
 	char buf[NAME_MAX];
 	if (sandbox_breakout(buf)) { goto error; }
 	if (!srcname) { srcname = buf; }
-	char src[PATH_MAX], dest[PATH_MAX];
+	char src[PATH_MAX];
 	if (!sandbox_exists(srcname, src)) {
 		message("sandbox %s does not exist\n", srcname);
 		errno = ENOENT;
 		goto error;
 	}
-	if (sandbox_exists(destname, dest)) {
-		message("sandbox %s exists\n", destname);
-		errno = EEXIST;
-		goto error;
+	if (!(backend = _sandbox_backend)
+		&& !(backend = _sandbox_backend_find(config_get("backend")))
+	) { goto error; }
+	if (!(srcbackend = _sandbox_backend_of(srcname))) { goto error; }
+	if (srcbackend->mount && backend != srcbackend) {
+		message("sandbox %s is kept by %s, so its clones will be too\n",
+			srcname, srcbackend->name);
+		backend = srcbackend;
 	}
-	switch (m_args) {
-	case 1:
-		message(m, destname);
-		break;
-	case 2:
-		message(m, srcname, destname);
-		break;
+	if (backend->whole && backend != srcbackend && strcmp("/", srcname)) {
+		message("sandbox %s isn't served whole, hard linking instead\n",
+			srcname);
+		backend = _sandbox_backends;
+	}
+	while (destnames[n]) { ++n; }
+	FATAL(!(news = (struct sandbox_new *)calloc(
+		n, sizeof(struct sandbox_new)
+	)), "calloc");
+	FATAL(!(builds = (const char **)calloc(2 * n, sizeof(char *))),
+		"calloc");
+	FATAL(!(journals = (struct journal **)calloc(
+		n, sizeof(struct journal *)
+	)), "calloc");
+	for (i = 0; i < n; ++i) {
+		struct sandbox_new *new = &news[i];
+		new->name = destnames[i];
+		if (sandbox_exists(new->name, new->dest)) {
+			message("sandbox %s exists\n", new->name);
+			errno = EEXIST;
+			goto error;
+		}
+		for (j = 0; j < i; ++j) {
+			if (strcmp(new->name, news[j].name)) { continue; }
+			message("sandbox %s given more than once\n", new->name);
+			errno = EINVAL;
+			goto error;
+		}
+		snprintf(new->shadow, PATH_MAX, "/var/sandboxes/.%s", new->name);
+		snprintf(new->partial, PATH_MAX, "%s/%s", SANDBOX_PARTIAL, new->name);
+		snprintf(new->root, PATH_MAX, "%s/root", new->partial);
+		snprintf(new->shadow2, PATH_MAX, "%s/shadow", new->partial);
+	}
+	for (i = 0; i < n; ++i) {
+		switch (m_args) {
+		case 1:
+			message(m, news[i].name);
+			break;
+		case 2:
+			message(m, srcname, news[i].name);
+			break;
+		}
 	}
 
 	/* Make sure /var/sandboxes exists and is a directory.
@@ -178,89 +1653,140 @@ static int _sandbox_clone(
 		WARN(mkdir("/var/sandboxes", 0755), "mkdir");
 	}
 	else if (!S_ISDIR(s.st_mode)) { goto error; }
-
-	/* Shallow copy most of the filesystem.
-	 */
-	{
-		WARN(lstat(src, &s), "lstat");
-		const char *exclude[] = {
-			"/etc", "/var/sandboxes", "/root", "/home", 0
-		};
-		for (i = 0; exclude[i]; ++i) {
-			exclude[i] = file_join(src, exclude[i]);
-		}
-		result = dir_shallowcopy(src, dest, s.st_dev, exclude);
-		util_nlist_free((void **)exclude);
+	if (backend->reflink && !file_reflinkable("/var/sandboxes")) {
+		message("/var/sandboxes can't share extents, hard linking instead\n");
+		backend = _sandbox_backends;
 	}
 
-	/* Shallow copy /etc from the appropriate source into the shadow
-	 * directory and create a placeholder for FUSE to take over.
+	/* Claim each name by opening its journal, which only one process may
+	 * do at a time.  A journal left by an interrupted build of the same
+	 * version of the same source is resumed; anything else left behind is
+	 * thrown away.  Another sandbox may change anywhere between attempts
+	 * without leaving a version behind, so clones always start over.
 	 */
-	{
-		const char *exclude[] = {0};
-		char fuse[PATH_MAX], shadowsrc[PATH_MAX], shadowdest[PATH_MAX];
-		strncpy(fuse, dest, PATH_MAX);
-		strncat(fuse, "/etc", PATH_MAX - strlen(fuse) - 1);
-		WARN(mkdir(fuse, 0755), "mkdir");
-		if (strcmp("/", srcname)) {
-			strncpy(shadowsrc, "/var/sandboxes/.", PATH_MAX);
-			strncat(shadowsrc, srcname, PATH_MAX - strlen(shadowsrc) - 1);
-			strncat(shadowsrc, "/etc", PATH_MAX - strlen(shadowsrc) - 1);
+	char header[3 * NAME_MAX], version[NAME_MAX] = "";
+	if (!strcmp("/", srcname) && backend->stage
+		&& _sandbox_version(version, 1)
+	) { goto error; }
+	if (strcmp("/", srcname)) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		snprintf(version, NAME_MAX, "%d %ld.%09ld", (int)getpid(),
+			(long)now.tv_sec, (long)now.tv_nsec);
+	}
+	snprintf(header, sizeof(header), "%s %s %s",
+		srcname, backend->name, version);
+	header[strcspn(header, "\n")] = 0;
+	if (mkdir(SANDBOX_PARTIAL, 0755) && EEXIST != errno) {
+		WARN(1, "mkdir");
+	}
+	for (i = 0; i < n; ++i) {
+		struct sandbox_new *new = &news[i];
+		if (mkdir(new->partial, 0755) && EEXIST != errno) {
+			WARN(1, "mkdir");
+		}
+		char *journal = file_join(new->partial, "journal");
+		new->journal = journal_open(journal, new->partial, header);
+		free(journal);
+		if (!new->journal) {
+			if (EAGAIN == errno || EACCES == errno) {
+				message("sandbox %s is being created\n", new->name);
+			}
+			goto error;
+		}
+		if (journal_resumed(new->journal)) {
+			message("resuming sandbox %s\n", new->name);
 		}
-		else { strncpy(shadowsrc, "/etc", PATH_MAX); }
-		WARN(lstat(shadowsrc, &s), "lstat");
-		strncpy(shadowdest, "/var/sandboxes/.", PATH_MAX);
-		strncat(shadowdest, destname, PATH_MAX - strlen(shadowdest) - 1);
-		WARN(mkdir(shadowdest, 0755), "mkdir");
-		strncat(shadowdest, "/etc", PATH_MAX - strlen(shadowdest) - 1);
-		result += dir_shallowcopy(shadowsrc, shadowdest, s.st_dev, exclude);
+		else if (_sandbox_discard_trees(new->partial)) { goto error; }
 	}
 
-	/* Deep copy /root and /home.
+	/* Take new copies of the base sandbox from the pool while they last
+	 * and build the rest together from one walk of the source, which is
+	 * mounted first if it has to be.  The pool is hard linked.
 	 */
-	{
-		const char *exclude[] = {"/var/sandboxes", 0};
-		for (i = 0; exclude[i]; ++i) {
-			exclude[i] = file_join(src, exclude[i]);
+	size = strcmp("/", srcname) || backend != _sandbox_backends
+		? 0 : config_int("pool", 0);
+	if (!backend->whole && srcbackend->mount
+		&& srcbackend->mount(srcname, src)
+	) { goto error; }
+	for (i = 0; i < n; ++i) {
+		struct sandbox_new *new = &news[i];
+		int claimed = 0;
+		if (0 < size && 0 > (claimed = _sandbox_pool_claim(
+			new->name, new->dest, new->shadow
+		))) { goto error; }
+		if (claimed) {
+			_sandbox_discard(new->partial);
+			journal_close(new->journal);
+			new->journal = 0;
+			continue;
 		}
-		const char *deepcopy[] = {"/root", "/home", 0};
-		for (i = 0; deepcopy[i]; ++i) {
-			char *deepsrc = file_join(src, deepcopy[i]);
-			char *deepdest = file_join(dest, deepcopy[i]);
-			result += dir_deepcopy(deepsrc, deepdest, exclude);
-			free(deepsrc);
-			free(deepdest);
+		builds[nbuild] = new->root;
+		builds[n + nbuild] = new->shadow2;
+		journals[nbuild++] = new->journal;
+	}
+	if (nbuild && _sandbox_build(
+		backend, srcname, src, builds, &builds[n], journals, nbuild
+	)) {
+		for (i = 0; i < n; ++i) {
+			if (!news[i].journal) { continue; }
+			message("sandbox %s is incomplete, run again to resume\n",
+				news[i].name);
 		}
-		util_nlist_free((void **)exclude);
+		goto error;
 	}
 
-	/* Write the name of the parent sandbox to the `parent` file in the
-	 * shadow directory.
+	/* Reveal each finished sandbox.
 	 */
-	char parent[PATH_MAX];
-	snprintf(parent, PATH_MAX, "/var/sandboxes/.%s/parent", destname);
-	WARN(0 > (fd = open(parent, O_WRONLY | O_CREAT, 0644)), "open");
-	if (strcmp("/", srcname)) {
-		WARN(0 > write(fd, srcname, strlen(srcname)), "write");
-		WARN(0 > write(fd, "\n", 1), "write");
+	for (i = 0; i < n; ++i) {
+		struct sandbox_new *new = &news[i];
+		if (!new->journal) { continue; }
+		if (_sandbox_reveal(new->partial, new->dest, new->shadow)) {
+			goto error;
+		}
+		_sandbox_discard(new->partial);
 	}
 
 	result = 0;
 error:
-	close(fd);
+	for (i = 0; news && i < n; ++i) { journal_close(news[i].journal); }
+	free(news);
+	free(builds);
+	free(journals);
+
+	/* Top the pool up in the background.
+	 */
+	if (0 < size) { _sandbox_pool_refill(size); }
+
 	return result;
 }
 
 /* Create a sandbox by cloning the base sandbox.
  */
 int sandbox_create(const char *name) {
-	return _sandbox_clone("/", name, "creating sandbox %s\n", 1);
+	const char *names[] = {name, 0};
+	return sandbox_create_many(names);
+}
+
+/* Create several sandboxes from one walk of the base sandbox.  names is
+ * null-terminated.
+ */
+int sandbox_create_many(const char **names) {
+	return _sandbox_clone("/", names, "creating sandbox %s\n", 1);
 }
 
 /* Clone a sandbox.
  */
 int sandbox_clone(const char *srcname, const char *destname) {
-	return _sandbox_clone(srcname, destname, "cloning sandbox %s to %s\n", 2);
+	const char *destnames[] = {destname, 0};
+	return sandbox_clone_many(srcname, destnames);
+}
+
+/* Clone a sandbox several times from one walk of it.  destnames is
+ * null-terminated.
+ */
+int sandbox_clone_many(const char *srcname, const char **destnames) {
+	return _sandbox_clone(srcname, destnames, "cloning sandbox %s to %s\n", 2);
 }
 
 /* Increment the named sandbox's reference count.  This must be called
@@ -331,7 +1857,7 @@ int sandbox_use(const char *name, const char *command, const char *callback) {
 		*sockname = 0, *sockname2 = 0, *sockname3 = 0, *dirname3 = 0;
 	const char *dirnames[] = {"/etc/init", "/etc/init.d", 0};
 	struct dirent **namelists[] = {0, 0, 0};
-	int jj[3];
+	int i, jj[3];
 	GHashTable *services = 0;
 	pid_t pid;
 
@@ -345,56 +1871,79 @@ int sandbox_use(const char *name, const char *command, const char *callback) {
 	}
 	message("using sandbox %s\n", name);
 	ref = _sandbox_refcount_inc(name);
+	const struct sandbox_backend *backend = _sandbox_backend_of(name);
+	if (!backend || (backend->mount && backend->mount(name, dirname1))) {
+		goto error;
+	}
 
-	/* If the user's home directory doesn't exist in this sandbox, deep
-	 * copy if from the base sandbox.
+	/* If the user's home directory doesn't exist in this sandbox, copy it
+	 * from the base sandbox.  Where /root or /home is shared, that's just
+	 * a shallow copy into the shadow directory, and FUSE copies each file
+	 * the first time it's changed.  Otherwise it's a deep copy.
 	 */
-	char *homesrc = getenv("HOME"), *homedest;
-	if (homesrc) {
-		homedest = file_join(dirname1, homesrc);
-		if (lstat(homedest, &s1)) {
-			const char *exclude[] = {0};
-			dir_deepcopy(homesrc, homedest, exclude);
+	char *homesrc = getenv("HOME"), homedest[PATH_MAX];
+	dir_reflink(backend->reflink);
+	if (homesrc && '/' == *homesrc && strcmp("/", name)) {
+		const char *exclude[] = {0};
+		struct rules *rules = _sandbox_rules("/", exclude, 1);
+		if (_sandbox_shared(name, homesrc, homedest)) {
+			_sandbox_fill(name, homesrc);
+			if (lstat(homedest, &s1) && !lstat(homesrc, &s2)) {
+				dir_shallowcopy(homesrc, homedest, s2.st_dev, rules);
+			}
+		}
+		else {
+			snprintf(homedest, PATH_MAX, "%s%s", dirname1, homesrc);
+			if (lstat(homedest, &s1)) {
+				dir_deepcopy(homesrc, homedest, rules);
+			}
 		}
-		free(homedest);
+		rules_unref(rules);
 	}
 
-	/* Recursively rebind mounted devices in the sandbox using mount(8).
-	 * This will only need to do actual work the first time a sandbox
-	 * is used after a reboot.  Because walking the entire filesystem
-	 * is slow, this guesses that if /dev is mounted correctly, so is
-	 * everything else.
+	/* Recursively rebind mounted devices and shared subtrees in the
+	 * sandbox using mount(8).  This will only need to do actual work the
+	 * first time a sandbox is used after a reboot.  Because walking the
+	 * entire filesystem is slow, this guesses that if /dev is mounted
+	 * correctly, so is everything else.
 	 */
 	WARN(lstat("/dev", &s1), "lstat");
 	dirname2 = file_join(dirname1, "dev");
 	WARN(lstat(dirname2, &s2), "lstat");
 	if (s1.st_dev != s2.st_dev) {
 		struct stat s;
-		WARN(lstat(dirname1, &s), "lstat");
+		WARN(lstat("/", &s), "lstat");
 		message("remounting devices\n");
-		const char *exclude[] = {"/var/sandboxes", "/root", "/home", 0};
-		if (dir_remount("/", dirname1, s.st_dev, exclude)) { goto error; }
+		if (backend->whole) {
+			if (_sandbox_remount_table(dirname1)) { goto error; }
+		}
+		else {
+			const char *exclude[] = {"/var/sandboxes", "/root", "/home", 0};
+			struct rules *rules = _sandbox_rules("/", exclude, 0);
+			if (!rules) { goto error; }
+			char **share = _sandbox_share(name);
+			int result2 = dir_remount(
+				"/", dirname1, s.st_dev, rules, (const char **)share);
+			util_nlist_free((void **)share);
+			free(share);
+			rules_unref(rules);
+			if (result2) { goto error; }
+		}
 	}
 
-	/* Mount FUSE in front of /etc if that hasn't already been done.
+	/* Mount FUSE in front of /etc and whichever of /root and /home are
+	 * shared if that hasn't already been done.
 	 */
-	WARN(lstat("/etc", &s1), "lstat");
-	root = file_join(dirname1, "etc");
-	WARN(lstat(root, &s2), "lstat");
-	if (s1.st_dev == s2.st_dev && strcmp("/", name)) {
-		message("mounting special /etc\n");
-		WARN(0 > (pid = fork()), "fork");
-		if (!pid) {
-			execlp("sandboxfs", "sandboxfs", "-oallow_other", root, (char *)0);
-			perror("execlp");
-			exit(-1);
-		}
-		int status;
-		do { wait(&status); }
-		while (!WIFEXITED(status));
-		if (WEXITSTATUS(status)) {
-			message("sandboxfs misbehaving, skipping\n");
-		}
+	WARN(lstat(dirname1, &s1), "lstat");
+	for (i = 0; _sandbox_fuse[i] && strcmp("/", name); ++i) {
+		char shadow[PATH_MAX];
+		if (!_sandbox_shared(name, _sandbox_fuse[i], shadow)) { continue; }
+		free(root);
+		root = file_join(dirname1, _sandbox_fuse[i]);
+		WARN(lstat(root, &s2), "lstat");
+		if (s1.st_dev != s2.st_dev) { continue; }
+		message("mounting special %s\n", _sandbox_fuse[i]);
+		_sandbox_sandboxfs(root);
 	}
 
 	/* If there's an `ssh-agent`(1) running in the current sandbox, copy it
@@ -509,6 +2058,68 @@ error:
 
 }
 
+/* Throw away what an interrupted build of the named sandbox left behind,
+ * unless it's being built right now.  Fails with ENOENT if there's
+ * nothing to throw away.
+ */
+static int _sandbox_destroy_partial(const char *name) {
+	int result = -1;
+	struct journal *j = 0;
+	if (!name || !strcmp("/", name) || !sandbox_valid(name)) {
+		errno = ENOENT;
+		goto error;
+	}
+	char partial[PATH_MAX];
+	snprintf(partial, PATH_MAX, "%s/%s", SANDBOX_PARTIAL, name);
+	struct stat s;
+	if (lstat(partial, &s)) { goto error; }
+	char *journal = file_join(partial, "journal");
+	j = journal_open(journal, partial, "");
+	free(journal);
+	if (!j) {
+		if (EAGAIN == errno || EACCES == errno) {
+			message("sandbox %s is being created\n", name);
+		}
+		goto error;
+	}
+	message("destroying incomplete sandbox %s\n", name);
+	result = _sandbox_discard(partial);
+error:
+	journal_close(j);
+	return result;
+}
+
+/* Return non-zero if another sandbox kept by overlayfs stacks on the
+ * named sandbox, which can't be destroyed until they are.
+ * (Positive logic.)
+ */
+static int _sandbox_stacked(const char *name) {
+	int result = 1;
+	int i;
+	char **names = sandbox_list();
+	if (!names) { goto error; }
+	char upper[PATH_MAX], root[PATH_MAX];
+	snprintf(upper, PATH_MAX, "/var/sandboxes/.%s/upper", name);
+	snprintf(root, PATH_MAX, "/var/sandboxes/%s", name);
+	for (i = 0; names[i]; ++i) {
+		char lower[PATH_MAX], *layer, *saveptr = 0;
+		if (_sandbox_read(names[i], "lower", lower, PATH_MAX)) { continue; }
+		for (layer = strtok_r(lower, ":", &saveptr); layer;
+			layer = strtok_r(0, ":", &saveptr)
+		) {
+			if (strcmp(upper, layer) && strcmp(root, layer)) { continue; }
+			message("sandbox %s is stacked on sandbox %s\n",
+				names[i], name);
+			goto error;
+		}
+	}
+	result = 0;
+error:
+	util_nlist_free((void **)names);
+	free(names);
+	return result;
+}
+
 /* Destroy a sandbox.
  */
 int sandbox_destroy(const char *name) {
@@ -517,8 +2128,10 @@ int sandbox_destroy(const char *name) {
 	if (sandbox_breakout(buf)) { goto error; }
 	char dirname[PATH_MAX];
 	if (!sandbox_exists(name, dirname)) {
-		message("sandbox %s does not exist\n", name);
-		errno = ENOENT;
+		if (!_sandbox_destroy_partial(name)) { return 0; }
+		if (ENOENT == errno) {
+			message("sandbox %s does not exist\n", name);
+		}
 		goto error;
 	}
 	if (!strcmp("/", name)) {
@@ -529,16 +2142,21 @@ int sandbox_destroy(const char *name) {
 		message("won't destroy the current sandbox\n");
 		goto error;
 	}
+	const struct sandbox_backend *backend = _sandbox_backend_of(name);
+	if (!backend || _sandbox_stacked(name)) { goto error; }
 	message("destroying sandbox %s\n", name);
+	if (_sandbox_fill_clones(name)) { goto error; }
 
 	struct stat s1, s2;
 	WARN(lstat(dirname, &s1), "lstat");
 
 	char fuse[PATH_MAX], shadow[PATH_MAX];
-	strncpy(fuse, dirname, PATH_MAX);
-	strncat(fuse, "/etc", PATH_MAX - strlen(fuse) - 1);
-	if (!lstat(fuse, &s2) && s1.st_dev != s2.st_dev) {
-		message("umnounting special /etc\n");
+	int i;
+	for (i = 0; _sandbox_fuse[i]; ++i) {
+		strncpy(fuse, dirname, PATH_MAX);
+		strncat(fuse, _sandbox_fuse[i], PATH_MAX - strlen(fuse) - 1);
+		if (lstat(fuse, &s2) || s1.st_dev == s2.st_dev) { continue; }
+		message("unmounting special %s\n", _sandbox_fuse[i]);
 		pid_t pid;
 		WARN(0 > (pid = fork()), "fork");
 		if (!pid) {
@@ -553,15 +2171,472 @@ int sandbox_destroy(const char *name) {
 			message("sandboxfs misbehaving, skipping\n");
 		}
 	}
+	if (backend->unlink(dirname)) { goto error; }
 	strncpy(shadow, "/var/sandboxes/.", PATH_MAX);
 	strncat(shadow, name, PATH_MAX - strlen(shadow) - 1);
 	if (!lstat(shadow, &s2)) {
 		if (dir_unlink(shadow, s2.st_dev)) { goto error; }
 	}
 
-	if (dir_unlink(dirname, s1.st_dev)) { goto error; }
+	if (dir_anchors_prune(SANDBOX_ANCHORS)) { goto error; }
+
+	return 0;
+error:
+	return -1;
+}
+
+/* What sandbox_rebase knows about the sandbox it's rebasing, whose root
+ * and each pathname in it is prefixlen bytes longer than the same
+ * pathname in the base sandbox.
+ */
+struct sandbox_rebase {
+	const struct tree *old, *new;
+	const char **share;
+	dev_t dev;
+	size_t prefixlen;
+	unsigned long relinked, added, removed, kept;
+};
+
+/* Return the pathname in the base sandbox of the pathname in the
+ * sandbox.
+ */
+static const char *_sandbox_rebase_base(
+	const struct sandbox_rebase *r, const char *pathname
+) {
+	return pathname[r->prefixlen] ? &pathname[r->prefixlen] : "/";
+}
+
+/* Append name to pathname, which is len bytes long, returning its new
+ * length, or 0 if it won't fit.
+ */
+static size_t _sandbox_rebase_push(
+	char *pathname, size_t len, const char *name
+) {
+	int len2 = snprintf(&pathname[len], PATH_MAX - len, "/%s", name);
+	return PATH_MAX - len <= len2 ? 0 : len + len2;
+}
+
+/* Return non-zero if the sandbox's file, described by s, is still entry i
+ * of the old tree: the same inode, or a copy with the same mode, size, and
+ * modification time, as setuid files and the like are given.  (Positive
+ * logic.)
+ */
+static int _sandbox_rebase_unchanged(
+	const struct sandbox_rebase *r, uint32_t i, const struct stat *s
+) {
+	const struct tree *t = r->old;
+	if (s->st_dev == r->dev && s->st_ino == t->ino[i]) { return 1; }
+	return s->st_mode == t->mode[i]
+		&& (uint64_t)s->st_size == t->size[i]
+		&& s->st_mtim.tv_sec == t->mtime[i].tv_sec
+		&& s->st_mtim.tv_nsec == t->mtime[i].tv_nsec;
+}
+
+/* Point pathname at the same file in the base sandbox, replacing whatever
+ * it is now in one step.  The file is copied instead wherever a shallow
+ * copy would (see dir_classify), or if it was setuid, setgid, or sticky
+ * as mode, its mode in the old tree, and left out if a shallow copy would
+ * leave it out.  A file that can take no more links is reflinked, linked
+ * to an anchor, or copied (see dir_linkat).  A file that's gone from the
+ * base sandbox since it was scanned is left alone.
+ */
+static int _sandbox_rebase_link(
+	const struct sandbox_rebase *r, const char *pathname, mode_t mode
+) {
+	const char *base = _sandbox_rebase_base(r, pathname);
+	struct stat s;
+	if (lstat(base, &s)) {
+		if (ENOENT == errno) { return 0; }
+		WARN(1, "lstat");
+	}
+	char dirname[PATH_MAX];
+	const char *name = strrchr(base, '/');
+	memcpy(dirname, base, name - base);
+	dirname[name++ - base] = 0;
+	int how = mode & (S_ISUID | S_ISGID | S_ISVTX)
+		? DIR_COPY : dir_classify(0, dirname, name, &s);
+	if (DIR_SKIP == how) { return 0; }
+
+	char tmp[PATH_MAX];
+	if (PATH_MAX <= snprintf(tmp, PATH_MAX, "%s~%d", pathname, (int)getpid())) {
+		return 0;
+	}
+	unlink(tmp);
+	if (DIR_COPY == how) {
+		if (file_copy(base, tmp)) {
+			unlink(tmp);
+			goto error;
+		}
+	}
+	else if (dir_linkat(AT_FDCWD, base, AT_FDCWD, tmp)) {
+		if (ENOENT == errno) { return 0; }
+		perror("link");
+		unlink(tmp);
+		goto error;
+	}
+	if (rename(tmp, pathname)) {
+		unlink(tmp);
+		WARN(1, "rename");
+	}
+	return 0;
+error:
+	return -1;
+}
+
+/* Add entry i of the new tree, which the base sandbox gained, to the
+ * sandbox at pathname, with everything beneath it.
+ */
+static int _sandbox_rebase_add(
+	struct sandbox_rebase *r, uint32_t i, char *pathname, size_t len
+) {
+	const struct tree *t = r->new;
+	if (!S_ISDIR(t->mode[i])) {
+		struct stat s;
+		if (!lstat(pathname, &s)) { return 0; }
+		++r->added;
+		return _sandbox_rebase_link(r, pathname, 0);
+	}
+	if (mkdir(pathname, t->mode[i] & 07777)) {
+		struct stat s;
+		if (EEXIST != errno || lstat(pathname, &s) || !S_ISDIR(s.st_mode)) {
+			return 0;
+		}
+	}
+	else {
+		WARN(lchown(pathname, t->uid[i], t->gid[i]), "lchown");
+		WARN(chmod(pathname, t->mode[i] & 07777), "chmod");
+	}
+	uint32_t j;
+	for (j = t->first[i]; j < t->first[i] + t->count[i]; ++j) {
+		size_t len2 = _sandbox_rebase_push(pathname, len, tree_name(t, j));
+		if (len2 && _sandbox_rebase_add(r, j, pathname, len2)) {
+			goto error;
+		}
+		pathname[len] = 0;
+	}
+	return 0;
+error:
+	return -1;
+}
 
+/* Remove entry i of the old tree, which the base sandbox lost, from the
+ * sandbox at pathname, with everything beneath it, except what the
+ * sandbox changed.
+ */
+static int _sandbox_rebase_remove(
+	struct sandbox_rebase *r, uint32_t i, char *pathname, size_t len
+) {
+	const struct tree *t = r->old;
+	if (S_ISDIR(t->mode[i])) {
+		uint32_t j;
+		for (j = t->first[i]; j < t->first[i] + t->count[i]; ++j) {
+			size_t len2 = _sandbox_rebase_push(pathname, len, tree_name(t, j));
+			if (len2 && _sandbox_rebase_remove(r, j, pathname, len2)) {
+				goto error;
+			}
+			pathname[len] = 0;
+		}
+		rmdir(pathname);
+		return 0;
+	}
+	struct stat s;
+	if (lstat(pathname, &s)) { return 0; }
+	if (!_sandbox_rebase_unchanged(r, i, &s)) {
+		++r->kept;
+		return 0;
+	}
+	WARN(unlink(pathname), "unlink");
+	++r->removed;
 	return 0;
 error:
 	return -1;
 }
+
+/* Bring pathname in the sandbox from entry o of the old tree, if had is
+ * non-zero, to entry n of the new tree, which is a different file.  The
+ * sandbox's changes stay, including anything it removed.
+ */
+static int _sandbox_rebase_entry(
+	struct sandbox_rebase *r, int had, uint32_t o, uint32_t n,
+	char *pathname, size_t len
+) {
+	const struct tree *old = r->old, *new = r->new;
+
+	/* A directory replaced a file or the other way around, so the old one
+	 * goes first.
+	 */
+	if (had && S_ISDIR(old->mode[o]) != S_ISDIR(new->mode[n])) {
+		if (_sandbox_rebase_remove(r, o, pathname, len)) { return -1; }
+		had = 0;
+	}
+	struct stat s;
+	if (lstat(pathname, &s)) {
+		return had ? 0 : _sandbox_rebase_add(r, n, pathname, len);
+	}
+	if (S_ISDIR(new->mode[n])) {
+		return _sandbox_rebase_add(r, n, pathname, len);
+	}
+	if (had && _sandbox_rebase_unchanged(r, o, &s)) {
+		++r->relinked;
+		return _sandbox_rebase_link(r, pathname, old->mode[o]);
+	}
+	++r->kept;
+	return 0;
+}
+
+/* Bring the directory at pathname in the sandbox from entry o of the old
+ * tree to entry n of the new tree.  A directory whose inode and ctime
+ * haven't changed holds the same entries, so only its subdirectories are
+ * looked at.  Otherwise each entry that's now a different file is pointed
+ * at the new one if the sandbox still has the old one.  Only entries that
+ * changed are ever looked up in the sandbox.
+ */
+static int _sandbox_rebase_dir(
+	struct sandbox_rebase *r, uint32_t o, uint32_t n,
+	char *pathname, size_t len
+) {
+	int result = -1, i;
+	const struct tree *old = r->old, *new = r->new;
+	GHashTable *names = 0;
+	if (new->dev[n] != r->dev || S_ISVTX & new->mode[n]) { return 0; }
+	for (i = 0; r->share[i]; ++i) {
+		if (!strcmp(r->share[i], _sandbox_rebase_base(r, pathname))) {
+			return 0;
+		}
+	}
+	int same = old->ino[o] == new->ino[n]
+		&& old->ctime[o].tv_sec == new->ctime[n].tv_sec
+		&& old->ctime[o].tv_nsec == new->ctime[n].tv_nsec;
+
+	FATAL(!(names = g_hash_table_new(g_str_hash, g_str_equal)),
+		"g_hash_table_new");
+	uint32_t j;
+	for (j = old->first[o]; j < old->first[o] + old->count[o]; ++j) {
+		g_hash_table_insert(names,
+			(char *)tree_name(old, j), (void *)(uintptr_t)(j + 1));
+	}
+	for (j = new->first[n]; j < new->first[n] + new->count[n]; ++j) {
+		const char *name = tree_name(new, j);
+		uintptr_t k = (uintptr_t)g_hash_table_lookup(names, name);
+		g_hash_table_remove(names, name);
+		size_t len2 = _sandbox_rebase_push(pathname, len, name);
+		if (!len2) { continue; }
+		int had = !!k--;
+		if (had && S_ISDIR(old->mode[k]) && S_ISDIR(new->mode[j])) {
+			if (_sandbox_rebase_dir(r, k, j, pathname, len2)) { goto error; }
+		}
+		else if (!same && !(had && old->ino[k] == new->ino[j])
+			&& _sandbox_rebase_entry(r, had, k, j, pathname, len2)
+		) { goto error; }
+		pathname[len] = 0;
+	}
+
+	/* Whatever's left is gone from the base sandbox.
+	 */
+	for (j = old->first[o]; !same && j < old->first[o] + old->count[o]; ++j) {
+		const char *name = tree_name(old, j);
+		if (!g_hash_table_contains(names, name)) { continue; }
+		size_t len2 = _sandbox_rebase_push(pathname, len, name);
+		if (len2 && _sandbox_rebase_remove(r, j, pathname, len2)) {
+			goto error;
+		}
+		pathname[len] = 0;
+	}
+
+	result = 0;
+error:
+	pathname[len] = 0;
+	if (names) { g_hash_table_destroy(names); }
+	return result;
+}
+
+/* Bring a sandbox hard linked to the base sandbox up to date with it after
+ * the base sandbox has changed, as upgrading packages changes it, without
+ * building it again.  The manifest the sandbox was built from is compared
+ * with the current one, and each file that's changed since is pointed at
+ * the new file wherever the sandbox still has the old one.  Files the base
+ * sandbox gained are added and those it lost are removed unless the
+ * sandbox has changed them, too.  /etc, /root, and /home aren't in the
+ * manifest and are left to the sandbox.
+ */
+int sandbox_rebase(const char *name) {
+	int result = -1, fd = -1;
+	struct tree *old = 0, *new = 0;
+	char **share = 0;
+	char dirname[PATH_MAX], pathname[PATH_MAX], parent[NAME_MAX + 1];
+	char version[NAME_MAX];
+
+	if (!strcmp("/", name) || !sandbox_exists(name, dirname)) {
+		message("sandbox %s doesn't exist\n", name);
+		goto error;
+	}
+	if (_sandbox_backend_of(name) != _sandbox_backends
+		|| _sandbox_read(name, "parent", parent, sizeof(parent)) || *parent
+	) {
+		message("only sandboxes hard linked to the base sandbox can be "
+			"rebased\n");
+		goto error;
+	}
+	snprintf(pathname, PATH_MAX, "/var/sandboxes/.%s/manifest", name);
+	if (0 > (fd = open(pathname, O_RDONLY))) {
+		message("sandbox %s doesn't know what it was built from\n", name);
+		goto error;
+	}
+	if (!(old = tree_load(fd))) { goto error; }
+
+	struct stat s, s2;
+	WARN(lstat("/", &s), "lstat");
+	if (_sandbox_version(version, 1)) { goto error; }
+	struct rules *rules = _sandbox_rules("/", _sandbox_shallow, 1);
+	if (!rules) { goto error; }
+	new = manifest_open(MANIFEST, "/", rules, s.st_dev, _sandbox_stamps);
+	rules_unref(rules);
+	if (!new) { goto error; }
+	WARN(fstat(fd, &s2), "fstat");
+	if (!lstat(MANIFEST, &s) && s.st_ino == s2.st_ino) {
+		message("sandbox %s is up to date\n", name);
+		RETURN(0);
+	}
+
+	message("rebasing sandbox %s\n", name);
+	dir_anchors(SANDBOX_ANCHORS);
+	struct sandbox_rebase r;
+	memset(&r, 0, sizeof(r));
+	r.old = old;
+	r.new = new;
+	r.share = (const char **)(share = _sandbox_share(name));
+	r.dev = new->dev[0];
+	r.prefixlen = strlen(dirname);
+	if (_sandbox_rebase_dir(&r, 0, 0, dirname, r.prefixlen)) { goto error; }
+	message("relinked %lu files, added %lu, removed %lu, "
+		"and kept %lu the sandbox changed\n",
+		r.relinked, r.added, r.removed, r.kept);
+
+	/* Remember what the sandbox was rebased onto.
+	 */
+	char tmp[PATH_MAX];
+	if (PATH_MAX <= snprintf(tmp, PATH_MAX, "%s~%d",
+		pathname, (int)getpid()
+	)) { goto error; }
+	unlink(tmp);
+	WARN(link(MANIFEST, tmp), "link");
+	if (rename(tmp, pathname)) {
+		unlink(tmp);
+		WARN(1, "rename");
+	}
+
+	result = 0;
+error:
+	if (0 <= fd) { close(fd); }
+	tree_free(old);
+	tree_free(new);
+	util_nlist_free((void **)share);
+	free(share);
+	return result;
+}
+
+/* Share the blocks of files that sandboxes copied with identical files in
+ * the base sandbox and other sandboxes.  Each sandbox is walked in turn,
+ * then each tree sandboxfs serves from its shadow directory, where files
+ * may also be hard linked since sandboxfs copies them again before they
+ * change, and then the upper layer of a sandbox kept by overlayfs.  Only
+ * one pass runs at a time.
+ */
+int sandbox_dedup() {
+	int result = -1, i, k;
+	struct journal *j = 0;
+	struct dedup *d = 0;
+	char **names = 0;
+
+	struct stat s;
+	WARN(lstat("/var/sandboxes", &s), "lstat");
+	if (!(j = journal_open(SANDBOX_DEDUP, "/var/sandboxes", "dedup"))) {
+		if (EAGAIN == errno || EACCES == errno) {
+			message("sandboxes are being deduplicated already\n");
+		}
+		goto error;
+	}
+	if (journal_resumed(j)) { message("resuming deduplication\n"); }
+	d = dedup_new(j, file_reflinkable("/var/sandboxes"));
+	if (!(names = sandbox_list())) { goto error; }
+	for (i = 0; names[i]; ++i) {
+		char dirname[PATH_MAX];
+		message("deduplicating sandbox %s\n", names[i]);
+		snprintf(dirname, PATH_MAX, "/var/sandboxes/%s", names[i]);
+		char **share = _sandbox_share(names[i]);
+		int result2 = dedup_tree(d, dirname, "/", s.st_dev, 0,
+			(const char **)share);
+		util_nlist_free((void **)share);
+		free(share);
+		if (result2) { goto error; }
+		for (k = 0; _sandbox_lazy_trees[k]; ++k) {
+			const char *tree = _sandbox_lazy_trees[k];
+			snprintf(dirname, PATH_MAX, "/var/sandboxes/.%s%s",
+				names[i], tree);
+			if (dedup_tree(d, dirname,
+				strcmp(LAZY_ROOTFS, tree) ? tree : "/", s.st_dev, 1, 0
+			)) { goto error; }
+		}
+		snprintf(dirname, PATH_MAX, "/var/sandboxes/.%s/upper", names[i]);
+		if (dedup_tree(d, dirname, "/", s.st_dev, 0, 0)) { goto error; }
+	}
+
+	struct dedup_counts c;
+	dedup_counts(d, &c);
+	message("shared %lu files by reflink and %lu by hard link, "
+		"saving %llu bytes\n", c.reflinked, c.linked, c.saved);
+	unlink(SANDBOX_DEDUP);
+
+	result = 0;
+error:
+	util_nlist_free((void **)names);
+	free(names);
+	dedup_free(d);
+	journal_close(j);
+	return result;
+}
+
+/* Set pathname to where changes to the named sandbox are journaled while
+ * they're tracked.  pathname must point to a buffer of at least PATH_MAX
+ * bytes.
+ */
+int sandbox_changes(const char *name, char *pathname) {
+	if (!sandbox_exists(name, 0)) {
+		message("sandbox %s doesn't exist\n", name);
+		return -1;
+	}
+	if (!strcmp("/", name)) { strcpy(pathname, SANDBOX_CHANGES); }
+	else { snprintf(pathname, PATH_MAX, "/var/sandboxes/.%s/changes", name); }
+	return 0;
+}
+
+/* Journal changes to the named sandbox until interrupted or terminated.
+ * Changes to the base sandbox leave out the sandboxes in it.  Sandboxes
+ * sandboxfs or overlayfs serve from elsewhere can't be tracked, and
+ * neither can the trees sandboxfs takes over in the others, whose changes
+ * are made in the shadow directory.
+ */
+int sandbox_track(const char *name) {
+	static const char *exclude[] = {"/var/sandboxes", 0};
+	char pathname[PATH_MAX], dirname[PATH_MAX];
+	if (sandbox_changes(name, pathname)) { return -1; }
+	sandbox_exists(name, dirname);
+	const struct sandbox_backend *backend = _sandbox_backend_of(name);
+	if (!backend) { return -1; }
+	if (backend->mount) {
+		message("changes to sandboxes kept by %s can't be tracked\n",
+			backend->name);
+		return -1;
+	}
+	message("tracking changes to sandbox %s\n", name);
+	if (changes_track(
+		pathname, dirname, strcmp("/", name) ? 0 : exclude
+	)) {
+		if (EAGAIN == errno || EACCES == errno) {
+			message("changes to sandbox %s are being tracked already\n",
+				name);
+		}
+		return -1;
+	}
+	return 0;
+}
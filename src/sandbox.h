@@ -5,11 +5,20 @@ int sandbox_valid(const char *name);
 int sandbox_exists(const char *name, char *pathname);
 int sandbox_breakout(char *name);
 
+void sandbox_lazy(int lazy);
+int sandbox_backend(const char *name);
+
 char **sandbox_list();
 char *sandbox_which();
 int sandbox_create(const char *name);
+int sandbox_create_many(const char **names);
 int sandbox_clone(const char *srcname, const char *destname);
+int sandbox_clone_many(const char *srcname, const char **destnames);
 int sandbox_use(const char *name, const char *command, const char *callback);
 int sandbox_destroy(const char *name);
+int sandbox_rebase(const char *name);
+int sandbox_dedup();
+int sandbox_changes(const char *name, char *pathname);
+int sandbox_track(const char *name);
 
 #endif
@@ -0,0 +1,104 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/btrfs.h>
+#include <linux/magic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* btrfs snapshots whole subvolumes, whose top directory is always this
+ * inode.  A snapshot is made in constant time, shares every extent with
+ * its source until one of them changes, and is a subvolume itself, so it
+ * can be snapshotted in turn.
+ */
+#define SNAPSHOT_INO 256
+
+/* Open the directory containing pathname and point name at its last
+ * component, which must fit in size bytes.  Returns -1, with errno set,
+ * on failure.
+ */
+static int _snapshot_parent(const char *pathname, char *name, size_t size) {
+	char dirname[PATH_MAX];
+	const char *slash = strrchr(pathname, '/');
+	if (!slash || !slash[1] || size <= strlen(&slash[1])) {
+		errno = EINVAL;
+		return -1;
+	}
+	strncpy(name, &slash[1], size);
+	if (slash == pathname) { strcpy(dirname, "/"); }
+	else if (PATH_MAX <= snprintf(dirname, PATH_MAX, "%.*s",
+		(int)(slash - pathname), pathname
+	)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/* Return non-zero if pathname is the top of a btrfs subvolume, which
+ * snapshot_make can snapshot.  (Positive logic.)
+ */
+int snapshot_capable(const char *pathname) {
+	struct statfs f;
+	struct stat s;
+	return !statfs(pathname, &f) && BTRFS_SUPER_MAGIC == f.f_type
+		&& !lstat(pathname, &s) && S_ISDIR(s.st_mode)
+		&& SNAPSHOT_INO == s.st_ino;
+}
+
+/* Make an empty subvolume at pathname.  Fails, with errno set, where
+ * there's no btrfs.
+ */
+int snapshot_subvolume(const char *pathname) {
+	struct btrfs_ioctl_vol_args args;
+	memset(&args, 0, sizeof(args));
+	int fd = _snapshot_parent(pathname, args.name, sizeof(args.name));
+	if (0 > fd) { return -1; }
+	int result = ioctl(fd, BTRFS_IOC_SUBVOL_CREATE, &args), errsv = errno;
+	close(fd);
+	errno = errsv;
+	return result;
+}
+
+/* Snapshot the subvolume at src as a new subvolume at dest, on the same
+ * filesystem.  Returns -1, with errno set, on failure.
+ */
+int snapshot_make(const char *src, const char *dest) {
+	int result = -1;
+	struct btrfs_ioctl_vol_args_v2 args;
+	memset(&args, 0, sizeof(args));
+	int fd = _snapshot_parent(dest, args.name, sizeof(args.name)), errsv;
+	if (0 > fd) { return -1; }
+	if (0 > (args.fd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC))) {
+		goto error;
+	}
+	result = ioctl(fd, BTRFS_IOC_SNAP_CREATE_V2, &args);
+error:
+	errsv = errno;
+	if (0 <= args.fd) { close(args.fd); }
+	close(fd);
+	errno = errsv;
+	return result;
+}
+
+/* Destroy the subvolume at pathname and everything in it without walking
+ * it.  Nothing may be mounted in it.  Returns -1, with errno set, on
+ * failure.
+ */
+int snapshot_destroy(const char *pathname) {
+	struct btrfs_ioctl_vol_args args;
+	memset(&args, 0, sizeof(args));
+	int fd = _snapshot_parent(pathname, args.name, sizeof(args.name));
+	if (0 > fd) { return -1; }
+	int result = ioctl(fd, BTRFS_IOC_SNAP_DESTROY, &args), errsv = errno;
+	close(fd);
+	errno = errsv;
+	return result;
+}
@@ -0,0 +1,9 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+int snapshot_capable(const char *pathname);
+int snapshot_subvolume(const char *pathname);
+int snapshot_make(const char *src, const char *dest);
+int snapshot_destroy(const char *pathname);
+
+#endif
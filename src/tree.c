@@ -0,0 +1,398 @@
+#include "dents.h"
+#include "macros.h"
+#include "rules.h"
+#include "tree.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define TREE_OPEN (O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+
+/* Every per-entry array, in the order tree_save writes them.
+ */
+#define TREE_ARRAYS(X) \
+	X(parent) X(name) X(first) X(count) X(ino) X(dev) X(size) \
+	X(mode) X(uid) X(gid) X(nlink) X(atime) X(mtime) X(ctime)
+
+/* Saved trees start with this header.  Each array follows, padded to
+ * TREE_ALIGN bytes, then the string table and the root.  Trees are only
+ * meant to be read on the machine that wrote them.
+ */
+#define TREE_MAGIC "sbxtree"
+#define TREE_VERSION 2
+#define TREE_ALIGN 8
+#define TREE_PAD(len) (((len) + TREE_ALIGN - 1) & ~(size_t)(TREE_ALIGN - 1))
+struct tree_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t timespec; /* sizeof(struct timespec) where it was written. */
+	uint32_t n, nameslen, rootlen, pad;
+};
+
+/* Start an empty tree.  Its root must be added with tree_add.
+ */
+struct tree *tree_new(const char *root) {
+	struct tree *t = (struct tree *)calloc(1, sizeof(struct tree));
+	FATAL(!t, "calloc");
+	FATAL(!(t->root = strdup(root)), "strdup");
+	t->interned = g_hash_table_new_full(g_str_hash, g_str_equal, free, 0);
+	FATAL(!t->interned, "g_hash_table_new_full");
+	return t;
+}
+
+#define TREE_GROW(field) \
+	FATAL(!(t->field = realloc(t->field, t->cap * sizeof(*t->field))), \
+		"realloc");
+
+/* Return the offset of name in the tree's string table, adding it if it
+ * isn't already there.
+ */
+static uint32_t _tree_intern(struct tree *t, const char *name) {
+	gpointer value = g_hash_table_lookup(t->interned, name);
+	if (value) { return GPOINTER_TO_UINT(value) - 1; }
+	size_t len = strlen(name) + 1;
+	if (t->nameslen + len > t->namescap) {
+		while (t->nameslen + len > t->namescap) {
+			t->namescap = t->namescap ? 2 * t->namescap : 4096;
+		}
+		FATAL(!(t->names = (char *)realloc(t->names, t->namescap)), "realloc");
+	}
+	uint32_t offset = t->nameslen;
+	memcpy(t->names + offset, name, len);
+	t->nameslen += len;
+	char *key = strdup(name);
+	FATAL(!key, "strdup");
+	g_hash_table_insert(t->interned, key, GUINT_TO_POINTER(offset + 1));
+	return offset;
+}
+
+/* Append an entry and return its index.  Entries must be added parents
+ * first and each directory's children together.
+ */
+uint32_t tree_add(
+	struct tree *t, uint32_t parent, const char *name, const struct stat *s
+) {
+	if (t->n == t->cap) {
+		t->cap = t->cap ? 2 * t->cap : 1024;
+		TREE_ARRAYS(TREE_GROW)
+	}
+	uint32_t i = t->n++;
+	t->parent[i] = t->n == 1 ? 0 : parent;
+	t->name[i] = _tree_intern(t, name);
+	t->first[i] = t->count[i] = 0;
+	t->ino[i] = s->st_ino;
+	t->dev[i] = s->st_dev;
+	t->size[i] = s->st_size;
+	t->mode[i] = s->st_mode;
+	t->uid[i] = s->st_uid;
+	t->gid[i] = s->st_gid;
+	t->nlink[i] = s->st_nlink;
+	t->atime[i] = s->st_atim;
+	t->mtime[i] = s->st_mtim;
+	t->ctime[i] = s->st_ctim;
+	return i;
+}
+
+/* Read directory i, open on fd, and then the directories within it.
+ * path is a buffer holding i's path, len bytes long, with room to append.
+ * rules, which is consumed, says what's excluded within it.  If ignore is
+ * non-zero, RULES_IGNORE files are honored.
+ */
+static int _tree_scan(
+	struct tree *t, uint32_t i, int fd, char *path, size_t len,
+	struct rules_state *rules, int ignore, dev_t dev
+) {
+	int result = -1;
+	struct dents d = {0};
+	struct rules_state **states = 0;
+	size_t j, nstates = 0;
+	WARN(dents_read(fd, &d), "getdents64");
+	if (ignore) {
+		for (j = 0; j < d.n; ++j) {
+			if (strcmp(RULES_IGNORE, d.entries[j]->name)) { continue; }
+			struct rules *r = rules_new(*path ? path : "/");
+			int result2 = rules_loadat(r, fd, RULES_IGNORE);
+			rules = rules_push(rules, r);
+			rules_unref(r);
+			if (result2) { goto error; }
+			break;
+		}
+	}
+	t->first[i] = t->n;
+	nstates = d.n + 1;
+	FATAL(!(states = (struct rules_state **)calloc(
+		nstates, sizeof(struct rules_state *)
+	)), "calloc");
+	for (j = 0; j < d.n; ++j) {
+		const char *name = d.entries[j]->name;
+		struct stat s;
+		if (dents_stat(fd, name, TREE_STATX, &s)) {
+			if (ENOENT == errno) { continue; } /* It's moved on. */
+			WARN(1, "statx");
+		}
+
+		/* Leave out whatever's excluded entirely.
+		 */
+		if (rules_match(
+			rules, name, S_ISDIR(s.st_mode), &states[t->n - t->first[i]]
+		)) { continue; }
+
+		tree_add(t, i, name, &s);
+	}
+	t->count[i] = t->n - t->first[i];
+	dents_free(&d);
+
+	/* Descend into subdirectories unless they're on another device or
+	 * sticky, in which case they're kept but left empty.
+	 */
+	uint32_t k, first = t->first[i], count = t->count[i];
+	for (k = first; k < first + count; ++k) {
+		if (!S_ISDIR(t->mode[k])) { continue; }
+		if (dev && dev != t->dev[k]) { continue; }
+		if (S_ISVTX & t->mode[k]) { continue; }
+		const char *name = tree_name(t, k);
+		size_t len2 = len + 1 + strlen(name);
+		if (PATH_MAX <= len2) { errno = ENAMETOOLONG; WARN(1, name); }
+		path[len] = '/';
+		strcpy(path + len + 1, name);
+		int fd2 = openat(fd, name, TREE_OPEN);
+		WARN(0 > fd2, "openat");
+		int result2 = _tree_scan(
+			t, k, fd2, path, len2, states[k - first], ignore, dev
+		);
+		states[k - first] = 0;
+		close(fd2);
+		path[len] = 0;
+		if (result2) { goto error; }
+	}
+
+	result = 0;
+error:
+	dents_free(&d);
+	if (states) {
+		for (j = 0; j < nstates; ++j) { rules_state_free(states[j]); }
+		free(states);
+	}
+	rules_state_free(rules);
+	return result;
+}
+
+/* Snapshot the tree rooted at root, leaving out whatever rules exclude.
+ * If dev is non-zero, directories on other devices are recorded but not
+ * read.  Returns a null pointer on failure.
+ */
+struct tree *tree_scan(const char *root, struct rules *rules, dev_t dev) {
+	struct tree *t = tree_new(root);
+	int fd = -1;
+	struct stat s;
+	char path[PATH_MAX];
+	WARN(dents_stat(AT_FDCWD, root, TREE_STATX, &s), "statx");
+	WARN(!S_ISDIR(s.st_mode), root);
+	tree_add(t, 0, "", &s);
+	WARN(0 > (fd = open(root, TREE_OPEN)), "open");
+	size_t len = strlen(root);
+	if (PATH_MAX <= len) { errno = ENAMETOOLONG; WARN(1, root); }
+	strcpy(path, root);
+	if (len && '/' == path[len - 1]) { path[--len] = 0; }
+	if (_tree_scan(
+		t, 0, fd, path, len, rules_start(rules, root), !!rules, dev
+	)) { goto error; }
+	close(fd);
+	return t;
+error:
+	if (0 <= fd) { close(fd); }
+	tree_free(t);
+	return 0;
+}
+
+#define TREE_FREE(field) free(t->field);
+void tree_free(struct tree *t) {
+	if (!t) { return; }
+	free(t->root);
+	if (t->map) { munmap(t->map, t->maplen); }
+	else {
+		TREE_ARRAYS(TREE_FREE)
+		free(t->names);
+	}
+	if (t->interned) { g_hash_table_destroy(t->interned); }
+	free(t);
+}
+
+/* Write len bytes and then zeros up to the next TREE_ALIGN boundary.
+ */
+static int _tree_write(int fd, const void *buf, size_t len) {
+	static const char zeros[TREE_ALIGN] = {0};
+	const char *p = (const char *)buf;
+	size_t pad = TREE_PAD(len) - len;
+	while (len || pad) {
+		if (!len) {
+			p = zeros;
+			len = pad;
+			pad = 0;
+		}
+		ssize_t w = write(fd, p, len);
+		if (0 > w) {
+			if (EINTR == errno) { continue; }
+			goto error;
+		}
+		p += w;
+		len -= w;
+	}
+	return 0;
+error:
+	return -1;
+}
+
+/* Save a tree to fd so tree_load can map it back in later.
+ */
+#define TREE_SAVE(field) \
+	if (_tree_write(fd, t->field, t->n * sizeof(*t->field))) { goto error; }
+int tree_save(const struct tree *t, int fd) {
+	struct tree_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TREE_MAGIC, sizeof(h.magic));
+	h.version = TREE_VERSION;
+	h.timespec = sizeof(struct timespec);
+	h.n = t->n;
+	h.nameslen = t->nameslen;
+	h.rootlen = strlen(t->root);
+	WARN(_tree_write(fd, &h, sizeof(h)), "write");
+	TREE_ARRAYS(TREE_SAVE)
+	WARN(_tree_write(fd, t->names, t->nameslen), "write");
+	WARN(_tree_write(fd, t->root, h.rootlen + 1), "write");
+	return 0;
+error:
+	return -1;
+}
+
+/* Return non-zero if every index in the tree is in bounds and it's shaped
+ * as tree_add builds it: each entry comes after its parent and each
+ * directory's children come together after it and name it as their
+ * parent, so walking it always ends.  (Positive logic.)
+ */
+static int _tree_valid(const struct tree *t) {
+	uint32_t i, j;
+	if (!t->nameslen || t->names[t->nameslen - 1] || t->parent[0]) {
+		return 0;
+	}
+	for (i = 0; i < t->n; ++i) {
+		if (t->name[i] >= t->nameslen || (i && t->parent[i] >= i)) {
+			return 0;
+		}
+		if (!t->count[i]) { continue; }
+		if (!S_ISDIR(t->mode[i]) || t->first[i] <= i
+			|| (uint64_t)t->first[i] + t->count[i] > t->n
+		) { return 0; }
+		for (j = t->first[i]; j < t->first[i] + t->count[i]; ++j) {
+			if (t->parent[j] != i) { return 0; }
+		}
+	}
+	return 1;
+}
+
+/* Map a tree saved by tree_save.  Nothing is copied up front, and only
+ * the indices are read, to check them, so a corrupt or truncated file
+ * can't send anyone outside the map.  Returns a null pointer, with errno
+ * set to EINVAL if the file isn't a tree, on failure.
+ */
+#define TREE_SIZE(field) len += TREE_PAD(h->n * sizeof(*t->field));
+#define TREE_LOAD(field) \
+	t->field = (void *)p; \
+	p += TREE_PAD(h->n * sizeof(*t->field));
+struct tree *tree_load(int fd) {
+	struct tree *t = (struct tree *)calloc(1, sizeof(struct tree));
+	FATAL(!t, "calloc");
+	struct stat s;
+	WARN(fstat(fd, &s), "fstat");
+	if ((size_t)s.st_size < sizeof(struct tree_header)) {
+		errno = EINVAL;
+		goto error;
+	}
+	t->maplen = s.st_size;
+	t->map = mmap(0, t->maplen, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	if (MAP_FAILED == t->map) {
+		t->map = 0;
+		WARN(1, "mmap");
+	}
+	const struct tree_header *h = (const struct tree_header *)t->map;
+	size_t len = sizeof(struct tree_header);
+	TREE_ARRAYS(TREE_SIZE)
+	len += TREE_PAD(h->nameslen) + TREE_PAD(h->rootlen + 1);
+	if (memcmp(TREE_MAGIC, h->magic, sizeof(h->magic))
+		|| TREE_VERSION != h->version
+		|| sizeof(struct timespec) != h->timespec
+		|| !h->n
+		|| t->maplen != len
+	) {
+		errno = EINVAL;
+		goto error;
+	}
+	char *p = (char *)t->map + sizeof(struct tree_header);
+	t->n = t->cap = h->n;
+	TREE_ARRAYS(TREE_LOAD)
+	t->names = p;
+	t->nameslen = t->namescap = h->nameslen;
+	p += TREE_PAD(h->nameslen);
+	if (p[h->rootlen]) {
+		errno = EINVAL;
+		goto error;
+	}
+	FATAL(!(t->root = strdup(p)), "strdup");
+	if (!_tree_valid(t)) {
+		errno = EINVAL;
+		goto error;
+	}
+	return t;
+error:
+	tree_free(t);
+	return 0;
+}
+
+const char *tree_name(const struct tree *t, uint32_t i) {
+	return t->names + t->name[i];
+}
+
+/* Return the whole path of entry i, which the caller must free.
+ */
+char *tree_path(const struct tree *t, uint32_t i) {
+	size_t len = strlen(t->root);
+	if (i && len && '/' == t->root[len - 1]) { --len; }
+	uint32_t j;
+	for (j = i; j; j = t->parent[j]) { len += 1 + strlen(tree_name(t, j)); }
+	char *path = (char *)malloc(len + 1);
+	FATAL(!path, "malloc");
+	path[len] = 0;
+	for (j = i; j; j = t->parent[j]) {
+		const char *name = tree_name(t, j);
+		size_t len2 = strlen(name);
+		len -= len2;
+		memcpy(path + len, name, len2);
+		path[--len] = '/';
+	}
+	memcpy(path, t->root, len);
+	return path;
+}
+
+/* Fill in what the tree knows about entry i (see TREE_STATX).
+ */
+void tree_stat(const struct tree *t, uint32_t i, struct stat *s) {
+	memset(s, 0, sizeof(struct stat));
+	s->st_ino = t->ino[i];
+	s->st_dev = t->dev[i];
+	s->st_size = t->size[i];
+	s->st_mode = t->mode[i];
+	s->st_uid = t->uid[i];
+	s->st_gid = t->gid[i];
+	s->st_nlink = t->nlink[i];
+	s->st_atim = t->atime[i];
+	s->st_mtim = t->mtime[i];
+	s->st_ctim = t->ctime[i];
+}
@@ -0,0 +1,57 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <glib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct rules;
+
+/* The STATX_* fields a tree records for each entry.  The device is always
+ * recorded, too.
+ */
+#define TREE_STATX (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID \
+	| STATX_GID | STATX_ATIME | STATX_MTIME | STATX_CTIME | STATX_INO \
+	| STATX_SIZE)
+
+/* A snapshot of a directory tree as parallel arrays indexed by entry.
+ * Entry 0 is the root.  The children of a directory are contiguous and
+ * come after it, so one pass in index order sees every parent before its
+ * children.  Directories that weren't read (excluded or on another device)
+ * have no children.  Neither do shared scratch directories like /tmp,
+ * which are marked sticky and change too often to be worth recording;
+ * walkers read them as they go.  Trees read by tree_load are mapped from their file and
+ * can't be added to.
+ */
+struct tree {
+	char *root;              /* Path of entry 0. */
+	uint32_t n, cap;
+	uint32_t *parent;        /* The root is its own parent. */
+	uint32_t *name;          /* Offset of the interned basename in names. */
+	uint32_t *first, *count; /* Children of directories. */
+	uint64_t *ino, *dev, *size;
+	uint32_t *mode, *uid, *gid, *nlink;
+	struct timespec *atime, *mtime, *ctime;
+	char *names;
+	uint32_t nameslen, namescap;
+	GHashTable *interned;    /* Basenames to offsets plus one. */
+	void *map;               /* The file the arrays point into, if any. */
+	size_t maplen;
+};
+
+struct tree *tree_new(const char *root);
+uint32_t tree_add(
+	struct tree *t, uint32_t parent, const char *name, const struct stat *s
+);
+struct tree *tree_scan(const char *root, struct rules *rules, dev_t dev);
+void tree_free(struct tree *t);
+int tree_save(const struct tree *t, int fd);
+struct tree *tree_load(int fd);
+
+const char *tree_name(const struct tree *t, uint32_t i);
+char *tree_path(const struct tree *t, uint32_t i);
+void tree_stat(const struct tree *t, uint32_t i, struct stat *s);
+
+#endif
@@ -0,0 +1,282 @@
+#include "macros.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Submission queue depth.  Each thread's ring is flushed whenever it
+ * fills, so this bounds how many operations are in flight at once.
+ */
+#define URING_ENTRIES 256
+
+/* A queued linkat(2), kept until it's reaped so a failure can be retried.
+ */
+struct uring_op {
+	const char *m; /* What to report failures under, empty to fail quietly. */
+	int fd1, fd2;
+	const char *name1, *name2;
+	int(*retry)(int fd1, const char *name1, int fd2, const char *name2);
+};
+
+/* The parts of a ring's shared memory we need, mapped with io_uring_setup's
+ * offsets.
+ */
+struct uring {
+	int fd;
+	void *sq, *cq;
+	size_t sqlen, cqlen;
+	struct io_uring_sqe *sqes;
+	size_t sqeslen;
+	unsigned int *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned int *cqhead, *cqtail, *cqmask;
+	struct io_uring_cqe *cqes;
+	unsigned int queued; /* Submitted but not yet reaped. */
+	unsigned int pending; /* Filled in but not yet submitted. */
+	int result;
+	struct uring_op ops[URING_ENTRIES];
+	unsigned int nops; /* Ops in use since everything was last reaped. */
+};
+
+/* Each thread batches into its own ring.  Once setup fails (old kernel,
+ * seccomp, or a container that forbids it) everyone stops trying.
+ */
+static __thread struct uring *_uring_self = 0;
+static int _uring_disabled = 0;
+
+static int _uring_setup(unsigned int entries, struct io_uring_params *p) {
+	return (int)syscall(SYS_io_uring_setup, entries, p);
+}
+static int _uring_enter(
+	int fd, unsigned int submit, unsigned int wait, unsigned int flags
+) {
+	return (int)syscall(SYS_io_uring_enter, fd, submit, wait, flags, 0, 0);
+}
+
+static void _uring_free(struct uring *u) {
+	if (u->sqes) { munmap(u->sqes, u->sqeslen); }
+	if (u->cq && u->cq != u->sq) { munmap(u->cq, u->cqlen); }
+	if (u->sq) { munmap(u->sq, u->sqlen); }
+	if (0 <= u->fd) { close(u->fd); }
+	free(u);
+}
+
+/* A forked child shares its parent's rings, so it must never touch the
+ * one that belonged to the thread that forked.
+ */
+static void _uring_forget() {
+	if (_uring_self) { _uring_free(_uring_self); }
+	_uring_self = 0;
+}
+
+/* Return this thread's ring, setting it up on first use, or a null pointer
+ * if io_uring isn't available.
+ */
+static struct uring *_uring() {
+	if (_uring_self) { return _uring_self; }
+	if (_uring_disabled) { return 0; }
+	struct uring *u = (struct uring *)calloc(1, sizeof(struct uring));
+	FATAL(!u, "calloc");
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(struct io_uring_params));
+	if (0 > (u->fd = _uring_setup(URING_ENTRIES, &p))) { goto error; }
+
+	u->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP && u->cqlen > u->sqlen) {
+		u->sqlen = u->cqlen;
+	}
+	u->sq = mmap(0, u->sqlen, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == u->sq) { u->sq = 0; goto error; }
+	if (p.features & IORING_FEAT_SINGLE_MMAP) { u->cq = u->sq; }
+	else {
+		u->cq = mmap(0, u->cqlen, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (MAP_FAILED == u->cq) { u->cq = 0; goto error; }
+	}
+	u->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = (struct io_uring_sqe *)mmap(0, u->sqeslen,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		u->fd, IORING_OFF_SQES);
+	if (MAP_FAILED == u->sqes) { u->sqes = 0; goto error; }
+	u->sqhead = (unsigned int *)((char *)u->sq + p.sq_off.head);
+	u->sqtail = (unsigned int *)((char *)u->sq + p.sq_off.tail);
+	u->sqmask = (unsigned int *)((char *)u->sq + p.sq_off.ring_mask);
+	u->sqarray = (unsigned int *)((char *)u->sq + p.sq_off.array);
+	u->cqhead = (unsigned int *)((char *)u->cq + p.cq_off.head);
+	u->cqtail = (unsigned int *)((char *)u->cq + p.cq_off.tail);
+	u->cqmask = (unsigned int *)((char *)u->cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq + p.cq_off.cqes);
+
+	/* The ring is only worth having if it supports linkat (Linux 5.15 and
+	 * later).  Probe by linking nothing to nothing; kernels that don't know
+	 * the opcode answer EINVAL rather than ENOENT.
+	 */
+	_uring_self = u;
+	uring_linkat(AT_FDCWD, "", AT_FDCWD, "", 0, 0);
+	if (uring_flush() && ENOENT != errno) { _uring_self = 0; goto error; }
+
+	static int atfork = 0;
+	if (!__sync_lock_test_and_set(&atfork, 1)) {
+		pthread_atfork(0, 0, _uring_forget);
+	}
+	return u;
+
+error:
+	_uring_disabled = 1;
+	_uring_free(u);
+	return 0;
+}
+
+/* Submit everything filled in so far, waiting for at least wait
+ * completions.
+ */
+static int _uring_submit(struct uring *u, unsigned int wait) {
+	while (u->pending || wait) {
+		int n = _uring_enter(
+			u->fd, u->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0
+		);
+		if (0 > n) {
+			if (EINTR == errno) { continue; }
+			return -1;
+		}
+		u->pending -= n;
+		u->queued += n;
+		break;
+	}
+	return 0;
+}
+
+/* Reap every completion that's arrived.  Failures are reported as they
+ * would have been by the synchronous call.
+ */
+static void _uring_reap(struct uring *u) {
+	unsigned int head = *u->cqhead;
+	unsigned int tail = __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cqmask];
+		if (0 > cqe->res) {
+			errno = -cqe->res;
+
+			/* Each operation carries what to do about its failure.
+			 */
+			struct uring_op *op =
+				(struct uring_op *)(unsigned long)cqe->user_data;
+			if (*op->m && op->retry) {
+				if (op->retry(op->fd1, op->name1, op->fd2, op->name2)) {
+					u->result = -1;
+				}
+			}
+			else {
+				if (*op->m) { perror(op->m); }
+				u->result = -1;
+			}
+		}
+		--u->queued;
+	}
+	__atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+}
+
+/* Wait for everything queued so far.
+ */
+static int _uring_wait(struct uring *u) {
+	if (_uring_submit(u, u->queued + u->pending)) { return -1; }
+	while (u->queued) {
+		_uring_reap(u);
+		if (u->queued && _uring_submit(u, u->queued)) { return -1; }
+	}
+	u->nops = 0;
+	return 0;
+}
+
+/* Return a cleared submission queue entry, making room by waiting for
+ * everything already queued if necessary.  It's queued by _uring_push.
+ */
+static struct io_uring_sqe *_uring_sqe(struct uring *u) {
+	unsigned int tail = *u->sqtail;
+	if (tail - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE) > *u->sqmask) {
+		if (_uring_submit(u, u->queued + u->pending)) {
+			perror("io_uring_enter");
+			return 0;
+		}
+		_uring_reap(u);
+		tail = *u->sqtail;
+	}
+	struct io_uring_sqe *sqe = &u->sqes[tail & *u->sqmask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+static void _uring_push(struct uring *u) {
+	unsigned int tail = *u->sqtail;
+	u->sqarray[tail & *u->sqmask] = tail & *u->sqmask;
+	__atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+	++u->pending;
+}
+
+/* Queue a linkat(2).  Names and descriptors must remain valid until the
+ * next uring_flush.  Without io_uring this is just linkat.  If retry isn't
+ * null, a link that fails is handed to it, with errno set, instead of
+ * being reported, and it fails only if retry does.  Returns zero on
+ * success, which for queued operations only means they were queued.
+ */
+int uring_linkat(
+	int fd1, const char *name1, int fd2, const char *name2, int flags,
+	int(*retry)(int fd1, const char *name1, int fd2, const char *name2)
+) {
+	int result = -1;
+	struct uring *u = _uring();
+	if (!u) {
+		if (!linkat(fd1, name1, fd2, name2, flags)) { return 0; }
+		if (retry) { return retry(fd1, name1, fd2, name2); }
+		WARN(1, "linkat");
+	}
+
+	/* Make room to remember the link, which is needed until it's reaped.
+	 */
+	if (URING_ENTRIES == u->nops) {
+		WARN(_uring_wait(u), "io_uring_enter");
+	}
+	struct io_uring_sqe *sqe = _uring_sqe(u);
+	if (!sqe) { goto error; }
+	struct uring_op *op = &u->ops[u->nops++];
+	op->m = *name1 ? "linkat" : ""; /* "" probes. */
+	op->fd1 = fd1;
+	op->name1 = name1;
+	op->fd2 = fd2;
+	op->name2 = name2;
+	op->retry = retry;
+	sqe->opcode = IORING_OP_LINKAT;
+	sqe->fd = fd1;
+	sqe->addr = (unsigned long)name1;
+	sqe->len = fd2;
+	sqe->addr2 = (unsigned long)name2;
+	sqe->hardlink_flags = flags;
+	sqe->user_data = (unsigned long)op;
+	_uring_push(u);
+	result = 0;
+
+error:
+	return result;
+}
+
+/* Wait for everything this thread has queued.  Returns zero if it all
+ * succeeded; failures have already been reported.
+ */
+int uring_flush() {
+	int result = -1;
+	struct uring *u = _uring_self;
+	if (!u) { return 0; }
+	WARN(_uring_wait(u), "io_uring_enter");
+	result = u->result;
+	u->result = 0;
+
+error:
+	return result;
+}
@@ -0,0 +1,10 @@
+#ifndef URING_H
+#define URING_H
+
+int uring_linkat(
+	int fd1, const char *name1, int fd2, const char *name2, int flags,
+	int(*retry)(int fd1, const char *name1, int fd2, const char *name2)
+);
+int uring_flush();
+
+#endif